@@ -23,8 +23,6 @@
 #include "core.h"
 #include "settings.h"
 
-FILE *ndsRomFile;
-
 Cartridge::~Cartridge()
 {
     // Write the save before exiting
@@ -32,6 +30,7 @@ Cartridge::~Cartridge()
 
     // Free the ROM and save memory
     if (ndsRomFile)  fclose(ndsRomFile);
+    if (ndsRom && !ndsRomShared) delete[] ndsRom;
     if (ndsSave) delete[] ndsSave;
     if (gbaRom)  delete[] gbaRom;
     if (gbaSave) delete[] gbaSave;
@@ -56,9 +55,19 @@ void Cartridge::loadNdsRom(std::string path)
 
     //WriteLog("Done");
 
-    // Attempt to load the ROM's save file
     ndsSaveName = path.substr(0, path.rfind(".")) + ".sav";
-    FILE *ndsSaveFile = fopen(ndsSaveName.c_str(), "rb");
+    loadNdsSave();
+}
+
+void Cartridge::loadNdsSave()
+{
+    // Throw away the current save, in case it was replaced by a state
+    if (ndsSave) delete[] ndsSave;
+    ndsSave = nullptr;
+    ndsSaveDirty = false;
+
+    // Attempt to load the ROM's save file
+    FILE *ndsSaveFile = (ndsSaveName != "") ? fopen(ndsSaveName.c_str(), "rb") : nullptr;
     if (ndsSaveFile)
     {
         fseek(ndsSaveFile, 0, SEEK_END);
@@ -75,7 +84,51 @@ void Cartridge::loadNdsRom(std::string path)
         ndsSave = new uint8_t[ndsSaveSize];
         memset(ndsSave, 0xFF, ndsSaveSize * sizeof(uint8_t));
     }
+}
+
+void Cartridge::loadNdsRom(const uint8_t *data, int size, bool copy)
+{
+    // Load an NDS ROM from a buffer, keeping a copy so ROM reads don't have to go through a file
+    // Without a copy the buffer is only read from, so several cores can share one that outlives them
+    ndsRomName = "";
+    if (copy)
+    {
+        uint8_t *rom = new uint8_t[size];
+        memcpy(rom, data, size);
+        ndsRom = rom;
+    }
+    else
+    {
+        ndsRom = data;
+    }
+    ndsRomShared = !copy;
+    ndsRomSize = size;
+
+    memset(RomHeader, 0, sizeof(RomHeader));
+    memset(SecureArea, 0, sizeof(SecureArea));
+    readNdsRom(0, RomHeader, 0x1000);
+    readNdsRom(0x4000, SecureArea, 0x800);
+
+    // There's no file to keep a save next to, so start with a blank save that is never written back
+    ndsSaveName = "";
+    loadNdsSave();
+}
 
+void Cartridge::readNdsRom(uint32_t address, uint8_t *data, int size)
+{
+    if (ndsRom)
+    {
+        // Copy from the ROM buffer, leaving anything past the end of the ROM untouched
+        if (address >= (uint32_t)ndsRomSize) return;
+        if (size > ndsRomSize - (int)address) size = ndsRomSize - address;
+        memcpy(data, &ndsRom[address], size);
+    }
+    else
+    {
+        // Read from the ROM file
+        fseek(ndsRomFile, address, SEEK_SET);
+        fread(data, sizeof(uint8_t), size, ndsRomFile);
+    }
 }
 
 void Cartridge::loadGbaRom(std::string path)
@@ -202,25 +255,18 @@ void Cartridge::directBoot()
     for (uint32_t i = 0; i < 0x170; i++)
         core->memory.write<uint8_t>(0, 0x27FFE00 + i, RomHeader[i]);
     
-    fseek(ndsRomFile, offset9, SEEK_SET);
-
     // Load the initial ARM9 code into memory
     for (uint32_t i = 0; i < size9; i++){
-        fread(&data, sizeof(uint8_t), 1, ndsRomFile);
+        readNdsRom(offset9 + i, &data, 1);
         core->memory.write<uint8_t>(0, ramAddr9 + i, data);
     }
 
-    fseek(ndsRomFile, 0, SEEK_SET);
-    fseek(ndsRomFile, offset7, SEEK_SET);
-
     // Load the initial ARM7 code into memory
     for (uint32_t i = 0; i < size7; i++){
-        fread(&data, sizeof(uint8_t), 1, ndsRomFile);
+        readNdsRom(offset7 + i, &data, 1);
         core->memory.write<uint8_t>(1, ramAddr7 + i, data);
     }
 
-    fseek(ndsRomFile, 0, SEEK_SET);
-
 }
 
 void Cartridge::writeSave()
@@ -708,7 +754,7 @@ void Cartridge::writeRomCtrl(bool cpu, uint32_t mask, uint32_t value)
     }
 
     // Handle encryption commands
-    if (ndsRomFile)
+    if (ndsRomFile || ndsRom)
     {
         if ((command[cpu] >> 56) == 0x3C) // Activate KEY1 encryption mode
         {
@@ -757,7 +803,7 @@ uint32_t Cartridge::readRomDataIn(bool cpu)
     // Endless 0xFFs are returned on a dummy command or when no cart is inserted
     uint32_t value = 0xFFFFFFFF;
 
-    if (ndsRomFile)
+    if (ndsRomFile || ndsRom)
     {
         // Interpret the current ROM command
         if (command[cpu] == 0x0000000000000000) // Get header
@@ -831,8 +877,7 @@ uint32_t Cartridge::readRomDataIn(bool cpu)
                 
                // last_addrRead = addr_tot + (dataBlockSZ);
 
-                fseek(ndsRomFile,addr_tot,SEEK_SET);
-                fread(&ROMdata,sizeof(uint32_t),1,ndsRomFile);
+                readNdsRom(addr_tot, (uint8_t*)&ROMdata, sizeof(uint32_t));
 
               //  read_status_index = 0;
             }
@@ -869,4 +914,69 @@ uint32_t Cartridge::readRomDataIn(bool cpu)
     }
 
     return value;
-}
\ No newline at end of file
+}
+void Cartridge::saveState(FILE *file)
+{
+    // Write the state to a file
+    // The ROM isn't included, so a state can only be loaded into a core running the same ROM
+    fwrite(&ndsSaveSize, sizeof(ndsSaveSize), 1, file);
+    if (ndsSaveSize > 0)
+        fwrite(ndsSave, sizeof(uint8_t), ndsSaveSize, file);
+    fwrite(&ndsSaveDirty, sizeof(ndsSaveDirty), 1, file);
+    fwrite(&gbaEepromCount, sizeof(gbaEepromCount), 1, file);
+    fwrite(&gbaEepromCmd, sizeof(gbaEepromCmd), 1, file);
+    fwrite(&gbaEepromData, sizeof(gbaEepromData), 1, file);
+    fwrite(&gbaEepromDone, sizeof(gbaEepromDone), 1, file);
+    fwrite(&gbaFlashCmd, sizeof(gbaFlashCmd), 1, file);
+    fwrite(&gbaBankSwap, sizeof(gbaBankSwap), 1, file);
+    fwrite(&gbaFlashErase, sizeof(gbaFlashErase), 1, file);
+    fwrite(encTable, sizeof(encTable), 1, file);
+    fwrite(encCode, sizeof(encCode), 1, file);
+    fwrite(command, sizeof(command), 1, file);
+    fwrite(blockSize, sizeof(blockSize), 1, file);
+    fwrite(readCount, sizeof(readCount), 1, file);
+    fwrite(encrypted, sizeof(encrypted), 1, file);
+    fwrite(auxCommand, sizeof(auxCommand), 1, file);
+    fwrite(auxAddress, sizeof(auxAddress), 1, file);
+    fwrite(auxWriteCount, sizeof(auxWriteCount), 1, file);
+    fwrite(auxSpiCnt, sizeof(auxSpiCnt), 1, file);
+    fwrite(auxSpiData, sizeof(auxSpiData), 1, file);
+    fwrite(romCtrl, sizeof(romCtrl), 1, file);
+    fwrite(romCmdOut, sizeof(romCmdOut), 1, file);
+}
+
+void Cartridge::loadState(FILE *file)
+{
+    // Read the state from a file, resizing the save if the state used a different size
+    int size = 0;
+    fread(&size, sizeof(size), 1, file);
+    if (size != ndsSaveSize)
+    {
+        if (ndsSave) delete[] ndsSave;
+        ndsSave = (size > 0) ? new uint8_t[size] : nullptr;
+        ndsSaveSize = size;
+    }
+    if (ndsSaveSize > 0)
+        fread(ndsSave, sizeof(uint8_t), ndsSaveSize, file);
+    fread(&ndsSaveDirty, sizeof(ndsSaveDirty), 1, file);
+    fread(&gbaEepromCount, sizeof(gbaEepromCount), 1, file);
+    fread(&gbaEepromCmd, sizeof(gbaEepromCmd), 1, file);
+    fread(&gbaEepromData, sizeof(gbaEepromData), 1, file);
+    fread(&gbaEepromDone, sizeof(gbaEepromDone), 1, file);
+    fread(&gbaFlashCmd, sizeof(gbaFlashCmd), 1, file);
+    fread(&gbaBankSwap, sizeof(gbaBankSwap), 1, file);
+    fread(&gbaFlashErase, sizeof(gbaFlashErase), 1, file);
+    fread(encTable, sizeof(encTable), 1, file);
+    fread(encCode, sizeof(encCode), 1, file);
+    fread(command, sizeof(command), 1, file);
+    fread(blockSize, sizeof(blockSize), 1, file);
+    fread(readCount, sizeof(readCount), 1, file);
+    fread(encrypted, sizeof(encrypted), 1, file);
+    fread(auxCommand, sizeof(auxCommand), 1, file);
+    fread(auxAddress, sizeof(auxAddress), 1, file);
+    fread(auxWriteCount, sizeof(auxWriteCount), 1, file);
+    fread(auxSpiCnt, sizeof(auxSpiCnt), 1, file);
+    fread(auxSpiData, sizeof(auxSpiData), 1, file);
+    fread(romCtrl, sizeof(romCtrl), 1, file);
+    fread(romCmdOut, sizeof(romCmdOut), 1, file);
+}
@@ -21,6 +21,7 @@
 #define CARTRIDGE_H
 
 #include <cstdint>
+#include <cstdio>
 #include <string>
 
 class Core;
@@ -31,7 +32,12 @@ class Cartridge
         Cartridge(Core *core): core(core) {}
         ~Cartridge();
 
+        void saveState(FILE *file);
+        void loadState(FILE *file);
+
         void loadNdsRom(std::string path);
+        void loadNdsRom(const uint8_t *data, int size, bool copy = true);
+        void loadNdsSave();
         void loadGbaRom(std::string path);
         void directBoot();
         void writeSave();
@@ -43,6 +49,7 @@ class Cartridge
         void resizeGbaSave(int newSize) { resizeSave(newSize, &gbaSave, &gbaSaveSize, &gbaSaveDirty); }
 
         int getNdsRomSize()  { return ndsRomSize;  }
+        uint8_t *getNdsHeader() { return RomHeader; }
         int getNdsSaveSize() { return ndsSaveSize; }
 
         int getGbaRomSize()  { return gbaRomSize;  }
@@ -80,6 +87,9 @@ class Cartridge
         bool gbaSaveDirty = false;
 
         std::string ndsRomName, ndsSaveName;
+        FILE *ndsRomFile = nullptr;
+        const uint8_t *ndsRom = nullptr;
+        bool ndsRomShared = false;
         uint8_t RomHeader[0x1000], SecureArea[0x800], *ndsSave = nullptr;
         int ndsRomSize = 0, ndsSaveSize = 0;
         bool ndsSaveDirty = false;
@@ -109,6 +119,8 @@ class Cartridge
         uint32_t romCtrl[2] = {};
         uint64_t romCmdOut[2] = {};
 
+        void readNdsRom(uint32_t address, uint8_t *data, int size);
+
         static void trimRom(uint8_t **rom, int *romSize, std::string *romName);
         static void resizeSave(int newSize, uint8_t **save, int *saveSize, bool *saveDirty);
 
@@ -17,14 +17,20 @@
     along with NooDS. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cstring>
 
+#ifdef PSP
 #include <pspkernel.h>
+#endif
 
 #include "core.h"
 #include "settings.h"
+
+#ifdef PSP
 #include "melib.h"
 #include "psp/GPU/draw.h"
+#endif
 
 Core * exCore;
 
@@ -33,8 +39,9 @@ Core::Core(std::string ndsPath, std::string gbaPath):
     Gpu2D(this, 1) }, gpu3D(this), gpu3DRenderer(this), input(this), interpreter { Interpreter(this, 0), Interpreter(this, 1) },
     ipc(this), memory(this), rtc(this), spi(this), spu(this), timers { Timers(this, 0), Timers(this, 1) }, wifi(this)
 {
-
+#ifdef PSP
     J_Init(false);
+#endif
 
     exCore = this;
 
@@ -49,39 +56,172 @@ Core::Core(std::string ndsPath, std::string gbaPath):
     {
         // Load an NDS ROM
         cartridge.loadNdsRom(ndsPath);
-        
+
         // Prepare to boot the NDS ROM directly if direct boot is enabled
         if (Settings::getDirectBoot())
+            directBootNds();
+
+        // Skip the firmware boot if there's a snapshot of it from an earlier launch
+        // Direct boot is already faster than reading a snapshot back, so it doesn't use one
+        if (Settings::getFastBoot() && !Settings::getDirectBoot() && cartridge.getNdsRomSize() > 0)
         {
-            // Set some registers as the BIOS/firmware would
-            cp15.write(1, 0, 0, 0x0005707D); // CP15 Control
-            cp15.write(9, 1, 0, 0x0300000A); // Data TCM base/size
-            cp15.write(9, 1, 1, 0x00000020); // Instruction TCM size
-            memory.write<uint8_t>(0,  0x4000247,   0x03); // WRAMCNT
-            memory.write<uint8_t>(0,  0x4000300,   0x01); // POSTFLG (ARM9)
-            memory.write<uint8_t>(1,  0x4000300,   0x01); // POSTFLG (ARM7)
-            memory.write<uint16_t>(0, 0x4000304, 0x0001); // POWCNT1
-            memory.write<uint16_t>(1, 0x4000504, 0x0200); // SOUNDBIAS
-
-            // Set some memory values as the BIOS/firmware would
-            memory.write<uint32_t>(0, 0x27FF800, 0x00001FC2); // Chip ID 1
-            memory.write<uint32_t>(0, 0x27FF804, 0x00001FC2); // Chip ID 2
-            memory.write<uint16_t>(0, 0x27FF850,     0x5835); // ARM7 BIOS CRC
-            memory.write<uint16_t>(0, 0x27FF880,     0x0007); // Message from ARM9 to ARM7
-            memory.write<uint16_t>(0, 0x27FF884,     0x0006); // ARM7 boot task
-            memory.write<uint32_t>(0, 0x27FFC00, 0x00001FC2); // Copy of chip ID 1
-            memory.write<uint32_t>(0, 0x27FFC04, 0x00001FC2); // Copy of chip ID 2
-            memory.write<uint16_t>(0, 0x27FFC10,     0x5835); // Copy of ARM7 BIOS CRC
-            memory.write<uint16_t>(0, 0x27FFC40,     0x0001); // Boot indicator
-
-            cartridge.directBoot();
-            interpreter[0].directBoot();
-            interpreter[1].directBoot();
-            spi.directBoot();
+            // Otherwise take one once the firmware has started the ROM
+            bootStatePath = ndsPath.substr(0, ndsPath.rfind(".")) + ".boot";
+            if (!loadBootState())
+                bootFrames = 600;
         }
     }
 }
 
+Core::Core(const uint8_t *ndsRom, int ndsRomSize, const uint8_t *bios9, const uint8_t *bios7, const uint8_t *firmware, bool copyRom):
+    Core()
+{
+    // Replace the BIOS and firmware loaded from files with the given buffers
+    if (bios9 && bios7) memory.loadBios(bios9, bios7);
+    if (firmware) spi.loadFirmware(firmware);
+
+    // Load an NDS ROM from memory
+    cartridge.loadNdsRom(ndsRom, ndsRomSize, copyRom);
+
+    // Prepare to boot the NDS ROM directly if direct boot is enabled
+    if (Settings::getDirectBoot())
+        directBootNds();
+}
+
+void Core::directBootNds()
+{
+    // Set some registers as the BIOS/firmware would
+    cp15.write(1, 0, 0, 0x0005707D); // CP15 Control
+    cp15.write(9, 1, 0, 0x0300000A); // Data TCM base/size
+    cp15.write(9, 1, 1, 0x00000020); // Instruction TCM size
+    memory.write<uint8_t>(0,  0x4000247,   0x03); // WRAMCNT
+    memory.write<uint8_t>(0,  0x4000300,   0x01); // POSTFLG (ARM9)
+    memory.write<uint8_t>(1,  0x4000300,   0x01); // POSTFLG (ARM7)
+    memory.write<uint16_t>(0, 0x4000304, 0x0001); // POWCNT1
+    memory.write<uint16_t>(1, 0x4000504, 0x0200); // SOUNDBIAS
+
+    // Set some memory values as the BIOS/firmware would
+    memory.write<uint32_t>(0, 0x27FF800, 0x00001FC2); // Chip ID 1
+    memory.write<uint32_t>(0, 0x27FF804, 0x00001FC2); // Chip ID 2
+    memory.write<uint16_t>(0, 0x27FF850,     0x5835); // ARM7 BIOS CRC
+    memory.write<uint16_t>(0, 0x27FF880,     0x0007); // Message from ARM9 to ARM7
+    memory.write<uint16_t>(0, 0x27FF884,     0x0006); // ARM7 boot task
+    memory.write<uint32_t>(0, 0x27FFC00, 0x00001FC2); // Copy of chip ID 1
+    memory.write<uint32_t>(0, 0x27FFC04, 0x00001FC2); // Copy of chip ID 2
+    memory.write<uint16_t>(0, 0x27FFC10,     0x5835); // Copy of ARM7 BIOS CRC
+    memory.write<uint16_t>(0, 0x27FFC40,     0x0001); // Boot indicator
+
+    cartridge.directBoot();
+    interpreter[0].directBoot();
+    interpreter[1].directBoot();
+    spi.directBoot();
+}
+
+static uint32_t crc32(const uint8_t *data, int size)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (int i = 0; i < size; i++)
+    {
+        crc ^= data[i];
+        for (int j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+    }
+    return ~crc;
+}
+
+static const uint32_t bootMagic = 0x4253444E; // "NDSB"
+
+void Core::getBootKey(uint32_t *key)
+{
+    // A boot snapshot is only valid for the same ROM header, BIOS and firmware
+    key[0] = crc32(cartridge.getNdsHeader(), 0x200);
+    key[1] = crc32(memory.getBios9(), 0x1000);
+    key[2] = crc32(memory.getBios7(), 0x4000);
+    key[3] = crc32(spi.getFirmware(), 0x40000);
+}
+
+bool Core::loadBootState()
+{
+    FILE *file = fopen(bootStatePath.c_str(), "rb");
+    if (!file) return false;
+
+    // Read the whole snapshot so it can be checked before any of it is applied
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *data = (size > 24) ? new uint8_t[size] : nullptr;
+    bool valid = (data && fread(data, sizeof(uint8_t), size, file) == (size_t)size);
+
+    // Check that the snapshot is intact and was taken with the same ROM, BIOS and firmware
+    if (valid)
+    {
+        uint32_t key[4], crc;
+        getBootKey(key);
+        memcpy(&crc, &data[size - 4], sizeof(crc));
+        valid = (crc == crc32(data, size - 4) && !memcmp(&data[0], &bootMagic, 4) && !memcmp(&data[4], key, sizeof(key)));
+    }
+    delete[] data;
+
+    // Apply the snapshot only once it's known to be whole; a state from another version is rejected untouched
+    fseek(file, 20, SEEK_SET);
+    bool loaded = (valid && loadState(file));
+    fclose(file);
+
+    // Drop a bad or stale snapshot so a new one is taken after this firmware boot
+    if (!loaded)
+    {
+        remove(bootStatePath.c_str());
+        return false;
+    }
+
+    // The snapshot holds the save from when it was taken, so reload the current one
+    cartridge.loadNdsSave();
+    return true;
+}
+
+void Core::saveBootState()
+{
+    FILE *file = fopen(bootStatePath.c_str(), "w+b");
+    if (!file) return;
+
+    uint32_t key[4];
+    getBootKey(key);
+    fwrite(&bootMagic, sizeof(bootMagic), 1, file);
+    fwrite(key, sizeof(key), 1, file);
+    bool saved = saveState(file);
+
+    // Read the snapshot back and append a checksum of it, so a truncated or corrupt file is caught on load
+    if (saved)
+    {
+        long size = ftell(file);
+        uint8_t *data = new uint8_t[size];
+        fseek(file, 0, SEEK_SET);
+        saved = (fread(data, sizeof(uint8_t), size, file) == (size_t)size);
+        uint32_t crc = crc32(data, size);
+        delete[] data;
+        fseek(file, 0, SEEK_END);
+        saved = saved && fwrite(&crc, sizeof(crc), 1, file) == 1 && !ferror(file);
+    }
+    fclose(file);
+
+    // Don't leave a partial snapshot behind
+    if (!saved) remove(bootStatePath.c_str());
+}
+
+bool Core::bootHandedOff()
+{
+    // The firmware has handed off once both CPUs are running the code it loaded from the ROM
+    uint8_t *header = cartridge.getNdsHeader();
+    for (int i = 0; i < 2; i++)
+    {
+        uint32_t start = U8TO32(header, 0x28 + i * 0x10);
+        uint32_t size = U8TO32(header, 0x2C + i * 0x10);
+        if (interpreter[i].getPc() - start >= size)
+            return false;
+    }
+    return true;
+}
+
 void Core::runGbaFrame()
 {
 }
@@ -93,8 +233,11 @@ int PC_Core(int addr){
 
    // for (int k = 0; k < 192;k++)
    {
-        exCore->gpu2D[0].drawScanline(exCore->CurrVcount);
-        exCore->gpu2D[1].drawScanline(exCore->CurrVcount);
+        if (exCore->isRendering())
+        {
+            exCore->gpu2D[0].drawScanline(exCore->CurrVcount);
+            exCore->gpu2D[1].drawScanline(exCore->CurrVcount);
+        }
         exCore->dma[0].trigger(2);
 
     }
@@ -113,13 +256,14 @@ int PC_Core(int addr){
     return 1;
 }
 
-int ME_Core(int _core){
-
-    Core * core = (Core*)_core;
+static void drawFrame2D(Core *core)
+{
+   // When rendering is off, the scanlines aren't drawn but the DMA and IRQ timing stays the same
+   bool render = core->isRendering();
 
    for (int k = 0; k < 192;k++)
    {
-        core->gpu2D[core->SwapDisplayRender].drawScanline(k);
+        if (render) core->gpu2D[core->SwapDisplayRender].drawScanline(k);
         core->dma[0].trigger(2);
 
         // Trigger a V-counter IRQ if enabled
@@ -132,91 +276,221 @@ int ME_Core(int _core){
         core->interpreter[core->SwapDisplayRender].sendInterrupt(2);
 
     core->dma[core->SwapDisplayRender].trigger(1);
+}
+
+#ifdef PSP
+int ME_Core(int _core){
+
+    drawFrame2D((Core*)_core);
 
     return 1;
 }
+#endif
 
-bool first = true;
 uint8_t frameskip = 0;
 
-void Core::runNdsFrame()
+static uint64_t elapsedNs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+int Core::runGpu3D(int cycles)
 {
-  
-    if (ME_JobReturnValue() || first){
+    // Run the geometry engine, timing it if profiling is enabled
+    if (!profiling)
+        return gpu3D.runCommands(cycles);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int count = gpu3D.runCommands(cycles);
+    profile.gpu3D += elapsedNs(start);
+    return count;
+}
+
+void Core::transferDma(bool cpu)
+{
+    // Run a DMA transfer, timing it if profiling is enabled
+    if (!profiling)
+    {
+        dma[cpu].transfer();
+        return;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    dma[cpu].transfer();
+    profile.dma += elapsedNs(start);
+}
+
+void Core::startNdsFrame()
+{
+#ifdef PSP
+    if (ME_JobReturnValue() || firstFrame){
         SwapDisplayRender = !SwapDisplayRender;
         J_EXECUTE_ME_ONCE(ME_Core,(int)this);
-        first = false;
+        firstFrame = false;
         MEfpsCount++;
     }
+#else
+    // Without a Media Engine, draw the 2D frame on the calling thread
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    SwapDisplayRender = !SwapDisplayRender;
+    drawFrame2D(this);
+    MEfpsCount++;
+
+    // Engines normally take turns drawing, so after skipped frames the other engine has to catch up
+    if (rendering && skippedFrames)
+    {
+        for (int i = 0; i < 192; i++)
+            gpu2D[!SwapDisplayRender].drawScanline(i);
+    }
+    skippedFrames = !rendering;
+
+    if (profiling)
+        profile.gpu2D += elapsedNs(start);
+#endif
+}
+
+void Core::finishNdsFrame()
+{
+#ifdef PSP
+    // Copy the completed sub-framebuffers to the main framebuffer
+    if (rendering && SwapDisplayRender && gpu.readPowCnt1() & BIT(0)) // LCDs enabled
+    {
+
+        sceKernelDcacheWritebackInvalidateAll();
+        if (gpu.readPowCnt1() & BIT(15)) // Display swap
+        {
+            psp_render->DrawFrame(gpu2D[0].getFramebuffer(0),gpu2D[1].getFramebuffer(0));
+        }
+        else
+        {
+            psp_render->DrawFrame(gpu2D[1].getFramebuffer(0),gpu2D[0].getFramebuffer(0));
+        }
+
+    }
+#endif
+
+    if (profiling)
+        profile.frames++;
+
+    // Snapshot the machine once it's done booting, giving up if the ROM is never reached
+    if (bootFrames > 0)
+    {
+        if (bootHandedOff())
+        {
+            saveBootState();
+            bootFrames = 0;
+        }
+        else
+        {
+            bootFrames--;
+        }
+    }
+
+    fpsCount++;
 
-    for (int i = 0; i < 263; i++) // 263 scanlines
+    // Update the FPS and reset the counter every second
+    auto tm_now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> fpsTime = tm_now - lastFpsTime;
+    if (fpsTime.count() >= 1.0f)
     {
-        //CurrVcount = i;
+        fps = fpsCount;
+        MEfps = MEfpsCount;
+        fpsCount = 0;
+        MEfpsCount = 0;
+        lastFpsTime = tm_now;
+    }
+}
 
-        for (int j = 0; j < 1065; j++) // 355 dots per scanline * 3
+void Core::runNdsCycles(int cycles)
+{
+    // Note the start time and the time already given to other components, if profiling is enabled
+    std::chrono::steady_clock::time_point start;
+    uint64_t oldOther = 0;
+    if (profiling)
+    {
+        start = std::chrono::steady_clock::now();
+        oldOther = profile.gpu2D + profile.gpu3D + profile.dma;
+    }
+
+    while (cycles > 0)
+    {
+        if (frameLine == 0 && frameDot == 0)
+            startNdsFrame();
+
+        // Run the rest of the current scanline, or as much of it as was requested
+        int dot = frameDot;
+        int end = std::min(dot + cycles, 1065); // 355 dots per scanline * 3
+
+        for (; dot < end; dot++)
         {
             // Run the ARM9 at twice the speed of the ARM7
             {              
                 if (interpreter[0].shouldRun()) interpreter[0].runCycle();    
 
                 if (timers[0].shouldTick())     timers[0].tick(1);
-                if (dma[0].shouldTransfer())    dma[0].transfer();
+                if (dma[0].shouldTransfer())    transferDma(0);
                 
                 if (interpreter[0].shouldRun()) interpreter[0].runCycle();
 
                 if (timers[0].shouldTick())     timers[0].tick(1);
-                if (dma[0].shouldTransfer())    dma[0].transfer();
+                if (dma[0].shouldTransfer())    transferDma(0);
             }
 
             // Run the ARM7 
             if (interpreter[1].shouldRun()) interpreter[1].runCycle();
             
             if (timers[1].shouldTick())     timers[1].tick(2);
-            if (dma[1].shouldTransfer())    dma[1].transfer();
+            if (dma[1].shouldTransfer())    transferDma(1);
 
-            if (gpu3D.shouldRun()) gpu3D.runCycle();
+            if (gpu3D.shouldRun()) runGpu3D(1);
 
-            //Stop the loop if both halted
+            // Skip the rest of the scanline if both CPUs are halted
             if (!interpreter[0].shouldRun() && !interpreter[1].shouldRun())
+            {
+                // Run the geometry engine through the skipped dots in one go
+                // If it wakes the ARM9 or starts a DMA transfer, resume from the dot where that happened
+                if (gpu3D.shouldRun())
+                {
+                    dot += runGpu3D(end - dot - 1);
+                    if (interpreter[0].shouldRun() || dma[0].shouldTransfer())
+                        continue;
+                }
+
+                dot = end = 1065;
                 break;
+            }
         }
-        
-        //PC_Core(0);
-        gpu.scanline256();
-        gpu.scanline355();
-    }
 
-    // Copy the completed sub-framebuffers to the main framebuffer
-    if (SwapDisplayRender && gpu.readPowCnt1() & BIT(0)) // LCDs enabled
-    {
+        cycles -= end - frameDot;
+        frameDot = dot;
 
-        sceKernelDcacheWritebackInvalidateAll();
-        if (gpu.readPowCnt1() & BIT(15)) // Display swap
+        if (frameDot == 1065)
         {
-            psp_render->DrawFrame(gpu2D[0].getFramebuffer(0),gpu2D[1].getFramebuffer(0));
-        }
-        else
-        {
-            psp_render->DrawFrame(gpu2D[1].getFramebuffer(0),gpu2D[0].getFramebuffer(0));
+            //PC_Core(0);
+            gpu.scanline256();
+            gpu.scanline355();
+            frameDot = 0;
+
+            if (++frameLine == 263) // 263 scanlines
+            {
+                frameLine = 0;
+                finishNdsFrame();
+            }
         }
-
     }
 
-    fpsCount++;
-
-    // Update the FPS and reset the counter every second
-    auto tm_now = std::chrono::steady_clock::now();
-    std::chrono::duration<double> fpsTime = tm_now - lastFpsTime;
-    if (fpsTime.count() >= 1.0f)
+    // Attribute the time that isn't accounted for by other components to the CPUs
+    if (profiling)
     {
-        fps = fpsCount;
-        MEfps = MEfpsCount;
-        fpsCount = 0;
-        MEfpsCount = 0;
-        lastFpsTime = tm_now;
+        uint64_t other = profile.gpu2D + profile.gpu3D + profile.dma - oldOther;
+        profile.cpu += elapsedNs(start) - other;
     }
+}
 
-    
+void Core::runNdsFrame()
+{
+    // Run until the end of the current frame
+    runNdsCycles((263 - frameLine) * 1065 - frameDot);
 }
 
 void Core::enterGbaMode()
@@ -231,3 +505,84 @@ void Core::enterGbaMode()
     memory.write<uint8_t>(0, 0x4000240, 0x80); // VRAMCNT_A
     memory.write<uint8_t>(0, 0x4000241, 0x80); // VRAMCNT_B
 }
+
+// Identifies state files, and is bumped whenever their layout changes
+static const uint32_t stateMagic = 0x5353444E; // "NDSS"
+static const uint32_t stateVersion = 3;
+
+bool Core::saveState(FILE *file)
+{
+    // Write the state header
+    fwrite(&stateMagic, sizeof(stateMagic), 1, file);
+    fwrite(&stateVersion, sizeof(stateVersion), 1, file);
+
+    // Write the core's own state
+    fwrite(&SwapDisplayRender, sizeof(SwapDisplayRender), 1, file);
+    fwrite(&CurrVcount, sizeof(CurrVcount), 1, file);
+    fwrite(&frameLine, sizeof(frameLine), 1, file);
+    fwrite(&frameDot, sizeof(frameDot), 1, file);
+    fwrite(&spuTimer, sizeof(spuTimer), 1, file);
+
+    // Write the state of each component
+    cartridge.saveState(file);
+    cp15.saveState(file);
+    divSqrt.saveState(file);
+    for (int i = 0; i < 2; i++) dma[i].saveState(file);
+    gpu.saveState(file);
+    for (int i = 0; i < 2; i++) gpu2D[i].saveState(file);
+    gpu3D.saveState(file);
+    gpu3DRenderer.saveState(file);
+    input.saveState(file);
+    for (int i = 0; i < 2; i++) interpreter[i].saveState(file);
+    ipc.saveState(file);
+    memory.saveState(file);
+    rtc.saveState(file);
+    spi.saveState(file);
+    spu.saveState(file);
+    for (int i = 0; i < 2; i++) timers[i].saveState(file);
+    wifi.saveState(file);
+
+    return !ferror(file);
+}
+
+bool Core::loadState(FILE *file)
+{
+    // Check the state header, leaving the core untouched if it doesn't match
+    uint32_t magic = 0, version = 0;
+    fread(&magic, sizeof(magic), 1, file);
+    fread(&version, sizeof(version), 1, file);
+    if (magic != stateMagic || version != stateVersion)
+        return false;
+
+    // Read the core's own state
+    fread(&SwapDisplayRender, sizeof(SwapDisplayRender), 1, file);
+    fread(&CurrVcount, sizeof(CurrVcount), 1, file);
+    fread(&frameLine, sizeof(frameLine), 1, file);
+    fread(&frameDot, sizeof(frameDot), 1, file);
+    fread(&spuTimer, sizeof(spuTimer), 1, file);
+
+    // Read the state of each component
+    cartridge.loadState(file);
+    cp15.loadState(file);
+    divSqrt.loadState(file);
+    for (int i = 0; i < 2; i++) dma[i].loadState(file);
+    gpu.loadState(file);
+    for (int i = 0; i < 2; i++) gpu2D[i].loadState(file);
+    gpu3D.loadState(file);
+    gpu3DRenderer.loadState(file);
+    input.loadState(file);
+    for (int i = 0; i < 2; i++) interpreter[i].loadState(file);
+    ipc.loadState(file);
+    memory.loadState(file);
+    rtc.loadState(file);
+    spi.loadState(file);
+    spu.loadState(file);
+    for (int i = 0; i < 2; i++) timers[i].loadState(file);
+    wifi.loadState(file);
+
+    // Anything derived from the old state has to be redrawn
+    gpu.invalidate3D();
+
+    return !ferror(file) && !feof(file);
+}
+
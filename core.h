@@ -43,14 +43,28 @@
 #include "timers.h"
 #include "wifi.h"
 
+struct Profile
+{
+    // Accumulated time spent in each part of the emulator, in nanoseconds
+    // CPU time covers everything that isn't accounted for by the other components
+    uint64_t cpu = 0;
+    uint64_t gpu2D = 0;
+    uint64_t gpu3D = 0;
+    uint64_t dma = 0;
+    int frames = 0;
+};
+
 class Core
 {
     public:
         Core(std::string ndsPath = "", std::string gbaPath = "");
+        Core(const uint8_t *ndsRom, int ndsRomSize, const uint8_t *bios9 = nullptr,
+            const uint8_t *bios7 = nullptr, const uint8_t *firmware = nullptr, bool copyRom = true);
 
         int MEfpsCount = 0;
 
         void runFrame() { (this->*runFunc)(); }
+        void runCycles(int cycles) { if (!gbaMode) runNdsCycles(cycles); }
 
         bool isGbaMode() { return gbaMode; }
         int  getFps()    { return fps;     }
@@ -62,6 +76,18 @@ class Core
 
         void enterGbaMode();
 
+        bool saveState(FILE *file);
+        bool loadState(FILE *file);
+
+        // Rendering can be turned off for frames whose output isn't needed
+        // Only the drawing is skipped; everything the emulated CPUs can observe runs as usual
+        void setRendering(bool value) { rendering = value; }
+        bool isRendering()            { return rendering;  }
+
+        void setProfiling(bool value) { profiling = value; }
+        Profile getProfile()          { return profile;    }
+        void resetProfile()           { profile = Profile(); }
+
         Cartridge cartridge;
         Cp15 cp15;
         DivSqrt divSqrt;
@@ -82,14 +108,39 @@ class Core
 
     private:
         bool gbaMode = false;
+        bool firstFrame = true;
         void (Core::*runFunc)() = &Core::runNdsFrame;
 
+        bool rendering = true;
+        bool skippedFrames = false;
+
+        bool profiling = false;
+        Profile profile;
+
         int fps = 0, fpsCount = 0, MEfps = 0;
         std::chrono::steady_clock::time_point lastFpsTime;
         int spuTimer = 0;
 
+        int frameLine = 0, frameDot = 0;
+
+        std::string bootStatePath;
+        int bootFrames = 0;
+
+        void directBootNds();
+
+        void getBootKey(uint32_t *key);
+        bool loadBootState();
+        void saveBootState();
+        bool bootHandedOff();
+
+        void startNdsFrame();
+        void finishNdsFrame();
+        void runNdsCycles(int cycles);
         void runNdsFrame();
         void runGbaFrame();
+
+        int runGpu3D(int cycles);
+        void transferDma(bool cpu);
 };
 
 
@@ -87,3 +87,31 @@ void Cp15::write(int cn, int cm, int cp, uint32_t value)
         }
     }
 }
+
+void Cp15::saveState(FILE *file)
+{
+    // Write the state to a file
+    fwrite(&ctrlReg, sizeof(ctrlReg), 1, file);
+    fwrite(&dtcmReg, sizeof(dtcmReg), 1, file);
+    fwrite(&itcmReg, sizeof(itcmReg), 1, file);
+    fwrite(&exceptionAddr, sizeof(exceptionAddr), 1, file);
+    fwrite(&dtcmEnabled, sizeof(dtcmEnabled), 1, file);
+    fwrite(&itcmEnabled, sizeof(itcmEnabled), 1, file);
+    fwrite(&dtcmAddr, sizeof(dtcmAddr), 1, file);
+    fwrite(&dtcmSize, sizeof(dtcmSize), 1, file);
+    fwrite(&itcmSize, sizeof(itcmSize), 1, file);
+}
+
+void Cp15::loadState(FILE *file)
+{
+    // Read the state from a file
+    fread(&ctrlReg, sizeof(ctrlReg), 1, file);
+    fread(&dtcmReg, sizeof(dtcmReg), 1, file);
+    fread(&itcmReg, sizeof(itcmReg), 1, file);
+    fread(&exceptionAddr, sizeof(exceptionAddr), 1, file);
+    fread(&dtcmEnabled, sizeof(dtcmEnabled), 1, file);
+    fread(&itcmEnabled, sizeof(itcmEnabled), 1, file);
+    fread(&dtcmAddr, sizeof(dtcmAddr), 1, file);
+    fread(&dtcmSize, sizeof(dtcmSize), 1, file);
+    fread(&itcmSize, sizeof(itcmSize), 1, file);
+}
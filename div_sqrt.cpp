@@ -173,3 +173,29 @@ void DivSqrt::writeSqrtParamH(uint32_t mask, uint32_t value)
 
     squareRoot();
 }
+
+void DivSqrt::saveState(FILE *file)
+{
+    // Write the state to a file
+    fwrite(&divCnt, sizeof(divCnt), 1, file);
+    fwrite(&divNumer, sizeof(divNumer), 1, file);
+    fwrite(&divDenom, sizeof(divDenom), 1, file);
+    fwrite(&divResult, sizeof(divResult), 1, file);
+    fwrite(&divRemResult, sizeof(divRemResult), 1, file);
+    fwrite(&sqrtCnt, sizeof(sqrtCnt), 1, file);
+    fwrite(&sqrtResult, sizeof(sqrtResult), 1, file);
+    fwrite(&sqrtParam, sizeof(sqrtParam), 1, file);
+}
+
+void DivSqrt::loadState(FILE *file)
+{
+    // Read the state from a file
+    fread(&divCnt, sizeof(divCnt), 1, file);
+    fread(&divNumer, sizeof(divNumer), 1, file);
+    fread(&divDenom, sizeof(divDenom), 1, file);
+    fread(&divResult, sizeof(divResult), 1, file);
+    fread(&divRemResult, sizeof(divRemResult), 1, file);
+    fread(&sqrtCnt, sizeof(sqrtCnt), 1, file);
+    fread(&sqrtResult, sizeof(sqrtResult), 1, file);
+    fread(&sqrtParam, sizeof(sqrtParam), 1, file);
+}
@@ -192,3 +192,27 @@ void Dma::writeDmaCnt(int channel, uint32_t mask, uint32_t value)
     if (((dmaCnt[channel] & 0x38000000) >> 27) == 0)
         active |= BIT(channel);
 }
+
+void Dma::saveState(FILE *file)
+{
+    // Write the state to a file
+    fwrite(&active, sizeof(active), 1, file);
+    fwrite(srcAddrs, sizeof(srcAddrs), 1, file);
+    fwrite(dstAddrs, sizeof(dstAddrs), 1, file);
+    fwrite(wordCounts, sizeof(wordCounts), 1, file);
+    fwrite(dmaSad, sizeof(dmaSad), 1, file);
+    fwrite(dmaDad, sizeof(dmaDad), 1, file);
+    fwrite(dmaCnt, sizeof(dmaCnt), 1, file);
+}
+
+void Dma::loadState(FILE *file)
+{
+    // Read the state from a file
+    fread(&active, sizeof(active), 1, file);
+    fread(srcAddrs, sizeof(srcAddrs), 1, file);
+    fread(dstAddrs, sizeof(dstAddrs), 1, file);
+    fread(wordCounts, sizeof(wordCounts), 1, file);
+    fread(dmaSad, sizeof(dmaSad), 1, file);
+    fread(dmaDad, sizeof(dmaDad), 1, file);
+    fread(dmaCnt, sizeof(dmaCnt), 1, file);
+}
@@ -21,6 +21,7 @@
 #define DMA_H
 
 #include <cstdint>
+#include <cstdio>
 
 class Core;
 
@@ -29,6 +30,9 @@ class Dma
     public:
         Dma(Core *core, bool cpu): core(core), cpu(cpu) {}
 
+        void saveState(FILE *file);
+        void loadState(FILE *file);
+
         void transfer();
         void trigger(int mode, uint8_t channels = 0x0F);
         void disable(int mode, uint8_t channels = 0x0F);
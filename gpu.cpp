@@ -18,7 +18,6 @@
 */
 
 #include <cstring>
-#include <pspkernel.h>
 
 #include "gpu.h"
 #include "core.h"
@@ -224,3 +223,25 @@ void Gpu::writePowCnt1(uint16_t mask, uint16_t value)
     mask &= 0x820F;
     powCnt1 = (powCnt1 & ~mask) | (value & mask);
 }
+
+void Gpu::saveState(FILE *file)
+{
+    // Write the state to a file
+    fwrite(dispStat, sizeof(dispStat), 1, file);
+    fwrite(&displayCapture, sizeof(displayCapture), 1, file);
+    fwrite(&dirty3D, sizeof(dirty3D), 1, file);
+    fwrite(&vCount, sizeof(vCount), 1, file);
+    fwrite(&dispCapCnt, sizeof(dispCapCnt), 1, file);
+    fwrite(&powCnt1, sizeof(powCnt1), 1, file);
+}
+
+void Gpu::loadState(FILE *file)
+{
+    // Read the state from a file
+    fread(dispStat, sizeof(dispStat), 1, file);
+    fread(&displayCapture, sizeof(displayCapture), 1, file);
+    fread(&dirty3D, sizeof(dirty3D), 1, file);
+    fread(&vCount, sizeof(vCount), 1, file);
+    fread(&dispCapCnt, sizeof(dispCapCnt), 1, file);
+    fread(&powCnt1, sizeof(powCnt1), 1, file);
+}
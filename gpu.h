@@ -22,6 +22,7 @@
 
 #include <atomic>
 #include <cstdint>
+#include <cstdio>
 #include <thread>
 #include <mutex>
 
@@ -35,6 +36,9 @@ class Gpu
         Gpu(Core *core);
         ~Gpu();
 
+        void saveState(FILE *file);
+        void loadState(FILE *file);
+
         uint16_t dispStat[2] = {};
 
         uint32_t *getFrame(bool gbaCrop);
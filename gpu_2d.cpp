@@ -22,10 +22,19 @@
 #include "gpu_2d.h"
 #include "core.h"
 
+#ifdef PSP
 #include "psp/GPU/draw.h"
 #include "pspDmac.h"
+#endif
 
-int I_8[128];
+// Color effects are applied with SIMD where the host has it
+// Defining GPU2D_SCALAR uses the reference implementation instead, for checking the others against
+// Defining GPU2D_TABLES uses lookup tables built when the coefficients change, for hosts with slow multiplies
+#if !defined(GPU2D_SCALAR) && !defined(GPU2D_TABLES) && defined(__SSE2__)
+#include <emmintrin.h>
+#elif !defined(GPU2D_SCALAR) && !defined(GPU2D_TABLES) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 Gpu2D::Gpu2D(Core *core, bool engine): core(core), engine(engine)
 {
@@ -36,6 +45,10 @@ Gpu2D::Gpu2D(Core *core, bool engine): core(core), engine(engine)
         objVramAddr = 0x6400000;
         palette = core->memory.getPalette();
         oam = core->memory.getOam();
+        bgPageMap = core->memory.getEngABg();
+        objPageMap = core->memory.getEngAObj();
+        bgPageMask = 0x7FFFF;
+        objPageMask = 0x3FFFF;
         extPalettes = core->memory.getEngAExtPal();
     }
     else
@@ -45,10 +58,16 @@ Gpu2D::Gpu2D(Core *core, bool engine): core(core), engine(engine)
         objVramAddr = 0x6600000;
         palette = core->memory.getPalette() + 0x400;
         oam = core->memory.getOam() + 0x400;
+        bgPageMap = core->memory.getEngBBg();
+        objPageMap = core->memory.getEngBObj();
+        bgPageMask = 0x1FFFF;
+        objPageMask = 0x1FFFF;
         extPalettes = core->memory.getEngBExtPal();
     }
 
-    for (int i = 0;i < 128; i++)  I_8[i] = i * 8;
+    updateBlendTables();
+    updateBrightnessTables();
+    updateMasterTable();
 }
 
 uint32_t Gpu2D::rgb5ToRgb6(uint32_t color)
@@ -61,6 +80,101 @@ uint32_t Gpu2D::rgb5ToRgb6(uint32_t color)
     return (color & 0xFFFC0000) | (0<<24)|(r << 16) | (g << 8) | b;*/
 }
 
+template <typename T> T Gpu2D::readBg(uint32_t address)
+{
+    // Read from a BG VRAM page, the same way as the memory map but without the dispatch
+    // Unmapped pages read as zero
+    int index = (address & bgPageMask) >> 14;
+    uint8_t *page = bgPages[index];
+    pagesRead |= (uint64_t)1 << index;
+    if (!page) return 0;
+
+    uint8_t *data = &page[address & 0x3FFF & ~(sizeof(T) - 1)];
+    T value = 0;
+    for (unsigned int i = 0; i < sizeof(T); i++)
+        value |= data[i] << (i * 8);
+    return value;
+}
+
+template <typename T> T Gpu2D::readObj(uint32_t address)
+{
+    // Read from an OBJ VRAM page, the same way as the memory map but without the dispatch
+    // Unmapped pages read as zero
+    int index = (address & objPageMask) >> 14;
+    uint8_t *page = objPages[index];
+    pagesRead |= (uint64_t)1 << (32 + index);
+    if (!page) return 0;
+
+    uint8_t *data = &page[address & 0x3FFF & ~(sizeof(T) - 1)];
+    T value = 0;
+    for (unsigned int i = 0; i < sizeof(T); i++)
+        value |= data[i] << (i * 8);
+    return value;
+}
+
+void Gpu2D::updatePalettes()
+{
+    // Convert the palettes to colors that are ready to store in the layers, for any that changed since the last scanline
+    // Versions are read before the data, so a write during conversion can't be missed
+    uint32_t version = core->memory.getPaletteVersion();
+    if (version != palColorsVersion)
+    {
+        palColorsVersion = version;
+        for (int i = 0; i < 512; i++)
+            palColors[i] = U8TO16(palette, i * 2) | BIT(15);
+    }
+
+    // Extended palettes live in VRAM, so their versions come from there
+    // Slots are only converted again when they're remapped or their VRAM is written
+    for (int slot = 0; slot < 5; slot++)
+    {
+        const uint8_t *data = extPalettes[slot];
+        if (!data) continue;
+
+        version = core->memory.getVramVersion(data);
+        if (data == extPalColorsData[slot] && version == extPalColorsVersion[slot])
+            continue;
+
+        extPalColorsData[slot] = data;
+        extPalColorsVersion[slot] = version;
+        for (int i = 0; i < 4096; i++)
+            extPalColors[slot][i] = U8TO16(data, i * 2) | BIT(15);
+    }
+}
+
+TileLine *Gpu2D::getTileLine(const uint8_t *data, const uint32_t *pal, uint32_t palVersion, bool bpp8, bool flip)
+{
+    // Read the version before the data, so a write during decoding can't be missed
+    uint32_t version = core->memory.getVramVersion(data);
+    uint8_t flags = (bpp8 << 1) | flip;
+
+    // Reuse the decoded line if its data and palette haven't changed since
+    TileLine *tileLine = &tileCache[(((uintptr_t)data >> 2) ^ ((uintptr_t)pal >> 6) ^ (flip << 9)) & 0x3FF];
+    if (tileLine->data == data && tileLine->pal == pal && tileLine->flags == flags &&
+        tileLine->version == version && tileLine->palVersion == palVersion)
+        return tileLine;
+
+    tileLine->data = data;
+    tileLine->pal = pal;
+    tileLine->version = version;
+    tileLine->palVersion = palVersion;
+    tileLine->flags = flags;
+    tileLine->opaque = 0;
+
+    // Decode the palette indices to colors, marking which pixels aren't transparent
+    uint64_t indices = (uint32_t)U8TO32(data, 0);
+    if (bpp8) indices |= (uint64_t)(uint32_t)U8TO32(data, 4) << 32;
+    for (int i = 0; i < 8; i++)
+    {
+        int index = bpp8 ? ((indices >> (i * 8)) & 0xFF) : ((indices >> (i * 4)) & 0xF);
+        int x = flip ? (7 - i) : i;
+        tileLine->colors[x] = pal[index];
+        if (index) tileLine->opaque |= BIT(x);
+    }
+
+    return tileLine;
+}
+
 void Gpu2D::drawGbaScanline(int line)
 {
 }
@@ -76,198 +190,361 @@ void Gpu2D::drawScanline(int line)
         internalY[1] = bgY[1];
     }
 
-    // Clear the layers
-    for (int i = 0; i < 5; i++)
-        memset(layers[i], 0, 256 * sizeof(uint32_t));
-    memset(objPrio, 4, 256 * sizeof(uint8_t));
+    // Resolve the VRAM pages for this scanline, so mapping changes can't happen partway through it
+    // Any change to the mapping is counted, so lines drawn with a different mapping aren't reused
+    int bgCount = (bgPageMask + 1) >> 14, objCount = (objPageMask + 1) >> 14;
+    if (memcmp(bgPages, bgPageMap, bgCount * sizeof(uint8_t*)) || memcmp(objPages, objPageMap, objCount * sizeof(uint8_t*)))
+    {
+        memcpy(bgPages, bgPageMap, bgCount * sizeof(uint8_t*));
+        memcpy(objPages, objPageMap, objCount * sizeof(uint8_t*));
+        mapEpoch++;
+    }
 
-    // Draw the background layers
-    // The type of each layer depends on the BG mode
-    switch (dispCnt & 0x00000007)
+    // Bring the converted palettes up to date
+    updatePalettes();
+
+    // Reuse the line from the last frame if nothing it depends on has changed
+    // Versions are read before any data, so a write during drawing can't be missed
+    uint32_t pageVersions[48] = {};
+    for (int i = 0; i < bgCount; i++)
+        if (bgPages[i]) pageVersions[i] = core->memory.getVramVersion(bgPages[i]);
+    for (int i = 0; i < objCount; i++)
+        if (objPages[i]) pageVersions[32 + i] = core->memory.getVramVersion(objPages[i]);
+
+    LineKey key;
+    getLineKey(&key);
+    LineState *state = &lineStates[line];
+    if (state->valid && !memcmp(&key, &state->key, sizeof(key)))
     {
-        case 0:
+        bool changed = false;
+        for (uint64_t mask = state->pagesRead; mask && !changed; mask &= mask - 1)
         {
-            if (dispCnt & BIT(8))  drawText(0, line);
-            if (dispCnt & BIT(9))  drawText(1, line);
-            if (dispCnt & BIT(10)) drawText(2, line);
-            if (dispCnt & BIT(11)) drawText(3, line);
-            break;
+            int i = __builtin_ctzll(mask);
+            changed = (pageVersions[i] != state->pageVersions[i]);
         }
 
-        case 1:
+        if (!changed)
         {
-            if (dispCnt & BIT(8))    drawText(0, line);
-            if (dispCnt & BIT(9))    drawText(1, line);
-            if (dispCnt & BIT(10))   drawText(2, line);
-            if (dispCnt & BIT(11)) drawAffine(3, line);
-            break;
-        }
+            // The internal registers of rotscale layers still advance, as if the line was drawn
+            for (int bg = 2; bg < 4; bg++)
+            {
+                if ((dispCnt & BIT(8 + bg)) && bgTypes[dispCnt & 0x00000007][bg] >= BG_AFFINE)
+                {
+                    internalX[bg - 2] += bgPB[bg - 2];
+                    internalY[bg - 2] += bgPD[bg - 2];
+                }
+            }
 
-        case 2:
-        {
-            if (dispCnt & BIT(8))    drawText(0, line);
-            if (dispCnt & BIT(9))    drawText(1, line);
-            if (dispCnt & BIT(10)) drawAffine(2, line);
-            if (dispCnt & BIT(11)) drawAffine(3, line);
-            break;
+            linesReused++;
+            return;
         }
+    }
 
-        case 3:
+    // Remember what the line depends on as it's drawn
+    // 3D can change without anything here changing, so lines with it are never reused
+    state->key = key;
+    state->valid = !(dispCnt & BIT(3));
+    memcpy(state->pageVersions, pageVersions, sizeof(pageVersions));
+    pagesRead = 0;
+    linesDrawn++;
+
+    // Split the line into spans that have the same layers enabled by the windows
+    WindowSpan spans[5];
+    int spanCount = buildWindowSpans(line, spans);
+    uint8_t visible = 0;
+    for (int s = 0; s < spanCount; s++)
+        visible |= spans[s].enabled;
+
+    // Draw the background layers, each with the renderer specialized for its current settings
+    // Layers are drawn from highest to lowest priority, so ones that end up fully covered can be skipped
+    // Alpha blending can show the second topmost pixel, so in that case a layer needs 2 opaque layers above it
+    if ((dispCnt & 0x00000007) == 7)
+        printf("Unknown engine %c BG mode: %d\n", ((engine == 0) ? 'A' : 'B'), dispCnt & 0x00000007);
+    int order[4] = { 0, 1, 2, 3 };
+    for (int i = 1; i < 4; i++)
+    {
+        for (int j = i; j > 0 && (bgCnt[order[j - 1]] & 0x0003) > (bgCnt[order[j]] & 0x0003); j--)
+            SWAP(order[j - 1], order[j]);
+    }
+
+    int needed = (bldCnt & 0x3F00) ? 2 : 1;
+    int coveredCount = 0;
+    bool countCover = false;
+
+    for (int i = 0; i < 4; i++)
+    {
+        int bg = order[i];
+        if (!(dispCnt & BIT(8 + bg))) continue;
+        BgRenderer renderer = getBgRenderer(bg);
+
+        // Layers the BG mode has no renderer for are never drawn or cleared, so take them out of the blend
+        if (!renderer)
         {
-            if (dispCnt & BIT(8))      drawText(0, line);
-            if (dispCnt & BIT(9))      drawText(1, line);
-            if (dispCnt & BIT(10))     drawText(2, line);
-            if (dispCnt & BIT(11)) drawExtended(3, line);
-            break;
+            for (int s = 0; s < spanCount; s++)
+                spans[s].enabled &= ~BIT(bg);
+            continue;
         }
 
-        case 4:
+        // Skip layers that are masked by the windows or covered on the whole line
+        // The internal registers of rotscale layers still advance, as if the line was drawn
+        if (!(visible & BIT(bg)) || coveredCount == 256)
         {
-            if (dispCnt & BIT(8))      drawText(0, line);
-            if (dispCnt & BIT(9))      drawText(1, line);
-            if (dispCnt & BIT(10))   drawAffine(2, line);
-            if (dispCnt & BIT(11)) drawExtended(3, line);
-            break;
+            if (bgTypes[dispCnt & 0x00000007][bg] >= BG_AFFINE)
+            {
+                internalX[bg - 2] += bgPB[bg - 2];
+                internalY[bg - 2] += bgPD[bg - 2];
+            }
+            continue;
         }
 
-        case 5:
+        // 3D is copied over the whole layer, so only other layers need clearing
+        if (renderer == &Gpu2D::draw3D)
         {
-            if (dispCnt & BIT(8))      drawText(0, line);
-            if (dispCnt & BIT(9))      drawText(1, line);
-            if (dispCnt & BIT(10)) drawExtended(2, line);
-            if (dispCnt & BIT(11)) drawExtended(3, line);
-            break;
+            (this->*renderer)(bg, line);
+            continue;
         }
+        memset(layers[bg], 0, 256 * sizeof(uint32_t));
+        (this->*renderer)(bg, line);
 
-        case 6:
+        // Count how many opaque layers cover each pixel where this layer is enabled
+        if (!countCover)
         {
-            if (dispCnt & BIT(10)) drawLarge(2, line);
-            break;
+            memset(layerCover, 0, sizeof(layerCover));
+            countCover = true;
         }
-
-        default:
+        for (int s = 0; s < spanCount; s++)
         {
-            printf("Unknown engine %c BG mode: %d\n", ((engine == 0) ? 'A' : 'B'), dispCnt & 0x00000007);
-            break;
+            if (!(spans[s].enabled & BIT(bg))) continue;
+            for (int x = spans[s].start; x < spans[s].end; x++)
+            {
+                if ((layers[bg][x] & BIT(15)) && ++layerCover[x] == needed)
+                    coveredCount++;
+            }
         }
     }
 
     // Draw the objects
-    if (dispCnt & BIT(12)) drawObjects(line);
+    if (dispCnt & BIT(12))
+    {
+        memset(layers[4], 0, 256 * sizeof(uint32_t));
+        memset(objPrio, 4, 256 * sizeof(uint8_t));
+        drawObjects(line);
+    }
 
     // Blend the layers to form the final image
-    for (int i = 0; i < 256; i++)
+    // The top two pixels are resolved first, and color effects are applied to the whole line after
+    uint16_t *pixels = &framebuffer[line * 256];
+    uint16_t backdrop = U8TO16(palette, 0);
+    int mode = (bldCnt & 0x00C0) >> 6;
+    bool effects = false;
+
+    for (int s = 0; s < spanCount; s++)
     {
-        uint8_t enabled = BIT(5) | (dispCnt >> 8);
-        uint16_t *pixel = &framebuffer[line * 256 + i];
+        uint8_t enabled = spans[s].enabled;
 
-        // If the current pixel is in the bounds of a window, disable layers that are disabled in that window
-        if (dispCnt & 0x0000E000) // Windows enabled
+        // Gather the background layers enabled in the span, in the order they're searched
+        int bgs[4], bgCount = 0;
+        for (int j = 3; j >= 0; j--)
         {
-            if ((dispCnt & BIT(13)) && i >= winX1[0] && i < winX2[0] && line >= winY1[0] && line < winY2[0])
-                enabled &= winIn >> 0; // Window 0
-            else if ((dispCnt & BIT(14)) && i >= winX1[1] && i < winX2[1] && line >= winY1[1] && line < winY2[1])
-                enabled &= winIn >> 8; // Window 1
-            else if ((dispCnt & BIT(15)) && (*pixel & BIT(24)))
-                enabled &= winOut >> 8; // Object window
-            else
-                enabled &= winOut >> 0; // Outside of windows
+            if (enabled & BIT(j))
+                bgs[bgCount++] = j;
         }
 
-        // Set the topmost two pixels to the backdrop color (first palette index)
-        uint32_t pixel2 = *pixel = U8TO16(palette, 0);
-        int blendBit = 5, blendBit2 = 5;
-        int priority = 4, priority2 = 4;
-
-        // If an object pixel exists, set it to the topmost pixel
-        // Objects are higher priority than background layers, so the priority is given a little boost
-        if ((enabled & BIT(4)) && (layers[4][i] & BIT(15)))
+        for (int i = spans[s].start; i < spans[s].end; i++)
         {
-            *pixel = layers[4][i];
-            blendBit = 4;
-            priority = objPrio[i] - 1;
-        }
+            uint16_t *pixel = &pixels[i];
 
-        // Look for pixels in the background layers
-        for (int j = 3; j >= 0; j--)
-        {
-            // Update the topmost pixels if a higher priority pixel is found
-            // 3D pixels (marked by bit 26) are special cases that have higher-precision alpha values
-            if ((enabled & BIT(j)) && (layers[j][i] & ((layers[j][i] & BIT(26)) ? 0xFC0000 : BIT(15))))
+            // Set the topmost two pixels to the backdrop color (first palette index)
+            uint32_t pixel2 = *pixel = backdrop;
+            int blendBit = 5, blendBit2 = 5;
+            int priority = 4, priority2 = 4;
+
+            // If an object pixel exists, set it to the topmost pixel
+            // Objects are higher priority than background layers, so the priority is given a little boost
+            if ((enabled & BIT(4)) && (layers[4][i] & BIT(15)))
             {
-                if ((bgCnt[j] & 0x0003) <= priority) // Higher than topmost
-                {
-                    // Move the topmost pixel to the second topmost
-                    pixel2 = *pixel;
-                    blendBit2 = blendBit;
-                    priority2 = priority;
-
-                    // Update the topmost pixel
-                    *pixel = layers[j][i];
-                    blendBit = j;
-                    priority = (bgCnt[j] & 0x0003);
-                }
-                else if ((bgCnt[j] & 0x0003) <= priority2) // Higher than second topmost
+                *pixel = layers[4][i];
+                blendBit = 4;
+                priority = objPrio[i] - 1;
+            }
+
+            // Look for pixels in the background layers
+            for (int k = 0; k < bgCount; k++)
+            {
+                // Update the topmost pixels if a higher priority pixel is found
+                // 3D pixels (marked by bit 26) are special cases that have higher-precision alpha values
+                int j = bgs[k];
+                if (layers[j][i] & ((layers[j][i] & BIT(26)) ? 0xFC0000 : BIT(15)))
                 {
-                    // Update the second topmost pixel
-                    pixel2 = layers[j][i];
-                    blendBit2 = j;
-                    priority2 = (bgCnt[j] & 0x0003);
+                    if ((bgCnt[j] & 0x0003) <= priority) // Higher than topmost
+                    {
+                        // Move the topmost pixel to the second topmost
+                        pixel2 = *pixel;
+                        blendBit2 = blendBit;
+                        priority2 = priority;
+
+                        // Update the topmost pixel
+                        *pixel = layers[j][i];
+                        blendBit = j;
+                        priority = (bgCnt[j] & 0x0003);
+                    }
+                    else if ((bgCnt[j] & 0x0003) <= priority2) // Higher than second topmost
+                    {
+                        // Update the second topmost pixel
+                        pixel2 = layers[j][i];
+                        blendBit2 = j;
+                        priority2 = (bgCnt[j] & 0x0003);
+                    }
                 }
             }
-        }
 
-        // Convert the pixels to 18-bit if they aren't 3D pixels that were already 18-bit
-        /*if (!(*pixel & BIT(26))) *pixel = rgb5ToRgb6(*pixel);
-        if (!(pixel2 & BIT(26))) pixel2 = rgb5ToRgb6(pixel2);*/
+            // Convert the pixels to 18-bit if they aren't 3D pixels that were already 18-bit
+            /*if (!(*pixel & BIT(26))) *pixel = rgb5ToRgb6(*pixel);
+            if (!(pixel2 & BIT(26))) pixel2 = rgb5ToRgb6(pixel2);*/
 
-        int mode = (bldCnt & 0x00C0) >> 6;
-        bool blend = ((enabled & BIT(5)) && (bldCnt & BIT(blendBit)));
+            bool blend = ((enabled & BIT(5)) && (bldCnt & BIT(blendBit)));
+            belowPixels[i] = pixel2;
 
-        // Blend the pixel if enabled
-        // Semi-transparent objects and 3D are special cases that force alpha blending (marked by bits 25 and 26)
-        // If special cases don't have a second target to blend with, they can fall back to brightness effects
-        // Blending is done with 18-bit colors on the DS
-        if (((blend && mode == 1) || (*pixel & (BIT(25) | BIT(26)))) && (bldCnt & BIT(8 + blendBit2))) // Alpha blending
-        {
-            if (*pixel & BIT(26)) // 3D
+            // Choose the color effect for the pixel
+            // Semi-transparent objects and 3D are special cases that force alpha blending (marked by bits 25 and 26)
+            // If special cases don't have a second target to blend with, they can fall back to brightness effects
+            if (((blend && mode == 1) || (*pixel & (BIT(25) | BIT(26)))) && (bldCnt & BIT(8 + blendBit2))) // Alpha blending
             {
-                int eva = ((*pixel >> 18) & 0x3F) + 1;
-                int evb = 64 - eva;
-                int r = ((*pixel >>  0) & 0x3F) * eva / 64 + ((pixel2 >>  0) & 0x3F) * evb / 64; if (r > 63) r = 63;
-                int g = ((*pixel >>  5) & 0x3F) * eva / 64 + ((pixel2 >>  5) & 0x3F) * evb / 64; if (g > 63) g = 63;
-                int b = ((*pixel >> 10) & 0x3F) * eva / 64 + ((pixel2 >> 10) & 0x3F) * evb / 64; if (b > 63) b = 63;
-                *pixel = (b << 10) | (g << 5) | r;
+                if (*pixel & BIT(26)) // 3D
+                {
+                    int eva = ((*pixel >> 18) & 0x3F) + 1;
+                    int evb = 64 - eva;
+                    int r = ((*pixel >>  0) & 0x3F) * eva / 64 + ((pixel2 >>  0) & 0x3F) * evb / 64; if (r > 63) r = 63;
+                    int g = ((*pixel >>  5) & 0x3F) * eva / 64 + ((pixel2 >>  5) & 0x3F) * evb / 64; if (g > 63) g = 63;
+                    int b = ((*pixel >> 10) & 0x3F) * eva / 64 + ((pixel2 >> 10) & 0x3F) * evb / 64; if (b > 63) b = 63;
+                    *pixel = (b << 10) | (g << 5) | r;
+                    pixelEffects[i] = EFFECT_NONE;
+                }
+                else
+                {
+                    pixelEffects[i] = EFFECT_ALPHA;
+                    effects = true;
+                }
+            }
+            else if (blend && mode >= 2) // Brightness increase or decrease
+            {
+                pixelEffects[i] = mode;
+                effects = true;
             }
             else
             {
-                int eva = (bldAlpha & 0x001F) >> 0; if (eva > 16) eva = 16;
-                int evb = (bldAlpha & 0x1F00) >> 8; if (evb > 16) evb = 16;
-                int r = ((*pixel >>  0) & 0x3F) * eva / 16 + ((pixel2 >>  0) & 0x3F) * evb / 16; if (r > 63) r = 63;
-                int g = ((*pixel >>  5) & 0x3F) * eva / 16 + ((pixel2 >>  5) & 0x3F) * evb / 16; if (g > 63) g = 63;
-                int b = ((*pixel >> 10) & 0x3F) * eva / 16 + ((pixel2 >> 10) & 0x3F) * evb / 16; if (b > 63) b = 63;
-                *pixel = (b << 10) | (g << 5) | r;
+                pixelEffects[i] = EFFECT_NONE;
             }
         }
-        else if (blend && mode == 2) // Brightness increase
-        {
-            int r = (*pixel >>  0) & 0x3F; r += (63 - r) * bldY / 16;
-            int g = (*pixel >>  5) & 0x3F; g += (63 - g) * bldY / 16;
-            int b = (*pixel >> 10) & 0x3F; b += (63 - b) * bldY / 16;
-            *pixel = (b << 10) | (g << 5) | r;
-        }
-        else if (blend && mode == 3) // Brightness decrease
+    }
+
+    // Apply the color effects
+    // Blending is done with 18-bit colors on the DS
+    if (effects)
+    {
+        int eva = (bldAlpha & 0x001F) >> 0; if (eva > 16) eva = 16;
+        int evb = (bldAlpha & 0x1F00) >> 8; if (evb > 16) evb = 16;
+        applyEffects(pixels, belowPixels, pixelEffects, eva, evb, bldY);
+    }
+
+    state->pagesRead = pagesRead;
+}
+
+void Gpu2D::getLineKey(LineKey *key)
+{
+    // Gather the state that decides what a scanline looks like
+    // The key is cleared first so padding doesn't affect comparisons
+    memset(key, 0, sizeof(LineKey));
+    key->dispCnt = dispCnt;
+    memcpy(key->bgCnt, bgCnt, sizeof(bgCnt));
+    memcpy(key->bgHOfs, bgHOfs, sizeof(bgHOfs));
+    memcpy(key->bgVOfs, bgVOfs, sizeof(bgVOfs));
+    memcpy(key->bgPA, bgPA, sizeof(bgPA));
+    memcpy(key->bgPC, bgPC, sizeof(bgPC));
+    memcpy(key->internalX, internalX, sizeof(internalX));
+    memcpy(key->internalY, internalY, sizeof(internalY));
+    memcpy(key->winX1, winX1, sizeof(winX1));
+    memcpy(key->winX2, winX2, sizeof(winX2));
+    memcpy(key->winY1, winY1, sizeof(winY1));
+    memcpy(key->winY2, winY2, sizeof(winY2));
+    key->winIn = winIn;
+    key->winOut = winOut;
+    key->bldCnt = bldCnt;
+    key->bldAlpha = bldAlpha;
+    key->bldY = bldY;
+
+    // Mapping, palette and OAM changes, with VRAM contents checked separately for the pages that were read
+    key->mapEpoch = mapEpoch;
+    key->palVersion = palColorsVersion;
+    key->oamVersion = (dispCnt & BIT(12)) ? core->memory.getOamVersion() : 0;
+    for (int i = 0; i < 5; i++)
+    {
+        key->extPalData[i] = extPalettes[i];
+        key->extPalVersion[i] = extPalettes[i] ? extPalColorsVersion[i] : 0;
+    }
+}
+
+int Gpu2D::buildWindowSpans(int line, WindowSpan *spans)
+{
+    uint8_t enabled = BIT(5) | (dispCnt >> 8);
+
+    // Without windows, the whole line is a single span
+    if (!(dispCnt & 0x0000E000))
+    {
+        spans[0] = { 0, 256, enabled };
+        return 1;
+    }
+
+    // Get the range that windows 0 and 1 cover on the current line, if any
+    int x1[2] = {}, x2[2] = {};
+    for (int w = 0; w < 2; w++)
+    {
+        if ((dispCnt & BIT(13 + w)) && line >= winY1[w] && line < winY2[w] && winX1[w] < winX2[w])
         {
-            int r = (*pixel >>  0) & 0x3F; r -= r * bldY / 16;
-            int g = (*pixel >>  5) & 0x3F; g -= g * bldY / 16;
-            int b = (*pixel >> 10) & 0x3F; b -= b * bldY / 16;
-            *pixel = (b << 10) | (g << 5) | r;
+            x1[w] = (winX1[w] < 256) ? winX1[w] : 256;
+            x2[w] = (winX2[w] < 256) ? winX2[w] : 256;
         }
     }
+
+    // Split the line at the window edges
+    int edges[6] = { 0, x1[0], x2[0], x1[1], x2[1], 256 };
+    for (int i = 1; i < 6; i++)
+    {
+        for (int j = i; j > 0 && edges[j - 1] > edges[j]; j--)
+            SWAP(edges[j - 1], edges[j]);
+    }
+
+    // Disable layers in each piece based on the window covering it, merging pieces that end up the same
+    // The object window would need pixels marked by bit 24, which the 16-bit framebuffer can't hold, so it's never hit
+    int count = 0;
+    for (int i = 0; i < 5; i++)
+    {
+        int start = edges[i], end = edges[i + 1];
+        if (start >= end) continue;
+
+        uint8_t mask = enabled;
+        if (start >= x1[0] && start < x2[0])
+            mask &= winIn >> 0; // Window 0
+        else if (start >= x1[1] && start < x2[1])
+            mask &= winIn >> 8; // Window 1
+        else
+            mask &= winOut >> 0; // Outside of windows
+
+        if (count > 0 && spans[count - 1].enabled == mask)
+            spans[count - 1].end = end;
+        else
+            spans[count++] = { (uint16_t)start, (uint16_t)end, mask };
+    }
+
+    return count;
 }
 
 void Gpu2D::finishScanline(int line)
 {
+    // A line changed after drawing can't be reused as is
+    if (((dispCnt & 0x00030000) >> 16) != 1 || ((masterBright & 0xC000) >> 14) == 1 || ((masterBright & 0xC000) >> 14) == 2)
+        lineStates[line].valid = false;
+
     // Redraw the scanline if the display isn't set to layer mode
     switch ((dispCnt & 0x00030000) >> 16) // Display mode
     {
@@ -281,9 +558,11 @@ void Gpu2D::finishScanline(int line)
         case 2: // VRAM display
         {
             // Draw raw bitmap data from a VRAM block
-            uint32_t address = 0x6800000 + ((dispCnt & 0x000C0000) >> 18) * 0x20000 + line * 256 * 2;
+            // A line is 512 bytes, so it never crosses a 16KB page
+            uint32_t address = ((dispCnt & 0x000C0000) >> 18) * 0x20000 + line * 256 * 2;
+            uint8_t *page = core->memory.getLcdc()[address >> 14];
             for (int i = 0; i < 256; i++)
-                framebuffer[line * 256 + i] = (core->memory.read<uint16_t>(0, address + i * 2));
+                framebuffer[line * 256 + i] = page ? U8TO16(page, (address & 0x3FFF) + i * 2) : 0;
             break;
         }
 
@@ -296,186 +575,450 @@ void Gpu2D::finishScanline(int line)
 
     // Apply the master brightness
     // This is only on the DS, and is done with 18-bit colors
-    switch ((masterBright & 0xC000) >> 14) // Mode
+    int mode = (masterBright & 0xC000) >> 14;
+    int factor = (masterBright & 0x001F);
+    if (factor > 16) factor = 16;
+    if ((mode == 1 || mode == 2) && factor != 0)
+        applyBrightness(&framebuffer[line * 256], (mode == 1) ? EFFECT_BRIGHTEN : EFFECT_DARKEN, factor);
+}
+
+void Gpu2D::updateBlendTables()
+{
+    // Precompute each channel value's contribution to an alpha blend for the current coefficients
+    int eva = (bldAlpha & 0x001F) >> 0; if (eva > 16) eva = 16;
+    int evb = (bldAlpha & 0x1F00) >> 8; if (evb > 16) evb = 16;
+    for (int i = 0; i < 64; i++)
+    {
+        blendTableA[i] = i * eva / 16;
+        blendTableB[i] = i * evb / 16;
+    }
+}
+
+void Gpu2D::updateBrightnessTables()
+{
+    // Precompute the brightness increase and decrease of each channel value for the current coefficient
+    for (int i = 0; i < 64; i++)
     {
-        case 1: // Up
+        brightenTable[i] = i + (63 - i) * bldY / 16;
+        darkenTable[i] = i - i * bldY / 16;
+    }
+}
+
+void Gpu2D::updateMasterTable()
+{
+    // Precompute the master brightness of each channel value for the current mode and factor
+    int mode = (masterBright & 0xC000) >> 14;
+    int factor = (masterBright & 0x001F);
+    if (factor > 16) factor = 16;
+    for (int i = 0; i < 64; i++)
+    {
+        if (mode == 1) // Up
+            masterTable[i] = i + (63 - i) * factor / 16;
+        else if (mode == 2) // Down
+            masterTable[i] = i - i * factor / 16;
+        else
+            masterTable[i] = i;
+    }
+}
+
+void Gpu2D::applyEffectsScalar(uint16_t *pixels, const uint16_t *below, const uint8_t *effects, int eva, int evb, int evy)
+{
+    // Apply the color effect chosen for each pixel, one pixel at a time
+    for (int i = 0; i < 256; i++)
+    {
+        uint16_t *pixel = &pixels[i];
+
+        switch (effects[i])
         {
-            // Get the brightness factor
-            int factor = (masterBright & 0x001F);
-            if (factor==0) break;
-            if (factor > 16) factor = 16;
+            case EFFECT_ALPHA: // Alpha blending
+            {
+                int r = ((*pixel >>  0) & 0x3F) * eva / 16 + ((below[i] >>  0) & 0x3F) * evb / 16; if (r > 63) r = 63;
+                int g = ((*pixel >>  5) & 0x3F) * eva / 16 + ((below[i] >>  5) & 0x3F) * evb / 16; if (g > 63) g = 63;
+                int b = ((*pixel >> 10) & 0x3F) * eva / 16 + ((below[i] >> 10) & 0x3F) * evb / 16; if (b > 63) b = 63;
+                *pixel = (b << 10) | (g << 5) | r;
+                break;
+            }
 
-            for (int i = 0; i < 256; i++)
+            case EFFECT_BRIGHTEN: // Brightness increase
             {
-                // Extract the RGB values
-                uint16_t *pixel = &framebuffer[line * 256 + i];
-                uint8_t r = (*pixel >>  0) & 0x3F;
-                uint8_t g = (*pixel >>  5) & 0x3F;
-                uint8_t b = (*pixel >> 10) & 0x3F;
-
-                // Adjust the values and put them back
-                r += (63 - r) * factor / 16;
-                g += (63 - g) * factor / 16;
-                b += (63 - b) * factor / 16;
-                *pixel = (0 << 15) | (b << 10) | (g << 5) | r;
+                int r = (*pixel >>  0) & 0x3F; r += (63 - r) * evy / 16;
+                int g = (*pixel >>  5) & 0x3F; g += (63 - g) * evy / 16;
+                int b = (*pixel >> 10) & 0x3F; b += (63 - b) * evy / 16;
+                *pixel = (b << 10) | (g << 5) | r;
+                break;
             }
 
-            break;
+            case EFFECT_DARKEN: // Brightness decrease
+            {
+                int r = (*pixel >>  0) & 0x3F; r -= r * evy / 16;
+                int g = (*pixel >>  5) & 0x3F; g -= g * evy / 16;
+                int b = (*pixel >> 10) & 0x3F; b -= b * evy / 16;
+                *pixel = (b << 10) | (g << 5) | r;
+                break;
+            }
         }
+    }
+}
+
+void Gpu2D::applyBrightnessScalar(uint16_t *pixels, int effect, int factor)
+{
+    // Apply a brightness effect to every pixel, one pixel at a time
+    uint8_t effects[256];
+    memset(effects, effect, sizeof(effects));
+    applyEffectsScalar(pixels, nullptr, effects, 0, 0, factor);
+}
 
-        case 2: // Down
+#if defined(GPU2D_SCALAR)
+
+void Gpu2D::applyEffects(uint16_t *pixels, const uint16_t *below, const uint8_t *effects, int eva, int evb, int evy)
+{
+    applyEffectsScalar(pixels, below, effects, eva, evb, evy);
+}
+
+void Gpu2D::applyBrightness(uint16_t *pixels, int effect, int factor)
+{
+    applyBrightnessScalar(pixels, effect, factor);
+}
+
+#elif defined(GPU2D_TABLES)
+
+// Look up each of a pixel's 6-bit channels in a table, which overlap by a bit like in the scalar code
+#define LOOKUP(table, p) (((table)[((p) >> 10) & 0x3F] << 10) | ((table)[((p) >> 5) & 0x3F] << 5) | (table)[(p) & 0x3F])
+
+void Gpu2D::applyEffects(uint16_t *pixels, const uint16_t *below, const uint8_t *effects, int eva, int evb, int evy)
+{
+    // The coefficients are already in the tables, which are rebuilt whenever they change
+    for (int i = 0; i < 256; i++)
+    {
+        uint16_t *pixel = &pixels[i];
+
+        switch (effects[i])
         {
-            // Get the brightness factor
-            int factor = (masterBright & 0x001F);
-            if (factor==0) break;
-            if (factor > 16) factor = 16;
+            case EFFECT_ALPHA: // Alpha blending
+            {
+                int r = blendTableA[(*pixel >>  0) & 0x3F] + blendTableB[(below[i] >>  0) & 0x3F]; if (r > 63) r = 63;
+                int g = blendTableA[(*pixel >>  5) & 0x3F] + blendTableB[(below[i] >>  5) & 0x3F]; if (g > 63) g = 63;
+                int b = blendTableA[(*pixel >> 10) & 0x3F] + blendTableB[(below[i] >> 10) & 0x3F]; if (b > 63) b = 63;
+                *pixel = (b << 10) | (g << 5) | r;
+                break;
+            }
 
-            for (int i = 0; i < 256; i++)
+            case EFFECT_BRIGHTEN: // Brightness increase
             {
-                // Extract the RGB values
-                uint16_t *pixel = &framebuffer[line * 256 + i];
-                uint8_t r = (*pixel >>  0) & 0x3F;
-                uint8_t g = (*pixel >>  5) & 0x3F;
-                uint8_t b = (*pixel >> 10) & 0x3F;
-                uint8_t a = (*pixel >> 15) & 0x2;
-
-                // Adjust the values and put them back
-                r -= r * factor / 16;
-                g -= g * factor / 16;
-                b -= b * factor / 16;
-                *pixel =  (a << 15) | (b << 10) | (g << 5) | r;
+                *pixel = LOOKUP(brightenTable, *pixel);
+                break;
             }
 
-            break;
+            case EFFECT_DARKEN: // Brightness decrease
+            {
+                *pixel = LOOKUP(darkenTable, *pixel);
+                break;
+            }
         }
     }
 }
 
-void Gpu2D::drawText(int bg, int line)
+void Gpu2D::applyBrightness(uint16_t *pixels, int effect, int factor)
+{
+    // The master brightness table already holds the effect for the current mode and factor
+    for (int i = 0; i < 256; i++)
+        pixels[i] = LOOKUP(masterTable, pixels[i]);
+}
+
+#undef LOOKUP
+
+#elif defined(__SSE2__)
+
+// Split 8 pixels into their 6-bit channels, which overlap by a bit like in the scalar code
+#define CHANNELS(c, p)                                      \
+    __m128i c##0 = _mm_and_si128(p, mask);                  \
+    __m128i c##1 = _mm_and_si128(_mm_srli_epi16(p, 5), mask);  \
+    __m128i c##2 = _mm_and_si128(_mm_srli_epi16(p, 10), mask);
+
+#define COMBINE(c0, c1, c2) _mm_or_si128(_mm_or_si128(_mm_slli_epi16(c2, 10), _mm_slli_epi16(c1, 5)), c0)
+
+static FORCE_INLINE __m128i blendChannel(__m128i t, __m128i b, __m128i eva, __m128i evb, __m128i max)
+{
+    return _mm_min_epi16(_mm_add_epi16(_mm_srli_epi16(_mm_mullo_epi16(t, eva), 4), _mm_srli_epi16(_mm_mullo_epi16(b, evb), 4)), max);
+}
+
+static FORCE_INLINE __m128i brightenChannel(__m128i t, __m128i evy, __m128i max)
+{
+    return _mm_add_epi16(t, _mm_srli_epi16(_mm_mullo_epi16(_mm_sub_epi16(max, t), evy), 4));
+}
+
+static FORCE_INLINE __m128i darkenChannel(__m128i t, __m128i evy)
+{
+    return _mm_sub_epi16(t, _mm_srli_epi16(_mm_mullo_epi16(t, evy), 4));
+}
+
+void Gpu2D::applyEffects(uint16_t *pixels, const uint16_t *below, const uint8_t *effects, int eva, int evb, int evy)
+{
+    const __m128i mask = _mm_set1_epi16(0x3F);
+    const __m128i vEva = _mm_set1_epi16(eva), vEvb = _mm_set1_epi16(evb), vEvy = _mm_set1_epi16(evy);
+
+    // Calculate every effect for 8 pixels at a time, and keep the one chosen for each pixel
+    for (int i = 0; i < 256; i += 8)
+    {
+        __m128i top = _mm_loadu_si128((__m128i*)&pixels[i]);
+        __m128i bot = _mm_loadu_si128((__m128i*)&below[i]);
+        __m128i eff = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)&effects[i]), _mm_setzero_si128());
+        CHANNELS(t, top)
+        CHANNELS(b, bot)
+
+        __m128i alpha   = COMBINE(blendChannel(t0, b0, vEva, vEvb, mask), blendChannel(t1, b1, vEva, vEvb, mask), blendChannel(t2, b2, vEva, vEvb, mask));
+        __m128i brighten = COMBINE(brightenChannel(t0, vEvy, mask), brightenChannel(t1, vEvy, mask), brightenChannel(t2, vEvy, mask));
+        __m128i darken   = COMBINE(darkenChannel(t0, vEvy), darkenChannel(t1, vEvy), darkenChannel(t2, vEvy));
+
+        __m128i isAlpha    = _mm_cmpeq_epi16(eff, _mm_set1_epi16(EFFECT_ALPHA));
+        __m128i isBrighten = _mm_cmpeq_epi16(eff, _mm_set1_epi16(EFFECT_BRIGHTEN));
+        __m128i isDarken   = _mm_cmpeq_epi16(eff, _mm_set1_epi16(EFFECT_DARKEN));
+        __m128i isNone     = _mm_cmpeq_epi16(eff, _mm_setzero_si128());
+
+        __m128i result = _mm_or_si128(_mm_and_si128(isAlpha, alpha), _mm_and_si128(isNone, top));
+        result = _mm_or_si128(result, _mm_or_si128(_mm_and_si128(isBrighten, brighten), _mm_and_si128(isDarken, darken)));
+        _mm_storeu_si128((__m128i*)&pixels[i], result);
+    }
+}
+
+void Gpu2D::applyBrightness(uint16_t *pixels, int effect, int factor)
 {
-    // If 3D is enabled, render it to BG0 in text mode
-    if (bg == 0 && (dispCnt & BIT(3)))
+    const __m128i mask = _mm_set1_epi16(0x3F);
+    const __m128i vEvy = _mm_set1_epi16(factor);
+
+    // Apply the same brightness effect to 8 pixels at a time
+    for (int i = 0; i < 256; i += 8)
     {
-        /*sceKernelDcacheWritebackInvalidateAll();
-		sceDmacMemcpy(layers[bg], core->gpu3DRenderer.getFramebuffer(line),  256 * sizeof(uint32_t));
-		sceKernelDcacheWritebackInvalidateAll();*/
-        memcpy(layers[bg], core->gpu3DRenderer.getFramebuffer(line), 256 * sizeof(uint32_t));
-        return;
+        __m128i top = _mm_loadu_si128((__m128i*)&pixels[i]);
+        CHANNELS(t, top)
+
+        if (effect == EFFECT_BRIGHTEN)
+            top = COMBINE(brightenChannel(t0, vEvy, mask), brightenChannel(t1, vEvy, mask), brightenChannel(t2, vEvy, mask));
+        else
+            top = COMBINE(darkenChannel(t0, vEvy), darkenChannel(t1, vEvy), darkenChannel(t2, vEvy));
+
+        _mm_storeu_si128((__m128i*)&pixels[i], top);
     }
+}
 
-    // Get the base data addresses
-    uint32_t tileBase  = bgVramAddr + ((bgCnt[bg] & 0x1F00) >> 8) * 0x0800 + ((dispCnt & 0x38000000) >> 27) * 0x10000;
-    uint32_t indexBase = bgVramAddr + ((bgCnt[bg] & 0x003C) >> 2) * 0x4000 + ((dispCnt & 0x07000000) >> 24) * 0x10000;
+#undef CHANNELS
+#undef COMBINE
 
-    // Move the tile address to the current line
-    int yOffset = (line + bgVOfs[bg]) % 512;
-    tileBase += ((yOffset / 8) % 32) * 64;
+#elif defined(__ARM_NEON)
 
-    // If the Y-offset exceeds 256 and the background is 512 pixels tall, move to the next 256x256 section
-    // If the background is 512 pixels wide, move 2 sections to skip the second X section
-    if (yOffset >= 256 && (bgCnt[bg] & BIT(15)))
-        tileBase += (bgCnt[bg] & BIT(14)) ? 0x1000 : 0x800;
+// Split 8 pixels into their 6-bit channels, which overlap by a bit like in the scalar code
+#define CHANNELS(c, p)                                  \
+    uint16x8_t c##0 = vandq_u16(p, mask);               \
+    uint16x8_t c##1 = vandq_u16(vshrq_n_u16(p, 5), mask);  \
+    uint16x8_t c##2 = vandq_u16(vshrq_n_u16(p, 10), mask);
 
-    // Draw a line
-    if (bgCnt[bg] & BIT(7)) // 8-bit
+#define COMBINE(c0, c1, c2) vorrq_u16(vorrq_u16(vshlq_n_u16(c2, 10), vshlq_n_u16(c1, 5)), c0)
+
+static FORCE_INLINE uint16x8_t blendChannel(uint16x8_t t, uint16x8_t b, uint16x8_t eva, uint16x8_t evb, uint16x8_t max)
+{
+    return vminq_u16(vaddq_u16(vshrq_n_u16(vmulq_u16(t, eva), 4), vshrq_n_u16(vmulq_u16(b, evb), 4)), max);
+}
+
+static FORCE_INLINE uint16x8_t brightenChannel(uint16x8_t t, uint16x8_t evy, uint16x8_t max)
+{
+    return vaddq_u16(t, vshrq_n_u16(vmulq_u16(vsubq_u16(max, t), evy), 4));
+}
+
+static FORCE_INLINE uint16x8_t darkenChannel(uint16x8_t t, uint16x8_t evy)
+{
+    return vsubq_u16(t, vshrq_n_u16(vmulq_u16(t, evy), 4));
+}
+
+void Gpu2D::applyEffects(uint16_t *pixels, const uint16_t *below, const uint8_t *effects, int eva, int evb, int evy)
+{
+    const uint16x8_t mask = vdupq_n_u16(0x3F);
+    const uint16x8_t vEva = vdupq_n_u16(eva), vEvb = vdupq_n_u16(evb), vEvy = vdupq_n_u16(evy);
+
+    // Calculate every effect for 8 pixels at a time, and keep the one chosen for each pixel
+    for (int i = 0; i < 256; i += 8)
     {
-        for (int i = 0; i <= 256; i += 8)
-        {
-            // Move the tile address to the current tile
-            int xOffset = (bgHOfs[bg] + i) % 512;
-            uint32_t tileAddr = tileBase + ((xOffset / 8) % 32) * 2;
+        uint16x8_t top = vld1q_u16(&pixels[i]);
+        uint16x8_t bot = vld1q_u16(&below[i]);
+        uint16x8_t eff = vmovl_u8(vld1_u8(&effects[i]));
+        CHANNELS(t, top)
+        CHANNELS(b, bot)
+
+        uint16x8_t alpha    = COMBINE(blendChannel(t0, b0, vEva, vEvb, mask), blendChannel(t1, b1, vEva, vEvb, mask), blendChannel(t2, b2, vEva, vEvb, mask));
+        uint16x8_t brighten = COMBINE(brightenChannel(t0, vEvy, mask), brightenChannel(t1, vEvy, mask), brightenChannel(t2, vEvy, mask));
+        uint16x8_t darken   = COMBINE(darkenChannel(t0, vEvy), darkenChannel(t1, vEvy), darkenChannel(t2, vEvy));
+
+        uint16x8_t result = vbslq_u16(vceqq_u16(eff, vdupq_n_u16(EFFECT_ALPHA)), alpha, top);
+        result = vbslq_u16(vceqq_u16(eff, vdupq_n_u16(EFFECT_BRIGHTEN)), brighten, result);
+        result = vbslq_u16(vceqq_u16(eff, vdupq_n_u16(EFFECT_DARKEN)), darken, result);
+        vst1q_u16(&pixels[i], result);
+    }
+}
 
-            // If the X-offset exceeds 256 and the background is 512 pixels wide, move to the next 256x256 section
-            if (xOffset >= 256 && (bgCnt[bg] & BIT(14)))
-                tileAddr += 0x800;
+void Gpu2D::applyBrightness(uint16_t *pixels, int effect, int factor)
+{
+    const uint16x8_t mask = vdupq_n_u16(0x3F);
+    const uint16x8_t vEvy = vdupq_n_u16(factor);
 
-            // Get the current tile
-            uint16_t tile = core->memory.read<uint16_t>(false, tileAddr);
+    // Apply the same brightness effect to 8 pixels at a time
+    for (int i = 0; i < 256; i += 8)
+    {
+        uint16x8_t top = vld1q_u16(&pixels[i]);
+        CHANNELS(t, top)
 
-            // Get the tile's palette
-            uint8_t *pal;
-            if (dispCnt & BIT(30)) // Extended palette
+        if (effect == EFFECT_BRIGHTEN)
+            top = COMBINE(brightenChannel(t0, vEvy, mask), brightenChannel(t1, vEvy, mask), brightenChannel(t2, vEvy, mask));
+        else
+            top = COMBINE(darkenChannel(t0, vEvy), darkenChannel(t1, vEvy), darkenChannel(t2, vEvy));
+
+        vst1q_u16(&pixels[i], top);
+    }
+}
+
+#undef CHANNELS
+#undef COMBINE
+
+#else
+
+void Gpu2D::applyEffects(uint16_t *pixels, const uint16_t *below, const uint8_t *effects, int eva, int evb, int evy)
+{
+    // Without SIMD, the effects are applied in a single pass that works on 3 channels at once
+    // The channels are spread out into 32 bits with room to multiply, like a small vector register
+    for (int i = 0; i < 256; i++)
+    {
+        uint32_t t = pixels[i];
+        uint32_t top = ((t & 0x3F) << 0) | (((t >> 5) & 0x3F) << 10) | (((t >> 10) & 0x3F) << 20);
+        uint32_t result;
+
+        switch (effects[i])
+        {
+            case EFFECT_ALPHA: // Alpha blending
             {
-                // Determine the extended palette slot
-                // Backgrounds 0 and 1 can alternatively use slots 2 and 3
-                int slot = (bg < 2 && (bgCnt[bg] & BIT(13))) ? (bg + 2) : bg;
+                uint32_t b = below[i];
+                uint32_t bot = ((b & 0x3F) << 0) | (((b >> 5) & 0x3F) << 10) | (((b >> 10) & 0x3F) << 20);
+                result = (((top * eva) >> 4) & 0x3F0FC3F) + (((bot * evb) >> 4) & 0x3F0FC3F);
 
-                // In extended palette mode, the tile can select from multiple 256-color palettes
-                if (!extPalettes[slot]) return;
-                pal = &extPalettes[slot][(tile & 0xF000) >> 3];
+                // Clamp each channel to 63
+                uint32_t over = result & (BIT(6) | BIT(16) | BIT(26));
+                result = (result | (over - (over >> 6))) & 0x3F0FC3F;
+                break;
             }
-            else // Standard palette
+
+            case EFFECT_BRIGHTEN: // Brightness increase
             {
-                pal = palette;
+                result = top + ((((0x3F0FC3F - top) * evy) >> 4) & 0x3F0FC3F);
+                break;
             }
 
-            // Get the palette indices for the current line of the tile, flipped vertically if enabled
-            uint32_t indexAddr = indexBase + (tile & 0x03FF) * 64 + ((tile & BIT(11)) ? ((7 - yOffset % 8) * 8) : ((yOffset % 8) * 8));
-            uint64_t indices = core->memory.read<uint32_t>(false, indexAddr) |
-                ((uint64_t)core->memory.read<uint32_t>(false, indexAddr + 4) << 32);
-
-            // Draw the current line of the tile
-            for (int j = 0; j < 8; j++)
+            case EFFECT_DARKEN: // Brightness decrease
             {
-                // Flip the tile horizontally if enabled
-                int offset = i - (xOffset % 8) + ((tile & BIT(10)) ? (7 - j) : j);
-
-                // Draw a pixel
-                if (offset >= 0 && offset < 256 && (indices & 0xFF))
-                    layers[bg][offset] = U8TO16(pal, (indices & 0xFF) * 2) | BIT(15);
+                result = top - (((top * evy) >> 4) & 0x3F0FC3F);
+                break;
+            }
 
-                // Move to the next palette index
-                indices >>= 8;
+            default:
+            {
+                continue;
             }
         }
+
+        pixels[i] = ((result >> 20) << 10) | (((result >> 10) & 0x3FF) << 5) | (result & 0x3FF);
     }
-    else // 4-bit
-    {
-        for (int i = 0; i <= 256; i += 8)
-        {
-            // Move the tile address to the current tile
-            int xOffset = (bgHOfs[bg] + i) % 512;
-            uint32_t tileAddr = tileBase + ((xOffset / 8) % 32) * 2;
+}
 
-            // If the X-offset exceeds 256 and the background is 512 pixels wide, move to the next 256x256 section
-            if (xOffset >= 256 && (bgCnt[bg] & BIT(14)))
-                tileAddr += 0x800;
+void Gpu2D::applyBrightness(uint16_t *pixels, int effect, int factor)
+{
+    uint8_t effects[256];
+    memset(effects, effect, sizeof(effects));
+    applyEffects(pixels, nullptr, effects, 0, 0, factor);
+}
 
-            // Get the current tile
-            uint16_t tile = core->memory.read<uint16_t>(false, tileAddr);
+#endif
 
-            // Get the tile's palette
-            // In 4-bit mode, the tile can select from multiple 16-color palettes
-            uint8_t *pal = &palette[((tile & 0xF000) >> 12) * 32];
+void Gpu2D::draw3D(int bg, int line)
+{
+    // If 3D is enabled, it's rendered to BG0 in place of text mode
+    /*sceKernelDcacheWritebackInvalidateAll();
+    sceDmacMemcpy(layers[bg], core->gpu3DRenderer.getFramebuffer(line),  256 * sizeof(uint32_t));
+    sceKernelDcacheWritebackInvalidateAll();*/
+    core->gpu3DRenderer.waitScanline(line);
+    memcpy(layers[bg], core->gpu3DRenderer.getFramebuffer(line), 256 * sizeof(uint32_t));
+}
 
-            // Get the palette indices for the current line of the tile, flipped vertically if enabled
-            uint32_t indexAddr = indexBase + (tile & 0x03FF) * 32 + ((tile & BIT(11)) ? ((7 - yOffset % 8) * 4) : ((yOffset % 8) * 4));
-            uint32_t indices = core->memory.read<uint32_t>(false, indexAddr);
+template <bool bpp8, bool extPal, bool wide> void Gpu2D::drawText(int bg, int line)
+{
+    // Get the base data addresses
+    uint32_t tileBase  = bgVramAddr + ((bgCnt[bg] & 0x1F00) >> 8) * 0x0800 + ((dispCnt & 0x38000000) >> 27) * 0x10000;
+    uint32_t indexBase = bgVramAddr + ((bgCnt[bg] & 0x003C) >> 2) * 0x4000 + ((dispCnt & 0x07000000) >> 24) * 0x10000;
 
-            // Draw the current line of the tile
-            for (int j = 0; j < 8; j++)
-            {
-                // Flip the tile horizontally if enabled
-                int offset = i - (xOffset % 8) + ((tile & BIT(10)) ? (7 - j) : j);
+    // Move the tile address to the current line
+    int yOffset = (line + bgVOfs[bg]) % 512;
+    tileBase += ((yOffset / 8) % 32) * 64;
 
-                // Draw a pixel
-                if (offset >= 0 && offset < 256 && (indices & 0xF))
-                    layers[bg][offset] = U8TO16(pal, (indices & 0xF) * 2) | BIT(15);
+    // If the Y-offset exceeds 256 and the background is 512 pixels tall, move to the next 256x256 section
+    // If the background is 512 pixels wide, move 2 sections to skip the second X section
+    if (yOffset >= 256 && (bgCnt[bg] & BIT(15)))
+        tileBase += wide ? 0x1000 : 0x800;
 
-                // Move to the next palette index
-                indices >>= 4;
-            }
+    // Get the version of the converted palette, which stays the same for the whole line
+    // Backgrounds 0 and 1 can alternatively use extended palette slots 2 and 3
+    int slot = (bg < 2 && (bgCnt[bg] & BIT(13))) ? (bg + 2) : bg;
+    if (extPal && !extPalettes[slot]) return;
+    uint32_t palVersion = extPal ? extPalColorsVersion[slot] : palColorsVersion;
+
+    // Draw a line
+    for (int i = 0; i <= 256; i += 8)
+    {
+        // Move the tile address to the current tile
+        int xOffset = (bgHOfs[bg] + i) % 512;
+        uint32_t tileAddr = tileBase + ((xOffset / 8) % 32) * 2;
+
+        // If the X-offset exceeds 256 and the background is 512 pixels wide, move to the next 256x256 section
+        if (wide && xOffset >= 256)
+            tileAddr += 0x800;
+
+        // Get the current tile
+        uint16_t tile = readBg<uint16_t>(tileAddr);
+
+        // Get the tile's palette
+        // In extended palette mode, 8-bit tiles can select from multiple 256-color palettes
+        // 4-bit tiles can always select from multiple 16-color palettes
+        const uint32_t *pal;
+        if (extPal)
+            pal = &extPalColors[slot][((tile & 0xF000) >> 12) * 256];
+        else if (bpp8)
+            pal = palColors;
+        else
+            pal = &palColors[((tile & 0xF000) >> 12) * 16];
+
+        // Get the palette indices for the current line of the tile, flipped vertically if enabled
+        // Unmapped VRAM reads as zero, which is fully transparent
+        const int rowSize = bpp8 ? 8 : 4;
+        uint32_t indexAddr = indexBase + (tile & 0x03FF) * rowSize * 8 + ((tile & BIT(11)) ? (7 - yOffset % 8) : (yOffset % 8)) * rowSize;
+        int index = (indexAddr & bgPageMask) >> 14;
+        uint8_t *page = bgPages[index];
+        pagesRead |= (uint64_t)1 << index;
+        if (!page) continue;
+
+        // Draw the part of the tile's line that's on screen, decoded and flipped horizontally if enabled
+        TileLine *tileLine = getTileLine(&page[indexAddr & 0x3FFF], pal, palVersion, bpp8, tile & BIT(10));
+        int x = i - (xOffset % 8);
+        int start = (x < 0) ? -x : 0;
+        int end = (x > 248) ? (256 - x) : 8;
+        for (int j = start; j < end; j++)
+        {
+            if (tileLine->opaque & BIT(j))
+                layers[bg][x + j] = tileLine->colors[j];
         }
     }
 }
 
-void Gpu2D::drawAffine(int bg, int line)
+template <bool wrap> void Gpu2D::drawAffine(int bg, int line)
 {
     // Get the base data addresses
     uint32_t tileBase  = bgVramAddr + ((bgCnt[bg] & 0x1F00) >> 8) * 0x0800 + ((dispCnt & 0x38000000) >> 27) * 0x10000;
     uint32_t indexBase = bgVramAddr + ((bgCnt[bg] & 0x003C) >> 2) * 0x4000 + ((dispCnt & 0x07000000) >> 24) * 0x10000;
 
-    // Get the background's size
+    // Get the background's size, which is always a power of 2
     int size = 128 << ((bgCnt[bg] & 0xC000) >> 14);
 
     // Draw a line
@@ -486,10 +1029,10 @@ void Gpu2D::drawAffine(int bg, int line)
         int rotscaleY = (internalY[bg - 2] + bgPC[bg - 2] * i) >> 8;
 
         // Handle display area overflow
-        if (bg < 2 || (bgCnt[bg] & BIT(13))) // Wraparound
+        if (wrap) // Wraparound
         {
-            rotscaleX %= size; if (rotscaleX < 0) rotscaleX += size;
-            rotscaleY %= size; if (rotscaleY < 0) rotscaleY += size;
+            rotscaleX &= size - 1;
+            rotscaleY &= size - 1;
         }
         else if (rotscaleX < 0 || rotscaleX >= size || rotscaleY < 0 || rotscaleY >= size) // Transparent
         {
@@ -497,15 +1040,15 @@ void Gpu2D::drawAffine(int bg, int line)
         }
 
         // Get the current tile
-        uint8_t tile = core->memory.read<uint8_t>(false, tileBase + (rotscaleY / 8) * (size / 8) + (rotscaleX / 8));
+        uint8_t tile = readBg<uint8_t>(tileBase + (rotscaleY / 8) * (size / 8) + (rotscaleX / 8));
 
         // Get the palette index for the current pixel of the tile
         uint32_t indexAddr = indexBase + tile * 64 + (rotscaleY % 8) * 8 + (rotscaleX % 8);
-        uint8_t index = core->memory.read<uint8_t>(false, indexAddr);
+        uint8_t index = readBg<uint8_t>(indexAddr);
 
         // Draw a pixel
         if (index)
-            layers[bg][i] = U8TO16(palette, index * 2) | BIT(15);
+            layers[bg][i] = palColors[index];
     }
 
     // Increment the internal registers at the end of the scanline
@@ -513,84 +1056,72 @@ void Gpu2D::drawAffine(int bg, int line)
     internalY[bg - 2] += bgPD[bg - 2];
 }
 
-void Gpu2D::drawExtended(int bg, int line)
+template <int type, bool wrap> void Gpu2D::drawExtended(int bg, int line)
 {
-    if ((bgCnt[bg] & BIT(7))) // Bitmap
+    if (type == EXT_DIRECT || type == EXT_BITMAP) // Bitmap
     {
-        uint32_t dataBase = bgVramAddr;
-        int sizeX, sizeY;
         // Get the base data address
-        dataBase += ((bgCnt[bg] & 0x1F00) >> 8) * 0x4000;
+        uint32_t dataBase = bgVramAddr + ((bgCnt[bg] & 0x1F00) >> 8) * 0x4000;
 
-        // Get the bitmap size
+        // Get the bitmap size, which is always a power of 2
+        int sizeX, sizeY;
         switch ((bgCnt[bg] & 0xC000) >> 14)
         {
-            case 0: sizeX = 128; sizeY = 128; break;
-            case 1: sizeX = 256; sizeY = 256; break;
-            case 2: sizeX = 512; sizeY = 256; break;
-            case 3: sizeX = 512; sizeY = 512; break;
+            case 0:  sizeX = 128; sizeY = 128; break;
+            case 1:  sizeX = 256; sizeY = 256; break;
+            case 2:  sizeX = 512; sizeY = 256; break;
+            default: sizeX = 512; sizeY = 512; break;
         }
-    
-        if (bgCnt[bg] & BIT(2)) // Direct color bitmap
+
+        // Draw a line
+        for (int i = 0; i < 256; i++)
         {
-            // Draw a line
-            for (int i = 0; i < 256; i++)
-            {
-                // Calculate the rotscaled coordinates relative to the background
-                int rotscaleX = (internalX[bg - 2] + bgPA[bg - 2] * i) >> 8;
-                int rotscaleY = (internalY[bg - 2] + bgPC[bg - 2] * i) >> 8;
+            // Calculate the rotscaled coordinates relative to the background
+            int rotscaleX = (internalX[bg - 2] + bgPA[bg - 2] * i) >> 8;
+            int rotscaleY = (internalY[bg - 2] + bgPC[bg - 2] * i) >> 8;
 
-                // Handle display area overflow
-                if (bgCnt[bg] & BIT(13)) // Wraparound
-                {
-                    rotscaleX %= sizeX; if (rotscaleX < 0) rotscaleX += sizeX;
-                    rotscaleY %= sizeY; if (rotscaleY < 0) rotscaleY += sizeY;
-                }
-                else if (rotscaleX < 0 || rotscaleX >= sizeX || rotscaleY < 0 || rotscaleY >= sizeY) // Transparent
-                {
-                    continue;
-                }
+            // Handle display area overflow
+            if (wrap) // Wraparound
+            {
+                rotscaleX &= sizeX - 1;
+                rotscaleY &= sizeY - 1;
+            }
+            else if (rotscaleX < 0 || rotscaleX >= sizeX || rotscaleY < 0 || rotscaleY >= sizeY) // Transparent
+            {
+                continue;
+            }
 
+            if (type == EXT_DIRECT) // Direct color bitmap
+            {
                 // Draw a pixel
-                layers[bg][i] = core->memory.read<uint16_t>(false, dataBase + (rotscaleY * sizeX + rotscaleX) * 2);
+                layers[bg][i] = readBg<uint16_t>(dataBase + (rotscaleY * sizeX + rotscaleX) * 2);
             }
-        }
-        else // 256 color bitmap
-        {
-            // Draw a line
-            for (int i = 0; i < 256; i++)
+            else // 256 color bitmap
             {
-                // Calculate the rotscaled coordinates relative to the background
-                int rotscaleX = (internalX[bg - 2] + bgPA[bg - 2] * i) >> 8;
-                int rotscaleY = (internalY[bg - 2] + bgPC[bg - 2] * i) >> 8;
-
-                // Handle display area overflow
-                if (bgCnt[bg] & BIT(13)) // Wraparound
-                {
-                    rotscaleX %= sizeX; if (rotscaleX < 0) rotscaleX += sizeX;
-                    rotscaleY %= sizeY; if (rotscaleY < 0) rotscaleY += sizeY;
-                }
-                else if (rotscaleX < 0 || rotscaleX >= sizeX || rotscaleY < 0 || rotscaleY >= sizeY) // Transparent
-                {
-                    continue;
-                }
-
                 // Get the palette index for the current pixel
-                uint8_t index = core->memory.read<uint8_t>(false, dataBase + rotscaleY * sizeX + rotscaleX);
+                uint8_t index = readBg<uint8_t>(dataBase + rotscaleY * sizeX + rotscaleX);
 
                 // Draw a pixel
                 if (index)
-                    layers[bg][i] = U8TO16(palette, index * 2) | BIT(15);
+                    layers[bg][i] = palColors[index];
             }
         }
     }
     else // Extended affine
     {
+        // In extended palette mode, the tile can select from multiple 256-color palettes
+        if (type == EXT_AFFINE_EXTPAL && !extPalettes[bg])
+        {
+            internalX[bg - 2] += bgPB[bg - 2];
+            internalY[bg - 2] += bgPD[bg - 2];
+            return;
+        }
+
         // Get the base data addresses
         uint32_t tileBase  = bgVramAddr + ((bgCnt[bg] & 0x1F00) >> 8) * 0x0800 + ((dispCnt & 0x38000000) >> 27) * 0x10000;
         uint32_t indexBase = bgVramAddr + ((bgCnt[bg] & 0x003C) >> 2) * 0x4000 + ((dispCnt & 0x07000000) >> 24) * 0x10000;
 
-        // Get the background's size
+        // Get the background's size, which is always a power of 2
         int size = 128 << ((bgCnt[bg] & 0xC000) >> 14);
 
         // Draw a line
@@ -601,10 +1132,10 @@ void Gpu2D::drawExtended(int bg, int line)
             int rotscaleY = (internalY[bg - 2] + bgPC[bg - 2] * i) >> 8;
 
             // Handle display area overflow
-            if (bg < 2 || (bgCnt[bg] & BIT(13))) // Wraparound
+            if (wrap) // Wraparound
             {
-                rotscaleX %= size; if (rotscaleX < 0) rotscaleX += size;
-                rotscaleY %= size; if (rotscaleY < 0) rotscaleY += size;
+                rotscaleX &= size - 1;
+                rotscaleY &= size - 1;
             }
             else if (rotscaleX < 0 || rotscaleX >= size || rotscaleY < 0 || rotscaleY >= size) // Transparent
             {
@@ -613,30 +1144,20 @@ void Gpu2D::drawExtended(int bg, int line)
 
             // Get the current tile
             uint32_t tileAddr = tileBase + ((rotscaleY / 8) * (size / 8) + (rotscaleX / 8)) * 2;
-            uint16_t tile = core->memory.read<uint16_t>(false, tileAddr);
+            uint16_t tile = readBg<uint16_t>(tileAddr);
 
             // Get the tile's palette
-            uint8_t *pal;
-            if (dispCnt & BIT(30)) // Extended palette
-            {
-                // In extended palette mode, the tile can select from multiple 256-color palettes
-                if (!extPalettes[bg]) continue;
-                pal = &extPalettes[bg][(tile & 0xF000) >> 3];
-            }
-            else // Standard palette
-            {
-                pal = palette;
-            }
+            const uint32_t *pal = (type == EXT_AFFINE_EXTPAL) ? &extPalColors[bg][((tile & 0xF000) >> 12) * 256] : palColors;
 
             // Get the palette index for the current pixel of the tile, flipped vertically or horizontally if enabled
             uint32_t indexAddr = indexBase + (tile & 0x03FF) * 64;
             indexAddr += ((tile & BIT(11)) ? (7 - rotscaleY % 8) : (rotscaleY % 8)) * 8;
             indexAddr += ((tile & BIT(10)) ? (7 - rotscaleX % 8) : (rotscaleX % 8));
-            uint8_t index = core->memory.read<uint8_t>(false, indexAddr);
+            uint8_t index = readBg<uint8_t>(indexAddr);
 
             // Draw a pixel
             if (index)
-                layers[bg][i] = U8TO16(pal, index * 2) | BIT(15);
+                layers[bg][i] = pal[index];
         }
     }
 
@@ -645,7 +1166,7 @@ void Gpu2D::drawExtended(int bg, int line)
     internalY[bg - 2] += bgPD[bg - 2];
 }
 
-void Gpu2D::drawLarge(int bg, int line)
+template <bool engineB, bool wrap> void Gpu2D::drawLarge(int bg, int line)
 {
     // Get the bitmap size
     int sizeX, sizeY;
@@ -668,10 +1189,10 @@ void Gpu2D::drawLarge(int bg, int line)
         int rotscaleY = (internalY[bg - 2] + bgPC[bg - 2] * i) >> 8;
 
         // Handle display area overflow
-        if (bgCnt[bg] & BIT(13)) // Wraparound
+        if (wrap) // Wraparound
         {
-            rotscaleX %= sizeX; if (rotscaleX < 0) rotscaleX += sizeX;
-            rotscaleY %= sizeY; if (rotscaleY < 0) rotscaleY += sizeY;
+            rotscaleX &= sizeX - 1;
+            rotscaleY &= sizeY - 1;
         }
         else if (rotscaleX < 0 || rotscaleX >= sizeX || rotscaleY < 0 || rotscaleY >= sizeY) // Transparent
         {
@@ -680,15 +1201,15 @@ void Gpu2D::drawLarge(int bg, int line)
 
         // A full large bitmap requires 512KB of VRAM, but engine B can only use 128KB
         // For engine B, wrap the 128KB bitmap 4 times to cover the full area
-        if (engine == 1)
-            rotscaleY %= sizeY / 4;
+        if (engineB)
+            rotscaleY &= sizeY / 4 - 1;
 
         // Get the palette index for the current pixel
-        uint8_t index = core->memory.read<uint8_t>(0, bgVramAddr + rotscaleY * sizeX + rotscaleX);
+        uint8_t index = readBg<uint8_t>(bgVramAddr + rotscaleY * sizeX + rotscaleX);
 
         // Draw a pixel
         if (index)
-            layers[bg][i] = U8TO16(palette, index * 2) | BIT(15);
+            layers[bg][i] = palColors[index];
     }
 
     // Increment the internal registers at the end of the scanline
@@ -696,23 +1217,106 @@ void Gpu2D::drawLarge(int bg, int line)
     internalY[bg - 2] += bgPD[bg - 2];
 }
 
-void Gpu2D::drawObjects(int line)
+// The type of each layer depends on the BG mode
+const uint8_t Gpu2D::bgTypes[8][4] =
+{
+    { BG_TEXT, BG_TEXT, BG_TEXT,     BG_TEXT     }, // Mode 0
+    { BG_TEXT, BG_TEXT, BG_TEXT,     BG_AFFINE   }, // Mode 1
+    { BG_TEXT, BG_TEXT, BG_AFFINE,   BG_AFFINE   }, // Mode 2
+    { BG_TEXT, BG_TEXT, BG_TEXT,     BG_EXTENDED }, // Mode 3
+    { BG_TEXT, BG_TEXT, BG_AFFINE,   BG_EXTENDED }, // Mode 4
+    { BG_TEXT, BG_TEXT, BG_EXTENDED, BG_EXTENDED }, // Mode 5
+    { BG_NONE, BG_NONE, BG_LARGE,    BG_NONE     }, // Mode 6
+    { BG_NONE, BG_NONE, BG_NONE,     BG_NONE     }  // Mode 7
+};
+
+// Renderers for each combination of the settings they're specialized on
+const Gpu2D::BgRenderer Gpu2D::textRenderers[] =
+{
+    &Gpu2D::drawText<false, false, false>, &Gpu2D::drawText<false, false, true>, // 4-bit
+    &Gpu2D::drawText<true,  false, false>, &Gpu2D::drawText<true,  false, true>, // 8-bit
+    &Gpu2D::drawText<true,  true,  false>, &Gpu2D::drawText<true,  true,  true>  // 8-bit, extended palette
+};
+
+const Gpu2D::BgRenderer Gpu2D::affineRenderers[] =
+{
+    &Gpu2D::drawAffine<false>, &Gpu2D::drawAffine<true>
+};
+
+const Gpu2D::BgRenderer Gpu2D::extendedRenderers[] =
+{
+    &Gpu2D::drawExtended<EXT_AFFINE,        false>, &Gpu2D::drawExtended<EXT_AFFINE,        true>,
+    &Gpu2D::drawExtended<EXT_AFFINE_EXTPAL, false>, &Gpu2D::drawExtended<EXT_AFFINE_EXTPAL, true>,
+    &Gpu2D::drawExtended<EXT_BITMAP,        false>, &Gpu2D::drawExtended<EXT_BITMAP,        true>,
+    &Gpu2D::drawExtended<EXT_DIRECT,        false>, &Gpu2D::drawExtended<EXT_DIRECT,        true>
+};
+
+const Gpu2D::BgRenderer Gpu2D::largeRenderers[] =
 {
-    // Loop through and draw the 128 sprites in OAM
+    &Gpu2D::drawLarge<false, false>, &Gpu2D::drawLarge<false, true>, // Engine A
+    &Gpu2D::drawLarge<true,  false>, &Gpu2D::drawLarge<true,  true>  // Engine B
+};
+
+Gpu2D::BgRenderer Gpu2D::getBgRenderer(int bg)
+{
+    // Pick the renderer specialized for the layer's current settings
+    bool wrap = (bgCnt[bg] & BIT(13));
+    switch (bgTypes[dispCnt & 0x00000007][bg])
+    {
+        case BG_TEXT:
+        {
+            if (bg == 0 && (dispCnt & BIT(3)))
+                return &Gpu2D::draw3D;
+
+            int depth = (bgCnt[bg] & BIT(7)) ? ((dispCnt & BIT(30)) ? 2 : 1) : 0;
+            return textRenderers[depth * 2 + ((bgCnt[bg] & BIT(14)) ? 1 : 0)];
+        }
+
+        case BG_AFFINE:
+        {
+            return affineRenderers[wrap];
+        }
+
+        case BG_EXTENDED:
+        {
+            int type;
+            if (bgCnt[bg] & BIT(7)) // Bitmap
+                type = (bgCnt[bg] & BIT(2)) ? EXT_DIRECT : EXT_BITMAP;
+            else // Extended affine
+                type = (dispCnt & BIT(30)) ? EXT_AFFINE_EXTPAL : EXT_AFFINE;
+            return extendedRenderers[type * 2 + wrap];
+        }
+
+        case BG_LARGE:
+        {
+            return largeRenderers[engine * 2 + wrap];
+        }
+
+        default:
+        {
+            return nullptr;
+        }
+    }
+}
+
+void Gpu2D::buildObjectLines()
+{
+    memset(objLineCounts, 0, sizeof(objLineCounts));
+
     for (int i = 0; i < 128; i++)
     {
         // Get the current object
         // Each object takes up 8 bytes in memory, but the last 2 bytes are reserved for rotscale
-        uint16_t object[3];
-        object[0] = U8TO16(oam, I_8[i]);
+        ObjectInfo *info = &objects[i];
+        uint16_t *object = info->attrib;
+        object[0] = U8TO16(oam, i * 8);
+        object[1] = U8TO16(oam, i * 8 + 2);
+        object[2] = U8TO16(oam, i * 8 + 4);
 
         // Skip sprites that are disabled
         if (!(object[0] & BIT(8)) && (object[0] & BIT(9)))
             continue;
 
-        object[1] = U8TO16(oam, I_8[i] + 2);
-        object[2] = U8TO16(oam, I_8[i] + 4);
-
         // Determine the dimensions of the object
         int width = 0, height = 0;
         switch ((object[1] & 0xC000) >> 14) // Size
@@ -774,17 +1378,55 @@ void Gpu2D::drawObjects(int line)
         int y = (object[0] & 0x00FF);
         if (y >= 192) y -= 256;
 
-        // Don't draw anything if the current scanline lies outside of the object's bounds
-        int spriteY = line - y;
-        if (spriteY < 0 || spriteY >= height2)
-            continue;
-
         // Get the X coordinate and wrap it around if it exceeds the screen bounds
         int x = (object[1] & 0x01FF);
         if (x >= 256) x -= 512;
 
-        int type = (object[0] & 0x0C00) >> 10;
-        uint8_t prio = (object[2] & 0x0C00) >> 10;
+        info->x = x;
+        info->y = y;
+        info->width = width;
+        info->height = height;
+        info->width2 = width2;
+        info->height2 = height2;
+        info->type = (object[0] & 0x0C00) >> 10;
+        info->prio = (object[2] & 0x0C00) >> 10;
+
+        // Get the rotscale parameters
+        if (object[0] & BIT(8))
+        {
+            for (int j = 0; j < 4; j++)
+                info->params[j] = U8TO16(oam, ((object[1] & 0x3E00) >> 9) * 0x20 + j * 8 + 6);
+        }
+
+        // Add the object to the lists of the scanlines it covers
+        int start = (y < 0) ? 0 : y;
+        int end = (y + height2 > 192) ? 192 : (y + height2);
+        for (int j = start; j < end; j++)
+            objLines[j][objLineCounts[j]++] = i;
+    }
+}
+
+void Gpu2D::drawObjects(int line)
+{
+    // Rebuild the per-scanline object lists if OAM has changed
+    uint32_t version = core->memory.getOamVersion();
+    if (objVersion != version)
+    {
+        objVersion = version;
+        buildObjectLines();
+    }
+
+    // Loop through and draw the sprites on this scanline, in OAM order
+    for (int i = 0; i < objLineCounts[line]; i++)
+    {
+        ObjectInfo *info = &objects[objLines[line][i]];
+        uint16_t *object = info->attrib;
+        int width = info->width, height = info->height;
+        int width2 = info->width2, height2 = info->height2;
+        int spriteY = line - info->y;
+        int x = info->x;
+        int type = info->type;
+        uint8_t prio = info->prio;
 
         // Draw bitmap objects
         if (type == 3)
@@ -807,10 +1449,7 @@ void Gpu2D::drawObjects(int line)
 
             if (object[0] & BIT(8)) // Rotscale
             {
-                // Get the rotscale parameters
-                int params[4];
-                for (int j = 0; j < 4; j++)
-                    params[j] = (int16_t)U8TO16(oam, ((object[1] & 0x3E00) >> 9) * 0x20 + j * 8 + 6);
+                int16_t *params = info->params;
 
                 // Draw a line of the object
                 for (int j = 0; j < width2; j++)
@@ -827,7 +1466,7 @@ void Gpu2D::drawObjects(int line)
                     if (rotscaleY < 0 || rotscaleY >= height) continue;
 
                     // Draw a pixel if the old one is lower priority
-                    uint16_t pixel = core->memory.read<uint16_t>(0, dataBase + (rotscaleY * bitmapWidth + rotscaleX) * 2);
+                    uint16_t pixel = readObj<uint16_t>(dataBase + (rotscaleY * bitmapWidth + rotscaleX) * 2);
                     if ((pixel & BIT(15)) && prio < objPrio[offset])
                     {
                         layers[4][offset] = pixel;
@@ -844,7 +1483,7 @@ void Gpu2D::drawObjects(int line)
                     if (offset < 0 || offset >= 256) continue;
 
                     // Draw a pixel if the old one is lower priority
-                    uint16_t pixel = core->memory.read<uint16_t>(0, dataBase + (spriteY * bitmapWidth + j) * 2);
+                    uint16_t pixel = readObj<uint16_t>(dataBase + (spriteY * bitmapWidth + j) * 2);
                     if ((pixel & BIT(15)) && prio < objPrio[offset])
                     {
                         layers[4][offset] = pixel;
@@ -862,26 +1501,23 @@ void Gpu2D::drawObjects(int line)
             
         if (object[0] & BIT(8)) // Rotscale
         {
-            // Get the rotscale parameters
-            int params[4];
-            for (int j = 0; j < 4; j++)
-                params[j] = (int16_t)U8TO16(oam, ((object[1] & 0x3E00) >> 9) * 0x20 + j * 8 + 6);
+            int16_t *params = info->params;
 
             if (object[0] & BIT(13)) // 8-bit
             {
                 int mapWidth = (dispCnt & BIT(4)) ? width : 128;
 
                 // Get the object's palette
-                uint8_t *pal;
+                const uint32_t *pal;
                 if (dispCnt & BIT(31)) // Extended palette
                 {
                     // In extended palette mode, the object can select from multiple 256-color palettes
                     if (!extPalettes[4]) continue;
-                    pal = &extPalettes[4][(object[2] & 0xF000) >> 3];
+                    pal = &extPalColors[4][((object[2] & 0xF000) >> 12) * 256];
                 }
                 else // Standard palette
                 {
-                    pal = &palette[0x200];
+                    pal = &palColors[256];
                 }
 
                 // Draw a line of the object
@@ -899,7 +1535,7 @@ void Gpu2D::drawObjects(int line)
                     if (rotscaleY < 0 || rotscaleY >= height) continue;
 
                     // Get the palette index for the current pixel
-                    uint8_t index = core->memory.read<uint8_t>(false, tileBase +
+                    uint8_t index = readObj<uint8_t>(tileBase +
                         ((rotscaleY / 8) * mapWidth + rotscaleY % 8) * 8 + (rotscaleX / 8) * 64 + rotscaleX % 8);
 
                     if (index && type == 2) // Object window
@@ -913,7 +1549,7 @@ void Gpu2D::drawObjects(int line)
                         // Semi-transparent pixels are marked with an extra bit
                         if (index && (!(layers[4][offset] & BIT(15)) || prio < objPrio[offset]))
                         {
-                            layers[4][offset] = ((type == 1) ? BIT(25) : 0) | BIT(15) | U8TO16(pal, index * 2);
+                            layers[4][offset] = ((type == 1) ? BIT(25) : 0) | pal[index];
                             objPrio[offset] = prio;
                         }
                     }
@@ -925,7 +1561,7 @@ void Gpu2D::drawObjects(int line)
 
                 // Get the object's palette
                 // In 4-bit mode, the object can select from multiple 16-color palettes
-                uint8_t *pal = &palette[0x200 + ((object[2] & 0xF000) >> 12) * 32];
+                const uint32_t *pal = &palColors[256 + ((object[2] & 0xF000) >> 12) * 16];
 
                 // Draw a line of the object
                 for (int j = 0; j < width2; j++)
@@ -942,7 +1578,7 @@ void Gpu2D::drawObjects(int line)
                     if (rotscaleY < 0 || rotscaleY >= height) continue;
 
                     // Get the palette index for the current pixel
-                    uint8_t index = core->memory.read<uint8_t>(false, tileBase +
+                    uint8_t index = readObj<uint8_t>(tileBase +
                         ((rotscaleY / 8) * mapWidth + rotscaleY % 8) * 4 + (rotscaleX / 8) * 32 + (rotscaleX % 8) / 2);
                     index = (rotscaleX % 2 == 1) ? ((index & 0xF0) >> 4) : (index & 0x0F);
 
@@ -957,7 +1593,7 @@ void Gpu2D::drawObjects(int line)
                         // Semi-transparent pixels are marked with an extra bit
                         if (index && (!(layers[4][offset] & BIT(15)) || prio < objPrio[offset]))
                         {
-                            layers[4][offset] = ((type == 1) ? BIT(25) : 0) | BIT(15) | U8TO16(pal, index * 2);
+                            layers[4][offset] = ((type == 1) ? BIT(25) : 0) | pal[index];
                             objPrio[offset] = prio;
                         }
                     }
@@ -974,16 +1610,16 @@ void Gpu2D::drawObjects(int line)
                 tileBase += ((spriteY % 8) + (spriteY / 8) * mapWidth) * 8;
 
             // Get the object's palette
-            uint8_t *pal;
+            const uint32_t *pal;
             if (dispCnt & BIT(31)) // Extended palette
             {
                 // In extended palette mode, the object can select from multiple 256-color palettes
                 if (!extPalettes[4]) continue;
-                pal = &extPalettes[4][(object[2] & 0xF000) >> 3];
+                pal = &extPalColors[4][((object[2] & 0xF000) >> 12) * 256];
             }
             else // Standard palette
             {
-                pal = &palette[0x200];
+                pal = &palColors[256];
             }
 
             // Draw a line of the object
@@ -994,7 +1630,7 @@ void Gpu2D::drawObjects(int line)
                 if (offset < 0 || offset >= 256) continue;
 
                 // Get the palette index for the current pixel
-                uint8_t index = core->memory.read<uint8_t>(false, tileBase + (j / 8) * 64 + j % 8);
+                uint8_t index = readObj<uint8_t>(tileBase + (j / 8) * 64 + j % 8);
 
                 if (index && type == 2) // Object window
                 {
@@ -1007,7 +1643,7 @@ void Gpu2D::drawObjects(int line)
                     // Semi-transparent pixels are marked with an extra bit
                     if (index && (!(layers[4][offset] & BIT(15)) || prio < objPrio[offset]))
                     {
-                        layers[4][offset] = ((type == 1) ? BIT(25) : 0) | BIT(15) | U8TO16(pal, index * 2);
+                        layers[4][offset] = ((type == 1) ? BIT(25) : 0) | pal[index];
                         objPrio[offset] = prio;
                     }
                 }
@@ -1024,7 +1660,7 @@ void Gpu2D::drawObjects(int line)
 
             // Get the palette of the object
             // In 4-bit mode, the object can select from multiple 16-color palettes
-            uint8_t *pal = &palette[0x200 + ((object[2] & 0xF000) >> 12) * 32];
+            const uint32_t *pal = &palColors[256 + ((object[2] & 0xF000) >> 12) * 16];
 
             // Draw a line of the object
             for (int j = 0; j < width; j++)
@@ -1034,7 +1670,7 @@ void Gpu2D::drawObjects(int line)
                 if (offset < 0 || offset >= 256) continue;
 
                 // Get the palette index for the current pixel
-                uint8_t index = core->memory.read<uint8_t>(false, tileBase + (j / 8) * 32 + (j % 8) / 2);
+                uint8_t index = readObj<uint8_t>(tileBase + (j / 8) * 32 + (j % 8) / 2);
                 index = (j & 1) ? ((index & 0xF0) >> 4) : (index & 0x0F);
 
                 if (index && type == 2) // Object window
@@ -1048,7 +1684,7 @@ void Gpu2D::drawObjects(int line)
                     // Semi-transparent pixels are marked with an extra bit
                     if (index && (!(layers[4][offset] & BIT(15)) || prio < objPrio[offset]))
                     {
-                        layers[4][offset] = ((type == 1) ? BIT(25) : 0) | BIT(15) | U8TO16(pal, index * 2);
+                        layers[4][offset] = ((type == 1) ? BIT(25) : 0) | pal[index];
                         objPrio[offset] = prio;
                     }
                 }
@@ -1182,19 +1818,95 @@ void Gpu2D::writeBldAlpha(uint16_t mask, uint16_t value)
 {
     // Write to the BLDALPHA register
     mask &= 0x1F1F;
+    uint16_t old = bldAlpha;
     bldAlpha = (bldAlpha & ~mask) | (value & mask);
+    if (bldAlpha != old) updateBlendTables();
 }
 
 void Gpu2D::writeBldY(uint8_t value)
 {
     // Write to the BLDY register
+    uint8_t old = bldY;
     bldY = value & 0x1F;
     if (bldY > 16) bldY = 16;
+    if (bldY != old) updateBrightnessTables();
 }
 
 void Gpu2D::writeMasterBright(uint16_t mask, uint16_t value)
 {
     // Write to the MASTER_BRIGHT register
     mask &= 0xC01F;
+    uint16_t old = masterBright;
     masterBright = (masterBright & ~mask) | (value & mask);
+    if (masterBright != old) updateMasterTable();
+}
+
+void Gpu2D::saveState(FILE *file)
+{
+    // Write the state to a file
+    fwrite(framebuffer, sizeof(framebuffer), 1, file);
+    fwrite(layers, sizeof(layers), 1, file);
+    fwrite(objPrio, sizeof(objPrio), 1, file);
+    fwrite(&gbaBlock, sizeof(gbaBlock), 1, file);
+    fwrite(internalX, sizeof(internalX), 1, file);
+    fwrite(internalY, sizeof(internalY), 1, file);
+    fwrite(&dispCnt, sizeof(dispCnt), 1, file);
+    fwrite(bgCnt, sizeof(bgCnt), 1, file);
+    fwrite(bgHOfs, sizeof(bgHOfs), 1, file);
+    fwrite(bgVOfs, sizeof(bgVOfs), 1, file);
+    fwrite(bgPA, sizeof(bgPA), 1, file);
+    fwrite(bgPB, sizeof(bgPB), 1, file);
+    fwrite(bgPC, sizeof(bgPC), 1, file);
+    fwrite(bgPD, sizeof(bgPD), 1, file);
+    fwrite(bgX, sizeof(bgX), 1, file);
+    fwrite(bgY, sizeof(bgY), 1, file);
+    fwrite(winX1, sizeof(winX1), 1, file);
+    fwrite(winX2, sizeof(winX2), 1, file);
+    fwrite(winY1, sizeof(winY1), 1, file);
+    fwrite(winY2, sizeof(winY2), 1, file);
+    fwrite(&winIn, sizeof(winIn), 1, file);
+    fwrite(&winOut, sizeof(winOut), 1, file);
+    fwrite(&bldCnt, sizeof(bldCnt), 1, file);
+    fwrite(&bldAlpha, sizeof(bldAlpha), 1, file);
+    fwrite(&bldY, sizeof(bldY), 1, file);
+    fwrite(&masterBright, sizeof(masterBright), 1, file);
+}
+
+void Gpu2D::loadState(FILE *file)
+{
+    // Read the state from a file
+    fread(framebuffer, sizeof(framebuffer), 1, file);
+    fread(layers, sizeof(layers), 1, file);
+    fread(objPrio, sizeof(objPrio), 1, file);
+    fread(&gbaBlock, sizeof(gbaBlock), 1, file);
+    fread(internalX, sizeof(internalX), 1, file);
+    fread(internalY, sizeof(internalY), 1, file);
+    fread(&dispCnt, sizeof(dispCnt), 1, file);
+    fread(bgCnt, sizeof(bgCnt), 1, file);
+    fread(bgHOfs, sizeof(bgHOfs), 1, file);
+    fread(bgVOfs, sizeof(bgVOfs), 1, file);
+    fread(bgPA, sizeof(bgPA), 1, file);
+    fread(bgPB, sizeof(bgPB), 1, file);
+    fread(bgPC, sizeof(bgPC), 1, file);
+    fread(bgPD, sizeof(bgPD), 1, file);
+    fread(bgX, sizeof(bgX), 1, file);
+    fread(bgY, sizeof(bgY), 1, file);
+    fread(winX1, sizeof(winX1), 1, file);
+    fread(winX2, sizeof(winX2), 1, file);
+    fread(winY1, sizeof(winY1), 1, file);
+    fread(winY2, sizeof(winY2), 1, file);
+    fread(&winIn, sizeof(winIn), 1, file);
+    fread(&winOut, sizeof(winOut), 1, file);
+    fread(&bldCnt, sizeof(bldCnt), 1, file);
+    fread(&bldAlpha, sizeof(bldAlpha), 1, file);
+    fread(&bldY, sizeof(bldY), 1, file);
+    fread(&masterBright, sizeof(masterBright), 1, file);
+
+    // Lines drawn before the state was loaded can't be reused
+    for (int i = 0; i < 192; i++)
+        lineStates[i].valid = false;
+
+    updateBlendTables();
+    updateBrightnessTables();
+    updateMasterTable();
 }
@@ -21,20 +21,106 @@
 #define GPU_2D_H
 
 #include <cstdint>
+#include <cstdio>
 
 class Core;
 
+struct TileLine
+{
+    // A line of a tile decoded to colors, already flipped horizontally if needed
+    const uint8_t *data = nullptr;
+    const uint32_t *pal = nullptr;
+    uint32_t version = 0, palVersion = 0;
+    uint8_t flags = 0;
+    uint8_t opaque = 0;
+    uint32_t colors[8] = {};
+};
+
+struct ObjectInfo
+{
+    // An OAM entry with the attributes needed for drawing already decoded
+    uint16_t attrib[3] = {};
+    int x = 0, y = 0;
+    int width = 0, height = 0;
+    int width2 = 0, height2 = 0;
+    int type = 0;
+    uint8_t prio = 0;
+    int16_t params[4] = {};
+};
+
+enum BgType
+{
+    BG_NONE = 0,
+    BG_TEXT,
+    BG_AFFINE,
+    BG_EXTENDED,
+    BG_LARGE
+};
+
+enum ExtendedType
+{
+    EXT_AFFINE = 0,
+    EXT_AFFINE_EXTPAL,
+    EXT_BITMAP,
+    EXT_DIRECT
+};
+
+struct LineKey
+{
+    // The registers and versions that decide what a scanline looks like
+    uint32_t dispCnt;
+    uint16_t bgCnt[4], bgHOfs[4], bgVOfs[4];
+    int16_t bgPA[2], bgPC[2];
+    int internalX[2], internalY[2];
+    uint16_t winX1[2], winX2[2], winY1[2], winY2[2];
+    uint16_t winIn, winOut, bldCnt, bldAlpha;
+    uint8_t bldY;
+    uint32_t mapEpoch, palVersion, oamVersion;
+    const uint8_t *extPalData[5];
+    uint32_t extPalVersion[5];
+};
+
+struct LineState
+{
+    // What a scanline depended on when it was last drawn, including the versions of the VRAM pages it read
+    LineKey key;
+    uint64_t pagesRead = 0;
+    uint32_t pageVersions[48] = {};
+    bool valid = false;
+};
+
+struct WindowSpan
+{
+    // A run of pixels on a scanline that has the same layers enabled by the windows
+    uint16_t start, end;
+    uint8_t enabled;
+};
+
+enum ColorEffect
+{
+    EFFECT_NONE = 0,
+    EFFECT_ALPHA,
+    EFFECT_BRIGHTEN,
+    EFFECT_DARKEN
+};
+
 class Gpu2D
 {
     public:
         Gpu2D(Core *core, bool engine);
 
+        void saveState(FILE *file);
+        void loadState(FILE *file);
+
         void drawGbaScanline(int line);
         void drawScanline(int line);
         void finishScanline(int line);
 
         uint16_t *getFramebuffer(int line) { return &framebuffer[256 * line]; }
 
+        uint64_t getLinesDrawn()  { return linesDrawn;  }
+        uint64_t getLinesReused() { return linesReused; }
+
         uint32_t readDispCnt()      { return dispCnt;      }
         uint16_t readBgCnt(int bg)  { return bgCnt[bg];    }
         uint16_t readWinIn()        { return winIn;        }
@@ -70,10 +156,51 @@ class Gpu2D
         uint8_t *palette, *oam;
         uint8_t **extPalettes;
 
+        // VRAM pages as host pointers, copied from the memory map at the start of each scanline
+        // Renderers read through these instead of going through the full memory map for every access
+        uint8_t **bgPageMap, **objPageMap;
+        uint8_t *bgPages[32] = {}, *objPages[16] = {};
+        uint32_t bgPageMask, objPageMask;
+        uint32_t mapEpoch = 0;
+
+        // Scanlines are reused from the last frame when nothing they depend on has changed
+        // BG pages read by the current line are bits 0-31, and OBJ pages are bits 32-47
+        LineState lineStates[192];
+        uint64_t pagesRead = 0;
+        uint64_t linesDrawn = 0, linesReused = 0;
+
         __attribute__((aligned(16))) uint16_t framebuffer[256 * 192 * 2] = {};
         uint32_t layers[5][256] = {};
         uint8_t objPrio[256] = {};
 
+        // The second topmost pixel and the color effect chosen for each pixel of the current scanline
+        __attribute__((aligned(16))) uint16_t belowPixels[256] = {};
+        __attribute__((aligned(16))) uint8_t pixelEffects[256] = {};
+
+        // How many opaque background layers cover each pixel of the current scanline
+        uint8_t layerCover[256] = {};
+
+        // Color effect results for each 6-bit channel value, rebuilt when the coefficients change
+        uint8_t blendTableA[64] = {}, blendTableB[64] = {};
+        uint8_t brightenTable[64] = {}, darkenTable[64] = {};
+        uint8_t masterTable[64] = {};
+
+        // Palettes converted to colors that are ready to store in the layers, with the opaque bit set
+        // The standard palettes hold BG colors followed by OBJ colors, and the extended palettes are BG slots 0-3 and OBJ
+        uint32_t palColors[512] = {};
+        uint32_t palColorsVersion = -1;
+        uint32_t extPalColors[5][4096] = {};
+        const uint8_t *extPalColorsData[5] = {};
+        uint32_t extPalColorsVersion[5] = {};
+
+        TileLine tileCache[1024];
+
+        // Objects binned by the scanlines they cover, rebuilt whenever OAM changes
+        ObjectInfo objects[128];
+        uint8_t objLines[192][128] = {};
+        uint8_t objLineCounts[192] = {};
+        uint32_t objVersion = -1;
+
         int gbaBlock = 0;
 
         int internalX[2] = {};
@@ -102,10 +229,37 @@ class Gpu2D
 
         uint32_t rgb5ToRgb6(uint32_t color);
 
-        void drawText(int bg, int line);
-        void drawAffine(int bg, int line);
-        void drawExtended(int bg, int line);
-        void drawLarge(int bg, int line);
+        template <typename T> T readBg(uint32_t address);
+        template <typename T> T readObj(uint32_t address);
+
+        void getLineKey(LineKey *key);
+        int buildWindowSpans(int line, WindowSpan *spans);
+
+        void updateBlendTables();
+        void updateBrightnessTables();
+        void updateMasterTable();
+
+        void applyEffects(uint16_t *pixels, const uint16_t *below, const uint8_t *effects, int eva, int evb, int evy);
+        static void applyEffectsScalar(uint16_t *pixels, const uint16_t *below, const uint8_t *effects, int eva, int evb, int evy);
+        void applyBrightness(uint16_t *pixels, int effect, int factor);
+        static void applyBrightnessScalar(uint16_t *pixels, int effect, int factor);
+
+        void updatePalettes();
+        TileLine *getTileLine(const uint8_t *data, const uint32_t *pal, uint32_t palVersion, bool bpp8, bool flip);
+
+        // Background renderers are specialized on the settings that would otherwise be checked for every pixel
+        typedef void (Gpu2D::*BgRenderer)(int bg, int line);
+        static const uint8_t bgTypes[8][4];
+        static const BgRenderer textRenderers[6], affineRenderers[2], extendedRenderers[8], largeRenderers[4];
+
+        BgRenderer getBgRenderer(int bg);
+
+        void draw3D(int bg, int line);
+        template <bool bpp8, bool extPal, bool wide> void drawText(int bg, int line);
+        template <bool wrap> void drawAffine(int bg, int line);
+        template <int type, bool wrap> void drawExtended(int bg, int line);
+        template <bool engineB, bool wrap> void drawLarge(int bg, int line);
+        void buildObjectLines();
         void drawObjects(int line);
 };
 
@@ -22,6 +22,14 @@
 #include "gpu_3d.h"
 #include "core.h"
 
+// Matrix rows are multiplied with SIMD where the host has signed 32x32 to 64-bit lane multiplies
+// Defining GPU3D_SCALAR uses the plain loop instead, for checking the others against
+#if !defined(GPU3D_SCALAR) && defined(__SSE4_1__)
+#include <smmintrin.h>
+#elif !defined(GPU3D_SCALAR) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 Gpu3D::Gpu3D(Core *core): core(core)
 {
     // Set the parameter counts
@@ -73,12 +81,75 @@ uint32_t Gpu3D::rgb5ToRgb6(uint16_t color)
     return (b << 12) | (g << 6) | r;
 }
 
-void Gpu3D::runCycle()
+int Gpu3D::runCommands(int cycles)
 {
-    // Fetch the next geometry command
+    int count = 0;
+
+    // Run geometry commands, one per cycle, until the cycles run out or the PIPE empties
+    // A run stops early if it wakes the ARM9 or starts a DMA transfer, so the scheduler can act on it
+    while (count < cycles && shouldRun())
+    {
+        stepCommand();
+        count++;
+
+        if (core->interpreter[0].shouldRun() || core->dma[0].shouldTransfer())
+            break;
+    }
+
+    // Update the rest of the FIFO status, which nothing reads until the run is over
+    gxStat = (gxStat & ~0x00001F00) | (coordinatePtr <<  8); // Coordinate stack pointer
+    gxStat = (gxStat & ~0x00002000) | (projectionPtr << 13); // Projection stack pointer
+    gxStat = (gxStat & ~0x01FF0000) | (fifo.size()   << 16); // FIFO entries
+
+    return count;
+}
+
+void Gpu3D::stepCommand()
+{
+    // Make sure there's a command to run, in case the PIPE was left empty with entries still in the FIFO
+    if (pipe.empty() && !fifo.empty())
+    {
+        pipe.push(fifo.front());
+        fifo.pop();
+    }
+    if (pipe.empty()) return;
+
+    // Fetch and execute the next geometry command
     Entry entry = pipe.front();
     pipe.pop();
+    runCommand(entry);
+
+    // Move 2 FIFO entries into the PIPE if it runs half empty
+    if (pipe.size() < 3)
+    {
+        for (int i = 0; i < ((fifo.size() > 2) ? 2 : fifo.size()); i++)
+        {
+            pipe.push(fifo.front());
+            fifo.pop();
+        }
+    }
+
+    if (fifo.size() == 0) gxStat |=  BIT(26); // Empty
+    if (pipe.size() == 0) gxStat &= ~BIT(27); // Commands not executing
+
+    // If the FIFO becomes less than half full, trigger GXFIFO DMA transfers
+    // If the FIFO is already less than half full when a DMA starts, it will automatically activate
+    if (fifo.size() < 128 && !(gxStat & BIT(25)))
+    {
+        gxStat |= BIT(25);
+        core->dma[0].trigger(7);
+    }
+
+    // Send a GXFIFO interrupt if enabled
+    switch ((gxStat & 0xC0000000) >> 30)
+    {
+        case 1: if (gxStat & BIT(25)) core->interpreter[0].sendInterrupt(21); break;
+        case 2: if (gxStat & BIT(26)) core->interpreter[0].sendInterrupt(21); break;
+    }
+}
 
+void Gpu3D::runCommand(Entry entry)
+{
     // Execute the geometry command
     switch (entry.command)
     {
@@ -131,99 +202,103 @@ void Gpu3D::runCycle()
     paramCount++;
     if (paramCount >= paramCounts[entry.command])
         paramCount = 0;
+}
 
-    // Move 2 FIFO entries into the PIPE if it runs half empty
-    if (pipe.size() < 3)
-    {
-        for (int i = 0; i < ((fifo.size() > 2) ? 2 : fifo.size()); i++)
-        {
-            pipe.push(fifo.front());
-            fifo.pop();
-        }
-    }
-
-    // Update the FIFO status
-    gxStat = (gxStat & ~0x00001F00) | (coordinatePtr <<  8); // Coordinate stack pointer
-    gxStat = (gxStat & ~0x00002000) | (projectionPtr << 13); // Projection stack pointer
-    gxStat = (gxStat & ~0x01FF0000) | (fifo.size()   << 16); // FIFO entries
-    if (fifo.size() == 0) gxStat |=  BIT(26); // Empty
-    if (pipe.size() == 0) gxStat &= ~BIT(27); // Commands not executing
-
-    // If the FIFO becomes less than half full, trigger GXFIFO DMA transfers
-    // If the FIFO is already less than half full when a DMA starts, it will automatically activate
-    if (fifo.size() < 128 && !(gxStat & BIT(25)))
-    {
-        gxStat |= BIT(25);
-        core->dma[0].trigger(7);
-    }
-
-    // Send a GXFIFO interrupt if enabled
-    switch ((gxStat & 0xC0000000) >> 30)
-    {
-        case 1: if (gxStat & BIT(25)) core->interpreter[0].sendInterrupt(21); break;
-        case 2: if (gxStat & BIT(26)) core->interpreter[0].sendInterrupt(21); break;
-    }
+uint64_t Gpu3D::mixHash(uint64_t hash, uint32_t value)
+{
+    // Fold a value into a hash, mixing the high bits back down so every bit affects the result
+    hash = (hash ^ value) * 0x100000001B3;
+    return hash ^ (hash >> 29);
 }
 
 void Gpu3D::swapBuffers()
 {
-    // Process the vertices
+    // Hash the new lists as they're finished, so the renderer can tell if a scene was submitted again unchanged
+    uint64_t hash = mixHash(0xCBF29CE484222325, (vertexCountIn << 16) | polygonCountIn);
+
+    // Process the vertices into the renderer's list
     for (int i = 0; i < vertexCountIn; i++)
     {
-        if (verticesIn[i].w != 0)
+        Vertex *v = &verticesIn[i];
+
+        if (v->w != 0)
         {
             // Normalize and scale the vertices to the viewport
             // X coordinates are 9-bit and Y coordinates are 8-bit; invalid viewports can cause wraparound
             // Z coordinates (and depth values in general) are 24-bit
-            verticesIn[i].x = (( (int64_t)verticesIn[i].x + verticesIn[i].w) * viewportWidth  / (verticesIn[i].w * 2) + viewportX) & 0x1FF;
-            verticesIn[i].y = ((-(int64_t)verticesIn[i].y + verticesIn[i].w) * viewportHeight / (verticesIn[i].w * 2) + viewportY) &  0xFF;
-            verticesIn[i].z = (((((int64_t)verticesIn[i].z << 14) / verticesIn[i].w) + 0x3FFF) << 9) & 0xFFFFFF;
+            vertexList.x[i] = (( (int64_t)v->x + v->w) * viewportWidth  / (v->w * 2) + viewportX) & 0x1FF;
+            vertexList.y[i] = ((-(int64_t)v->y + v->w) * viewportHeight / (v->w * 2) + viewportY) &  0xFF;
+            vertexList.z[i] = (((((int64_t)v->z << 14) / v->w) + 0x3FFF) << 9) & 0xFFFFFF;
         }
         else
         {
             // The W coordinate is invalid, so not much can be done
-            verticesIn[i].x = 0;
-            verticesIn[i].y = 0;
-            verticesIn[i].z = 0;
+            vertexList.x[i] = 0;
+            vertexList.y[i] = 0;
+            vertexList.z[i] = 0;
         }
+
+        vertexList.w[i] = v->w;
+        vertexList.s[i] = v->s;
+        vertexList.t[i] = v->t;
+        vertexList.color[i] = v->color;
+
+        hash = mixHash(hash, vertexList.x[i] | (vertexList.y[i] << 16));
+        hash = mixHash(hash, vertexList.z[i]);
+        hash = mixHash(hash, vertexList.w[i]);
+        hash = mixHash(hash, (uint16_t)vertexList.s[i] | ((uint32_t)(uint16_t)vertexList.t[i] << 16));
+        hash = mixHash(hash, vertexList.color[i]);
     }
 
     // Determine each polygon's W-shift value to be used for reducing (or expanding) W values to 16 bits
     for (int i = 0; i < polygonCountIn; i++)
     {
         _Polygon *p = &polygonsIn[i];
+        const int32_t *w = &vertexList.w[p->vertex];
+        int wShift = 0;
 
         // Reduce precision in 4-bit increments until all W values fit in the 16-bit range
         for (int j = 0; j < p->size; j++)
         {
-            while (((uint32_t)p->vertices[j].w >> p->wShift) > 0xFFFF)
-                p->wShift += 4;
+            while (((uint32_t)w[j] >> wShift) > 0xFFFF)
+                wShift += 4;
         }
 
         // If precision wasn't reduced, increase it in 4-bit increments until a W value no longer fits in the 16-bit range
-        if (p->wShift == 0)
+        if (wShift == 0)
         {
             while (true)
             {
                 for (int j = 0; j < p->size; j++)
                 {
-                    if (p->vertices[j].w == 0 || ((uint32_t)p->vertices[j].w << -(p->wShift - 4)) > 0xFFFF)
+                    if (w[j] == 0 || ((uint32_t)w[j] << -(wShift - 4)) > 0xFFFF)
                         goto out;
                 }
-                p->wShift -= 4;
+                wShift -= 4;
             }
             out:;
         }
+
+        p->wShift = wShift;
+
+        PolygonAttribs *a = &attribsIn[i];
+        hash = mixHash(hash, p->vertex | (p->size << 16) | (p->crossed << 20) | ((uint32_t)(uint8_t)p->wShift << 24));
+        hash = mixHash(hash, a->mode | (a->alpha << 8) | (a->id << 16) | (a->textureFmt << 24));
+        hash = mixHash(hash, a->transNewDepth | (a->depthTestEqual << 1) | (a->fog << 2) | (a->repeatS << 3) | (a->repeatT << 4) |
+            (a->flipS << 5) | (a->flipT << 6) | (a->transparent0 << 7) | (a->wBuffer << 8) | (a->sizeS << 16));
+        hash = mixHash(hash, a->textureAddr | (a->sizeT << 20));
+        hash = mixHash(hash, a->paletteAddr);
     }
+    sceneHash = hash;
 
-    // Swap the vertex buffers
-    SWAP(verticesOut, verticesIn);
+    // The vertices have been copied, so the input buffer can be reused
     vertexCountOut = vertexCountIn;
     vertexCountIn = 0;
     vertexCount = 0;
 
     // Swap the polygon buffers
     SWAP(polygonsOut, polygonsIn);
+    SWAP(attribsOut, attribsIn);
     polygonCountOut = polygonCountIn;
     polygonCountIn = 0;
 
@@ -232,20 +307,106 @@ void Gpu3D::swapBuffers()
     core->gpu.invalidate3D();
 }
 
+template <int terms> void Gpu3D::multiplyRow(const int32_t *row, const int32_t *mtx, int32_t *out)
+{
+    // Multiply a row vector with the first rows of a matrix, keeping 64-bit sums until the fractional bits are dropped
+    // The low 32 bits of the shifted sums are the same whether the shift is arithmetic or logical
+
+#if defined(__SSE4_1__) && !defined(GPU3D_SCALAR)
+    // Sum the even and odd columns in separate 64-bit lanes, then interleave them back together
+    __m128i even = _mm_setzero_si128(), odd = _mm_setzero_si128();
+    for (int i = 0; i < terms; i++)
+    {
+        __m128i value = _mm_set1_epi32(row[i]);
+        __m128i column = _mm_loadu_si128((__m128i*)&mtx[i * 4]);
+        even = _mm_add_epi64(even, _mm_mul_epi32(value, column));
+        odd = _mm_add_epi64(odd, _mm_mul_epi32(value, _mm_srli_epi64(column, 32)));
+    }
+    even = _mm_and_si128(_mm_srli_epi64(even, 12), _mm_set1_epi64x(0xFFFFFFFF));
+    odd = _mm_slli_epi64(_mm_srli_epi64(odd, 12), 32);
+    _mm_storeu_si128((__m128i*)out, _mm_or_si128(even, odd));
+#elif defined(__ARM_NEON) && !defined(GPU3D_SCALAR)
+    // Sum the low and high columns in 64-bit lanes, then narrow them while dropping the fractional bits
+    int64x2_t low = vdupq_n_s64(0), high = vdupq_n_s64(0);
+    for (int i = 0; i < terms; i++)
+    {
+        int32x2_t value = vdup_n_s32(row[i]);
+        int32x4_t column = vld1q_s32(&mtx[i * 4]);
+        low = vmlal_s32(low, vget_low_s32(column), value);
+        high = vmlal_s32(high, vget_high_s32(column), value);
+    }
+    vst1q_s32(out, vcombine_s32(vshrn_n_s64(low, 12), vshrn_n_s64(high, 12)));
+#else
+    for (int x = 0; x < 4; x++)
+    {
+        int64_t value = 0;
+        for (int i = 0; i < terms; i++) value += (int64_t)row[i] * mtx[i * 4 + x];
+        out[x] = value >> 12;
+    }
+#endif
+}
+
 Matrix Gpu3D::multiply(Matrix *mtx1, Matrix *mtx2)
 {
     Matrix matrix;
 
     // Multiply 2 matrices
     for (int y = 0; y < 4; y++)
+        multiplyRow<4>(&mtx1->data[y * 4], mtx2->data, &matrix.data[y * 4]);
+
+    return matrix;
+}
+
+Matrix Gpu3D::multiply43(Matrix *mtx1, Matrix *mtx2)
+{
+    Matrix matrix;
+
+    // Multiply a 4x3 matrix with another matrix
+    // The last column of the 4x3 matrix is known to be 0, 0, 0, 1, so the first 3 rows only need 3 terms
+    for (int y = 0; y < 3; y++)
+        multiplyRow<3>(&mtx1->data[y * 4], mtx2->data, &matrix.data[y * 4]);
+    multiplyRow<4>(&mtx1->data[12], mtx2->data, &matrix.data[12]);
+
+    return matrix;
+}
+
+Matrix Gpu3D::multiply33(Matrix *mtx1, Matrix *mtx2)
+{
+    Matrix matrix;
+
+    // Multiply a 3x3 matrix with another matrix
+    // The 3x3 matrix is padded with identity values, so the last row of the other matrix is unchanged
+    for (int y = 0; y < 3; y++)
+        multiplyRow<3>(&mtx1->data[y * 4], mtx2->data, &matrix.data[y * 4]);
+    memcpy(&matrix.data[12], &mtx2->data[12], 4 * sizeof(int32_t));
+
+    return matrix;
+}
+
+Matrix Gpu3D::multiplyScale(Matrix *mtx1, Matrix *mtx2)
+{
+    Matrix matrix;
+
+    // Multiply a scale matrix with another matrix
+    // Only the diagonal of the scale matrix is set, so each row of the other matrix is scaled by one value
+    for (int y = 0; y < 3; y++)
     {
         for (int x = 0; x < 4; x++)
-        {
-            int64_t value = 0;
-            for (int i = 0; i < 4; i++) value += (int64_t)mtx1->data[y * 4 + i] * mtx2->data[i * 4 + x];
-            matrix.data[y * 4 + x] = value >> 12;
-        }
+            matrix.data[y * 4 + x] = ((int64_t)mtx1->data[y * 5] * mtx2->data[y * 4 + x]) >> 12;
     }
+    memcpy(&matrix.data[12], &mtx2->data[12], 4 * sizeof(int32_t));
+
+    return matrix;
+}
+
+Matrix Gpu3D::multiplyTrans(Matrix *mtx1, Matrix *mtx2)
+{
+    Matrix matrix;
+
+    // Multiply a translation matrix with another matrix
+    // Only the last row of the translation matrix differs from identity, so the first 3 rows are unchanged
+    memcpy(matrix.data, mtx2->data, 12 * sizeof(int32_t));
+    multiplyRow<4>(&mtx1->data[12], mtx2->data, &matrix.data[12]);
 
     return matrix;
 }
@@ -255,10 +416,13 @@ Vertex Gpu3D::multiply(Vertex *vtx, Matrix *mtx)
     Vertex vertex = *vtx;
 
     // Multiply a vertex with a matrix
-    vertex.x = ((int64_t)vtx->x * mtx->data[0] + (int64_t)vtx->y * mtx->data[4] + (int64_t)vtx->z * mtx->data[8]  + (int64_t)vtx->w * mtx->data[12]) >> 12;
-    vertex.y = ((int64_t)vtx->x * mtx->data[1] + (int64_t)vtx->y * mtx->data[5] + (int64_t)vtx->z * mtx->data[9]  + (int64_t)vtx->w * mtx->data[13]) >> 12;
-    vertex.z = ((int64_t)vtx->x * mtx->data[2] + (int64_t)vtx->y * mtx->data[6] + (int64_t)vtx->z * mtx->data[10] + (int64_t)vtx->w * mtx->data[14]) >> 12;
-    vertex.w = ((int64_t)vtx->x * mtx->data[3] + (int64_t)vtx->y * mtx->data[7] + (int64_t)vtx->z * mtx->data[11] + (int64_t)vtx->w * mtx->data[15]) >> 12;
+    int32_t row[4] = { vtx->x, vtx->y, vtx->z, vtx->w };
+    int32_t out[4];
+    multiplyRow<4>(row, mtx->data, out);
+    vertex.x = out[0];
+    vertex.y = out[1];
+    vertex.z = out[2];
+    vertex.w = out[3];
 
     return vertex;
 }
@@ -269,6 +433,16 @@ int32_t Gpu3D::multiply(Vertex *vec1, Vertex *vec2)
     return ((int64_t)vec1->x * vec2->x + (int64_t)vec1->y * vec2->y + (int64_t)vec1->z * vec2->z) >> 12;
 }
 
+void Gpu3D::updateClip()
+{
+    // The clip matrix is only recalculated when something uses it, since games often change the other matrices many times in between
+    if (clipDirty)
+    {
+        clip = multiply(&coordinate, &projection);
+        clipDirty = false;
+    }
+}
+
 void Gpu3D::addVertex()
 {
     if (vertexCountIn >= 6144) return;
@@ -294,11 +468,7 @@ void Gpu3D::addVertex()
     }
 
     // Update the clip matrix if necessary
-    if (clipDirty)
-    {
-        clip = multiply(&coordinate, &projection);
-        clipDirty = false;
-    }
+    updateClip();
 
     // Transform the vertex
     verticesIn[vertexCountIn] = multiply(&verticesIn[vertexCountIn], &clip);
@@ -323,12 +493,12 @@ void Gpu3D::addPolygon()
 
     // Set the polygon vertex information
     int size = 3 + (polygonType & 1);
-    savedPolygon.size = size;
-    savedPolygon.vertices = &verticesIn[vertexCountIn - size];
+    int clippedSize = size;
+    int vertex = vertexCountIn - size;
 
     // Save a copy of the unclipped vertices
     Vertex unclipped[10];
-    memcpy(unclipped, savedPolygon.vertices, size * sizeof(Vertex));
+    memcpy(unclipped, &verticesIn[vertex], size * sizeof(Vertex));
 
     // Rearrange quad strip vertices to be counter-clockwise
     if (polygonType == 3)
@@ -340,11 +510,11 @@ void Gpu3D::addPolygon()
 
     // Clip the polygon
     Vertex clipped[10];
-    bool clip = clipPolygon(unclipped, clipped, &savedPolygon.size);
+    bool clip = clipPolygon(unclipped, clipped, &clippedSize);
 
     // Calculate the cross product of the normalized polygon vertices to determine orientation
     int64_t cross = 0;
-    if (savedPolygon.size >= 3)
+    if (clippedSize >= 3)
     {
         cross = (((int64_t)clipped[1].x << 12) / clipped[1].w - ((int64_t)clipped[0].x << 12) / clipped[0].w) *
                 (((int64_t)clipped[2].y << 12) / clipped[2].w - ((int64_t)clipped[0].y << 12) / clipped[0].w) -
@@ -361,7 +531,7 @@ void Gpu3D::addPolygon()
     }
 
     // Discard polygons that are outside of the view area or should be culled
-    if (savedPolygon.size == 0 || (!renderFront && cross > 0) || (!renderBack && cross < 0))
+    if (clippedSize == 0 || (!renderFront && cross > 0) || (!renderBack && cross < 0))
     {
         switch (polygonType)
         {
@@ -424,7 +594,7 @@ void Gpu3D::addPolygon()
                 vertexCountIn -= size;
 
                 // Add the clipped vertices
-                for (int i = 0; i < savedPolygon.size; i++)
+                for (int i = 0; i < clippedSize; i++)
                 {
                     if (vertexCountIn >= 6144) return;
                     verticesIn[vertexCountIn] = clipped[i];
@@ -437,10 +607,10 @@ void Gpu3D::addPolygon()
             {
                 // Remove the unclipped vertices
                 vertexCountIn -= (vertexCount == 3) ? 3 : 1;
-                savedPolygon.vertices = &verticesIn[vertexCountIn];
+                vertex = vertexCountIn;
 
                 // Add the clipped vertices
-                for (int i = 0; i < savedPolygon.size; i++)
+                for (int i = 0; i < clippedSize; i++)
                 {
                     if (vertexCountIn >= 6144) return;
                     verticesIn[vertexCountIn] = clipped[i];
@@ -462,10 +632,10 @@ void Gpu3D::addPolygon()
             {
                 // Remove the unclipped vertices
                 vertexCountIn -= (vertexCount == 4) ? 4 : 2;
-                savedPolygon.vertices = &verticesIn[vertexCountIn];
+                vertex = vertexCountIn;
 
                 // Add the clipped vertices
-                for (int i = 0; i < savedPolygon.size; i++)
+                for (int i = 0; i < clippedSize; i++)
                 {
                     if (vertexCountIn >= 6144) return;
                     verticesIn[vertexCountIn] = clipped[i];
@@ -486,9 +656,15 @@ void Gpu3D::addPolygon()
     }
 
     // Set the new polygon
-    polygonsIn[polygonCountIn] = savedPolygon;
-    polygonsIn[polygonCountIn].crossed = (polygonType == 3 && !clip);
-    polygonsIn[polygonCountIn].paletteAddr <<= 4 - (savedPolygon.textureFmt == 2);
+    // Translucency decides the drawing order, so it's worked out here instead of for every frame
+    _Polygon *polygon = &polygonsIn[polygonCountIn];
+    polygon->vertex = vertex;
+    polygon->size = clippedSize;
+    polygon->crossed = (polygonType == 3 && !clip);
+    polygon->translucent = (savedAttribs.alpha < 0x3F || savedAttribs.textureFmt == 1 || savedAttribs.textureFmt == 6);
+    polygon->wShift = 0;
+    attribsIn[polygonCountIn] = savedAttribs;
+    attribsIn[polygonCountIn].paletteAddr <<= 4 - (savedAttribs.textureFmt == 2);
 
     // Move to the next polygon
     polygonCountIn++;
@@ -926,29 +1102,29 @@ void Gpu3D::mtxMult43Cmd(uint32_t param)
     {
         case 0: // Projection stack
         {
-            projection = multiply(&temp, &projection);
+            projection = multiply43(&temp, &projection);
             clipDirty = true;
             break;
         }
 
         case 1: // Coordinate stack
         {
-            coordinate = multiply(&temp, &coordinate);
+            coordinate = multiply43(&temp, &coordinate);
             clipDirty = true;
             break;
         }
 
         case 2: // Coordinate and directional stacks
         {
-            coordinate = multiply(&temp, &coordinate);
-            direction = multiply(&temp, &direction);
+            coordinate = multiply43(&temp, &coordinate);
+            direction = multiply43(&temp, &direction);
             clipDirty = true;
             break;
         }
 
         case 3: // Texture stack
         {
-            texture = multiply(&temp, &texture);
+            texture = multiply43(&temp, &texture);
             break;
         }
     }
@@ -967,29 +1143,29 @@ void Gpu3D::mtxMult33Cmd(uint32_t param)
     {
         case 0: // Projection stack
         {
-            projection = multiply(&temp, &projection);
+            projection = multiply33(&temp, &projection);
             clipDirty = true;
             break;
         }
 
         case 1: // Coordinate stack
         {
-            coordinate = multiply(&temp, &coordinate);
+            coordinate = multiply33(&temp, &coordinate);
             clipDirty = true;
             break;
         }
 
         case 2: // Coordinate and directional stacks
         {
-            coordinate = multiply(&temp, &coordinate);
-            direction = multiply(&temp, &direction);
+            coordinate = multiply33(&temp, &coordinate);
+            direction = multiply33(&temp, &direction);
             clipDirty = true;
             break;
         }
 
         case 3: // Texture stack
         {
-            texture = multiply(&temp, &texture);
+            texture = multiply33(&temp, &texture);
             break;
         }
     }
@@ -1008,21 +1184,21 @@ void Gpu3D::mtxScaleCmd(uint32_t param)
     {
         case 0: // Projection stack
         {
-            projection = multiply(&temp, &projection);
+            projection = multiplyScale(&temp, &projection);
             clipDirty = true;
             break;
         }
 
         case 1: case 2: // Coordinate stack
         {
-            coordinate = multiply(&temp, &coordinate);
+            coordinate = multiplyScale(&temp, &coordinate);
             clipDirty = true;
             break;
         }
 
         case 3: // Texture stack
         {
-            texture = multiply(&temp, &texture);
+            texture = multiplyScale(&temp, &texture);
             break;
         }
     }
@@ -1041,29 +1217,29 @@ void Gpu3D::mtxTransCmd(uint32_t param)
     {
         case 0: // Projection stack
         {
-            projection = multiply(&temp, &projection);
+            projection = multiplyTrans(&temp, &projection);
             clipDirty = true;
             break;
         }
 
         case 1: // Coordinate stack
         {
-            coordinate = multiply(&temp, &coordinate);
+            coordinate = multiplyTrans(&temp, &coordinate);
             clipDirty = true;
             break;
         }
 
         case 2: // Coordinate and directional stacks
         {
-            coordinate = multiply(&temp, &coordinate);
-            direction = multiply(&temp, &direction);
+            coordinate = multiplyTrans(&temp, &coordinate);
+            direction = multiplyTrans(&temp, &direction);
             clipDirty = true;
             break;
         }
 
         case 3: // Texture stack
         {
-            texture = multiply(&temp, &texture);
+            texture = multiplyTrans(&temp, &texture);
             break;
         }
     }
@@ -1255,22 +1431,22 @@ void Gpu3D::polygonAttrCmd(uint32_t param)
 void Gpu3D::texImageParamCmd(uint32_t param)
 {
     // Set the texture parameters
-    savedPolygon.textureAddr = (param & 0x0000FFFF) << 3;
-    savedPolygon.sizeS = 8 << ((param & 0x00700000) >> 20);
-    savedPolygon.sizeT = 8 << ((param & 0x03800000) >> 23);
-    savedPolygon.repeatS = param & BIT(16);
-    savedPolygon.repeatT = param & BIT(17);
-    savedPolygon.flipS = param & BIT(18);
-    savedPolygon.flipT = param & BIT(19);
-    savedPolygon.textureFmt = (param & 0x1C000000) >> 26;
-    savedPolygon.transparent0 = param & BIT(29);
+    savedAttribs.textureAddr = (param & 0x0000FFFF) << 3;
+    savedAttribs.sizeS = 8 << ((param & 0x00700000) >> 20);
+    savedAttribs.sizeT = 8 << ((param & 0x03800000) >> 23);
+    savedAttribs.repeatS = param & BIT(16);
+    savedAttribs.repeatT = param & BIT(17);
+    savedAttribs.flipS = param & BIT(18);
+    savedAttribs.flipT = param & BIT(19);
+    savedAttribs.textureFmt = (param & 0x1C000000) >> 26;
+    savedAttribs.transparent0 = param & BIT(29);
     textureCoordMode = (param & 0xC0000000) >> 30;
 }
 
 void Gpu3D::plttBaseCmd(uint32_t param)
 {
     // Set the palette base address
-    savedPolygon.paletteAddr = param & 0x00001FFF;
+    savedAttribs.paletteAddr = param & 0x00001FFF;
 }
 
 void Gpu3D::difAmbCmd(uint32_t param)
@@ -1341,21 +1517,21 @@ void Gpu3D::beginVtxsCmd(uint32_t param)
 
     // Apply the polygon attributes
     enabledLights = polygonAttr & 0x0000000F;
-    savedPolygon.mode = (polygonAttr & 0x00000030) >> 4;
+    savedAttribs.mode = (polygonAttr & 0x00000030) >> 4;
     renderBack = polygonAttr & BIT(6);
     renderFront = polygonAttr & BIT(7);
-    savedPolygon.transNewDepth = polygonAttr & BIT(11);
-    savedPolygon.depthTestEqual = polygonAttr & BIT(14);
-    savedPolygon.fog = polygonAttr & BIT(15);
-    savedPolygon.alpha = ((polygonAttr & 0x001F0000) >> 16) * 2;
-    if (savedPolygon.alpha > 0) savedPolygon.alpha++;
-    savedPolygon.id = (polygonAttr & 0x3F000000) >> 24;
+    savedAttribs.transNewDepth = polygonAttr & BIT(11);
+    savedAttribs.depthTestEqual = polygonAttr & BIT(14);
+    savedAttribs.fog = polygonAttr & BIT(15);
+    savedAttribs.alpha = ((polygonAttr & 0x001F0000) >> 16) * 2;
+    if (savedAttribs.alpha > 0) savedAttribs.alpha++;
+    savedAttribs.id = (polygonAttr & 0x3F000000) >> 24;
 }
 
 void Gpu3D::swapBuffersCmd(uint32_t param)
 {
     // Set the W-buffering toggle
-    savedPolygon.wBuffer = param & BIT(1);
+    savedAttribs.wBuffer = param & BIT(1);
 
     // Halt the geometry engine
     // The buffers will be swapped and the engine unhalted on next V-blank
@@ -1407,11 +1583,7 @@ void Gpu3D::boxTestCmd(uint32_t param)
     vertices[7].z = boxTestCoords[2] + boxTestCoords[5];
 
     // Update the clip matrix if necessary
-    if (clipDirty)
-    {
-        clip = multiply(&coordinate, &projection);
-        clipDirty = false;
-    }
+    updateClip();
 
     // Transform the vertices
     for (int i = 0; i < 8; i++)
@@ -1466,11 +1638,7 @@ void Gpu3D::posTestCmd(uint32_t param)
         savedVertex.w = 1 << 12;
 
         // Update the clip matrix if necessary
-        if (clipDirty)
-        {
-            clip = multiply(&coordinate, &projection);
-            clipDirty = false;
-        }
+        updateClip();
 
         // Multiply the vertex with the clip matrix and set the result
         Vertex vertex = multiply(&savedVertex, &clip);
@@ -1509,16 +1677,19 @@ void Gpu3D::addEntry(Entry entry)
     }
     else
     {
-        // If the FIFO is full, free space by running cycles
+        // If the FIFO is full, free space by running commands
         // On real hardware, a GXFIFO overflow would halt the CPU until space is free
+        // This steps even while the engine is halted waiting for V-blank, or the FIFO would never drain
         while (fifo.size() >= 256)
-            runCycle();
+            stepCommand();
 
         // Move data into the FIFO
         fifo.push(entry);
 
-        // Update the FIFO status
-        gxStat = (gxStat & ~0x01FF0000) | (fifo.size() << 16); // Count
+        // Update the FIFO status, including the stack pointers of any commands that were just run
+        gxStat = (gxStat & ~0x00001F00) | (coordinatePtr <<  8); // Coordinate stack pointer
+        gxStat = (gxStat & ~0x00002000) | (projectionPtr << 13); // Projection stack pointer
+        gxStat = (gxStat & ~0x01FF0000) | (fifo.size()   << 16); // Count
         gxStat &= ~BIT(26); // Not empty
 
         // If the FIFO is half full or more, disable GXFIFO DMA transfers
@@ -1843,11 +2014,7 @@ uint32_t Gpu3D::readRamCount()
 uint32_t Gpu3D::readClipMtxResult(int index)
 {
     // Update the clip matrix if necessary
-    if (clipDirty)
-    {
-        clip = multiply(&coordinate, &projection);
-        clipDirty = false;
-    }
+    updateClip();
 
     // Read from one of the CLIPMTX_RESULT registers
     return clip.data[index];
@@ -1858,3 +2025,171 @@ uint32_t Gpu3D::readVecMtxResult(int index)
     // Read from one of the VECMTX_RESULT registers
     return direction.data[(index / 3) * 4 + index % 3];
 }
+
+void Gpu3D::saveState(FILE *file)
+{
+    // Write the state to a file
+    fwrite(&halted, sizeof(halted), 1, file);
+    fwrite(&paramCount, sizeof(paramCount), 1, file);
+    fwrite(&matrixMode, sizeof(matrixMode), 1, file);
+    fwrite(&projectionPtr, sizeof(projectionPtr), 1, file);
+    fwrite(&coordinatePtr, sizeof(coordinatePtr), 1, file);
+    fwrite(&clipDirty, sizeof(clipDirty), 1, file);
+    fwrite(&projection, sizeof(projection), 1, file);
+    fwrite(&projectionStack, sizeof(projectionStack), 1, file);
+    fwrite(&coordinate, sizeof(coordinate), 1, file);
+    fwrite(coordinateStack, sizeof(coordinateStack), 1, file);
+    fwrite(&direction, sizeof(direction), 1, file);
+    fwrite(directionStack, sizeof(directionStack), 1, file);
+    fwrite(&texture, sizeof(texture), 1, file);
+    fwrite(&textureStack, sizeof(textureStack), 1, file);
+    fwrite(&clip, sizeof(clip), 1, file);
+    fwrite(&temp, sizeof(temp), 1, file);
+    fwrite(verticesIn, sizeof(verticesIn), 1, file);
+    fwrite(&vertexList, sizeof(vertexList), 1, file);
+    fwrite(&vertexCountIn, sizeof(vertexCountIn), 1, file);
+    fwrite(&vertexCountOut, sizeof(vertexCountOut), 1, file);
+    fwrite(polygons1, sizeof(polygons1), 1, file);
+    fwrite(polygons2, sizeof(polygons2), 1, file);
+    fwrite(attribs1, sizeof(attribs1), 1, file);
+    fwrite(attribs2, sizeof(attribs2), 1, file);
+    fwrite(&polygonCountIn, sizeof(polygonCountIn), 1, file);
+    fwrite(&polygonCountOut, sizeof(polygonCountOut), 1, file);
+    fwrite(&sceneHash, sizeof(sceneHash), 1, file);
+    fwrite(&savedVertex, sizeof(savedVertex), 1, file);
+    fwrite(&savedAttribs, sizeof(savedAttribs), 1, file);
+    fwrite(&s, sizeof(s), 1, file);
+    fwrite(&t, sizeof(t), 1, file);
+    fwrite(&vertexCount, sizeof(vertexCount), 1, file);
+    fwrite(&clockwise, sizeof(clockwise), 1, file);
+    fwrite(&polygonType, sizeof(polygonType), 1, file);
+    fwrite(&textureCoordMode, sizeof(textureCoordMode), 1, file);
+    fwrite(&polygonAttr, sizeof(polygonAttr), 1, file);
+    fwrite(&enabledLights, sizeof(enabledLights), 1, file);
+    fwrite(&renderBack, sizeof(renderBack), 1, file);
+    fwrite(&renderFront, sizeof(renderFront), 1, file);
+    fwrite(&diffuseColor, sizeof(diffuseColor), 1, file);
+    fwrite(&ambientColor, sizeof(ambientColor), 1, file);
+    fwrite(&specularColor, sizeof(specularColor), 1, file);
+    fwrite(&emissionColor, sizeof(emissionColor), 1, file);
+    fwrite(&shininessEnabled, sizeof(shininessEnabled), 1, file);
+    fwrite(lightVector, sizeof(lightVector), 1, file);
+    fwrite(halfVector, sizeof(halfVector), 1, file);
+    fwrite(lightColor, sizeof(lightColor), 1, file);
+    fwrite(shininess, sizeof(shininess), 1, file);
+    fwrite(&viewportX, sizeof(viewportX), 1, file);
+    fwrite(&viewportY, sizeof(viewportY), 1, file);
+    fwrite(&viewportWidth, sizeof(viewportWidth), 1, file);
+    fwrite(&viewportHeight, sizeof(viewportHeight), 1, file);
+    fwrite(boxTestCoords, sizeof(boxTestCoords), 1, file);
+    fwrite(&gxFifo, sizeof(gxFifo), 1, file);
+    fwrite(&gxStat, sizeof(gxStat), 1, file);
+    fwrite(posResult, sizeof(posResult), 1, file);
+    fwrite(vecResult, sizeof(vecResult), 1, file);
+    fwrite(&gxFifoCount, sizeof(gxFifoCount), 1, file);
+
+    // Write which polygon buffers are in use
+    bool swapped = (polygonsIn != polygons1);
+    fwrite(&swapped, sizeof(swapped), 1, file);
+
+    // Write the FIFO and pipe contents, oldest first
+    for (int i = 0; i < 2; i++)
+    {
+        EntryQueue queue = i ? pipe : fifo;
+        uint32_t size = queue.size();
+        fwrite(&size, sizeof(size), 1, file);
+        for (; !queue.empty(); queue.pop())
+        {
+            fwrite(&queue.front().command, sizeof(uint8_t), 1, file);
+            fwrite(&queue.front().param, sizeof(uint32_t), 1, file);
+        }
+    }
+}
+
+void Gpu3D::loadState(FILE *file)
+{
+    // Read the state from a file
+    fread(&halted, sizeof(halted), 1, file);
+    fread(&paramCount, sizeof(paramCount), 1, file);
+    fread(&matrixMode, sizeof(matrixMode), 1, file);
+    fread(&projectionPtr, sizeof(projectionPtr), 1, file);
+    fread(&coordinatePtr, sizeof(coordinatePtr), 1, file);
+    fread(&clipDirty, sizeof(clipDirty), 1, file);
+    fread(&projection, sizeof(projection), 1, file);
+    fread(&projectionStack, sizeof(projectionStack), 1, file);
+    fread(&coordinate, sizeof(coordinate), 1, file);
+    fread(coordinateStack, sizeof(coordinateStack), 1, file);
+    fread(&direction, sizeof(direction), 1, file);
+    fread(directionStack, sizeof(directionStack), 1, file);
+    fread(&texture, sizeof(texture), 1, file);
+    fread(&textureStack, sizeof(textureStack), 1, file);
+    fread(&clip, sizeof(clip), 1, file);
+    fread(&temp, sizeof(temp), 1, file);
+    fread(verticesIn, sizeof(verticesIn), 1, file);
+    fread(&vertexList, sizeof(vertexList), 1, file);
+    fread(&vertexCountIn, sizeof(vertexCountIn), 1, file);
+    fread(&vertexCountOut, sizeof(vertexCountOut), 1, file);
+    fread(polygons1, sizeof(polygons1), 1, file);
+    fread(polygons2, sizeof(polygons2), 1, file);
+    fread(attribs1, sizeof(attribs1), 1, file);
+    fread(attribs2, sizeof(attribs2), 1, file);
+    fread(&polygonCountIn, sizeof(polygonCountIn), 1, file);
+    fread(&polygonCountOut, sizeof(polygonCountOut), 1, file);
+    fread(&sceneHash, sizeof(sceneHash), 1, file);
+    fread(&savedVertex, sizeof(savedVertex), 1, file);
+    fread(&savedAttribs, sizeof(savedAttribs), 1, file);
+    fread(&s, sizeof(s), 1, file);
+    fread(&t, sizeof(t), 1, file);
+    fread(&vertexCount, sizeof(vertexCount), 1, file);
+    fread(&clockwise, sizeof(clockwise), 1, file);
+    fread(&polygonType, sizeof(polygonType), 1, file);
+    fread(&textureCoordMode, sizeof(textureCoordMode), 1, file);
+    fread(&polygonAttr, sizeof(polygonAttr), 1, file);
+    fread(&enabledLights, sizeof(enabledLights), 1, file);
+    fread(&renderBack, sizeof(renderBack), 1, file);
+    fread(&renderFront, sizeof(renderFront), 1, file);
+    fread(&diffuseColor, sizeof(diffuseColor), 1, file);
+    fread(&ambientColor, sizeof(ambientColor), 1, file);
+    fread(&specularColor, sizeof(specularColor), 1, file);
+    fread(&emissionColor, sizeof(emissionColor), 1, file);
+    fread(&shininessEnabled, sizeof(shininessEnabled), 1, file);
+    fread(lightVector, sizeof(lightVector), 1, file);
+    fread(halfVector, sizeof(halfVector), 1, file);
+    fread(lightColor, sizeof(lightColor), 1, file);
+    fread(shininess, sizeof(shininess), 1, file);
+    fread(&viewportX, sizeof(viewportX), 1, file);
+    fread(&viewportY, sizeof(viewportY), 1, file);
+    fread(&viewportWidth, sizeof(viewportWidth), 1, file);
+    fread(&viewportHeight, sizeof(viewportHeight), 1, file);
+    fread(boxTestCoords, sizeof(boxTestCoords), 1, file);
+    fread(&gxFifo, sizeof(gxFifo), 1, file);
+    fread(&gxStat, sizeof(gxStat), 1, file);
+    fread(posResult, sizeof(posResult), 1, file);
+    fread(vecResult, sizeof(vecResult), 1, file);
+    fread(&gxFifoCount, sizeof(gxFifoCount), 1, file);
+
+    // Restore the polygon buffer pointers
+    bool swapped = false;
+    fread(&swapped, sizeof(swapped), 1, file);
+    polygonsIn  = swapped ? polygons2 : polygons1;
+    polygonsOut = swapped ? polygons1 : polygons2;
+    attribsIn   = swapped ? attribs2  : attribs1;
+    attribsOut  = swapped ? attribs1  : attribs2;
+
+    // Read the FIFO and pipe contents
+    for (int i = 0; i < 2; i++)
+    {
+        EntryQueue *queue = i ? &pipe : &fifo;
+        *queue = EntryQueue();
+        uint32_t size = 0;
+        fread(&size, sizeof(size), 1, file);
+        for (uint32_t j = 0; j < size; j++)
+        {
+            uint8_t command = 0;
+            uint32_t param = 0;
+            fread(&command, sizeof(command), 1, file);
+            fread(&param, sizeof(param), 1, file);
+            if (queue->size() < 256) queue->push(Entry(command, param));
+        }
+    }
+}
@@ -21,7 +21,7 @@
 #define GPU_3D_H
 
 #include <cstdint>
-#include <queue>
+#include <cstdio>
 
 #include "defines.h"
 
@@ -29,12 +29,29 @@ class Core;
 
 struct Entry
 {
+    Entry(): command(0), param(0) {}
     Entry(uint8_t command, uint32_t param): command(command), param(param) {}
 
     uint8_t command;
     uint32_t param;
 };
 
+class EntryQueue
+{
+    public:
+        // A fixed-size ring buffer of geometry commands, big enough for the whole FIFO
+        bool empty() { return count == 0; }
+        int size()   { return count;      }
+
+        Entry &front()          { return entries[head];                      }
+        void push(Entry entry)  { entries[(head + count++) & 0xFF] = entry;  }
+        void pop()              { head = (head + 1) & 0xFF; count--;         }
+
+    private:
+        Entry entries[256];
+        int head = 0, count = 0;
+};
+
 struct Matrix
 {
     int32_t data[4 * 4] =
@@ -53,28 +70,43 @@ struct Vertex
     uint32_t color = 0;
 };
 
+struct VertexList
+{
+    // Vertices as handed to the renderer, normalized to the viewport and kept as one array per attribute
+    // X coordinates are 9-bit and Y coordinates are 8-bit, so they're stored as 16-bit values
+    uint16_t x[6144] = {}, y[6144] = {};
+    int32_t z[6144] = {}, w[6144] = {};
+    int16_t s[6144] = {}, t[6144] = {};
+    uint32_t color[6144] = {};
+};
+
 struct _Polygon
 {
-    int size = 0;
-    Vertex *vertices = nullptr;
+    // What's needed to bin, sort and find the edges of a polygon; everything else is in its PolygonAttribs
+    uint16_t vertex = 0;
+    uint8_t size = 0;
     bool crossed = false;
+    bool translucent = false;
+    int8_t wShift = 0;
+};
 
-    int mode = 0;
+struct PolygonAttribs
+{
+    uint8_t mode = 0;
     bool transNewDepth = false;
     bool depthTestEqual = false;
     bool fog = false;
     uint8_t alpha = 0;
-    int id = 0;
+    uint8_t id = 0;
 
     uint32_t textureAddr = 0, paletteAddr = 0;
-    int sizeS = 0, sizeT = 0;
+    uint16_t sizeS = 0, sizeT = 0;
     bool repeatS = false, repeatT = false;
     bool flipS = false, flipT = false;
-    int textureFmt = 0;
+    uint8_t textureFmt = 0;
     bool transparent0 = false;
 
     bool wBuffer = false;
-    int wShift = 0;
 };
 
 
@@ -83,14 +115,20 @@ class Gpu3D
     public:
         Gpu3D(Core *core);
 
-        void runCycle();
+        void saveState(FILE *file);
+        void loadState(FILE *file);
+
+        int runCommands(int cycles);
         void swapBuffers();
 
         bool shouldRun()  { return !halted && (gxStat & BIT(27)); }
         bool shouldSwap() { return  halted;                       }
 
-        _Polygon *getPolygons()     { return polygonsOut;     }
-        int       getPolygonCount() { return polygonCountOut; }
+        VertexList     *getVertices()        { return &vertexList;     }
+        _Polygon       *getPolygons()        { return polygonsOut;     }
+        PolygonAttribs *getPolygonAttribs()  { return attribsOut;      }
+        int             getPolygonCount()    { return polygonCountOut; }
+        uint64_t        getSceneHash()       { return sceneHash;       }
 
         uint32_t readGxStat()             { return gxStat;           }
         uint32_t readPosResult(int index) { return posResult[index]; }
@@ -144,7 +182,7 @@ class Gpu3D
 
         bool halted = false;
 
-        std::queue<Entry> fifo, pipe;
+        EntryQueue fifo, pipe;
 
         int paramCounts[0x100] = {};
         int paramCount = 0;
@@ -160,16 +198,21 @@ class Gpu3D
         Matrix clip;
         Matrix temp;
 
-        Vertex vertices1[6144], vertices2[6144];
-        Vertex *verticesIn = vertices1, *verticesOut = vertices2;
+        // Vertices are built and clipped as structs, then copied to the renderer's list when the buffers are swapped
+        Vertex verticesIn[6144];
+        VertexList vertexList;
         int vertexCountIn = 0, vertexCountOut = 0;
 
+        // Polygons are split into the few fields needed for setup and the attributes only needed while drawing
         _Polygon polygons1[2048], polygons2[2048];
+        PolygonAttribs attribs1[2048], attribs2[2048];
         _Polygon *polygonsIn = polygons1, *polygonsOut = polygons2;
+        PolygonAttribs *attribsIn = attribs1, *attribsOut = attribs2;
         int polygonCountIn = 0, polygonCountOut = 0;
+        uint64_t sceneHash = 0;
 
         Vertex savedVertex;
-        _Polygon savedPolygon;
+        PolygonAttribs savedAttribs;
         int16_t s, t;
 
         int vertexCount = 0;
@@ -200,12 +243,22 @@ class Gpu3D
 
         int gxFifoCount = 0;
 
+        static uint64_t mixHash(uint64_t hash, uint32_t value);
+
+        template <int terms> static void multiplyRow(const int32_t *row, const int32_t *mtx, int32_t *out);
         Matrix multiply(Matrix *mtx1, Matrix *mtx2);
+        Matrix multiply43(Matrix *mtx1, Matrix *mtx2);
+        Matrix multiply33(Matrix *mtx1, Matrix *mtx2);
+        Matrix multiplyScale(Matrix *mtx1, Matrix *mtx2);
+        Matrix multiplyTrans(Matrix *mtx1, Matrix *mtx2);
         Vertex multiply(Vertex *vtx, Matrix *mtx);
         int32_t multiply(Vertex *vec1, Vertex *vec2);
 
         uint32_t rgb5ToRgb6(uint16_t color);
 
+        void stepCommand();
+        void runCommand(Entry entry);
+        void updateClip();
         void addVertex();
         void addPolygon();
 
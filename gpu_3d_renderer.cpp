@@ -18,22 +18,42 @@
 */
 
 #include <cstring>
-#include <vector>
 
 #include "gpu_3d_renderer.h"
 #include "core.h"
 #include "settings.h"
 
+// Depth tests of polygon spans and the fog pass use SIMD where the host has it
+// Defining GPU3D_SCALAR uses the plain loop instead, for checking the others against
+#if !defined(GPU3D_SCALAR) && defined(__SSE2__)
+#include <emmintrin.h>
+#elif !defined(GPU3D_SCALAR) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 Gpu3DRenderer::Gpu3DRenderer(Core *core): core(core)
 {
+#ifndef PSP
     // Mark the scanlines as ready to start
     // This is mainly in case 3D is requested before the threads have a chance to start
     for (int i = 0; i < 192; i++)
         ready[i] = true;
+#endif
+
+    // Build the tables used to avoid divisions when interpolating pixels
+    reciprocals[0] = 0;
+    for (int i = 1; i < 512; i++)
+    {
+        reciprocals[i] = 0xFFFFFFFF / i;
+        dividers[i].setup(i);
+    }
 }
 
 Gpu3DRenderer::~Gpu3DRenderer()
 {
+#ifndef PSP
+    stopThreads();
+#endif
 }
 
 uint32_t Gpu3DRenderer::rgba5ToRgba6(uint32_t color)
@@ -53,20 +73,200 @@ uint16_t *Gpu3DRenderer::getFramebuffer(int line)
 
 void Gpu3DRenderer::drawScanline(int line)
 {
-    drawScanline1(line, 0);
+    if (line == 0)
+    {
+        // Make sure the last frame is finished before setting up a new one
+        for (int i = 0; i < 192; i++)
+            waitScanline(i);
+
+        // Resolve the texture and palette slots for the frame
+        // Any change to the mapping is counted, so textures decoded with a different mapping aren't reused
+        if (memcmp(texSlots, core->memory.getTex3D(), sizeof(texSlots)) || memcmp(palSlots, core->memory.getPal3D(), sizeof(palSlots)))
+        {
+            memcpy(texSlots, core->memory.getTex3D(), sizeof(texSlots));
+            memcpy(palSlots, core->memory.getPal3D(), sizeof(palSlots));
+            slotEpoch++;
+        }
+
+        // Get the versions of the texture and palette pages, so changes to cached textures can be found
+        for (int i = 0; i < 32; i++)
+            pageVersions[i] = texSlots[i >> 3] ? core->memory.getVramVersion(&texSlots[i >> 3][(i & 7) << 14]) : 0;
+        for (int i = 0; i < 6; i++)
+            pageVersions[32 + i] = palSlots[i] ? core->memory.getVramVersion(palSlots[i]) : 0;
+
+        // Clear the texture cache if it has grown past half of its limit
+        if (cachedTexels > TEXTURE_CACHE_LIMIT / 2)
+        {
+            for (int i = 0; i < 256; i++)
+                std::vector<uint32_t>().swap(textureCache[i].texels);
+            cachedTexels = 0;
+        }
+        // Keep the last frame if the same scene would be drawn the same way again
+        FrameKey key;
+        getFrameKey(&key);
+        reuseFrame = frameValid && !memcmp(&key, &frameKey, sizeof(key));
+        if (reuseFrame) return;
+        frameKey = key;
+        frameValid = true;
+        frame++;
+
+        // Rebuild the fog densities once per frame if their registers changed
+        if (fogDirty)
+            updateFogDensities();
+
+        setupPolygons();
+
+#ifndef PSP
+        // Update the worker threads if the setting changed
+        int count = Settings::getThreaded3D();
+        if (count < 0) count = 0;
+        if (count > 4) count = 4;
+        if (count != activeThreads)
+            startThreads(count);
+
+        // Hand the whole frame to the threads if there are any
+        if (activeThreads > 0)
+        {
+            for (int i = 0; i < 192; i++)
+                ready[i] = false;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            generation++;
+            start.notify_all();
+        }
+#endif
+    }
+
+    // Without threads, scanlines are drawn as they're requested
+    if (activeThreads == 0 && !reuseFrame)
+        drawScanline1(line, 0);
+}
+
+void Gpu3DRenderer::waitScanline(int line)
+{
+#ifndef PSP
+    // Wait for a scanline to be drawn by the threads
+    while (!ready[line])
+        std::this_thread::yield();
+#endif
+}
+
+#ifndef PSP
+void Gpu3DRenderer::startThreads(int count)
+{
+    stopThreads();
+
+    // Start the requested number of threads, which wait for the next frame
+    stopping = false;
+    activeThreads = count;
+    for (int i = 0; i < count; i++)
+        threads.push_back(std::thread(&Gpu3DRenderer::drawThreaded, this, i));
+}
+
+void Gpu3DRenderer::stopThreads()
+{
+    // Stop the worker threads once they finish what they're drawing
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start.notify_all();
+    for (unsigned int i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    threads.clear();
+    activeThreads = 0;
+}
+#endif
+
+void Gpu3DRenderer::getFrameKey(FrameKey *key)
+{
+    // Gather the state that decides what a frame looks like
+    // The key is cleared first so padding doesn't affect comparisons
+    memset(key, 0, sizeof(FrameKey));
+    key->sceneHash = core->gpu3D.getSceneHash();
+    key->slotEpoch = slotEpoch;
+    memcpy(key->pageVersions, pageVersions, sizeof(pageVersions));
+    key->clearColor = clearColor;
+    key->fogColor = fogColor;
+    key->disp3DCnt = disp3DCnt;
+    key->clearDepth = clearDepth;
+    key->fogOffset = fogOffset;
+    memcpy(key->toonTable, toonTable, sizeof(toonTable));
+    memcpy(key->fogTable, fogTable, sizeof(fogTable));
+}
+
+void Gpu3DRenderer::setupPolygons()
+{
+    const VertexList *vertices = core->gpu3D.getVertices();
+    _Polygon *polygons = core->gpu3D.getPolygons();
+    PolygonAttribs *attribs = core->gpu3D.getPolygonAttribs();
+    int count = core->gpu3D.getPolygonCount();
+
+    // Find the scanlines each polygon covers
+    // A polygon has edges intersecting a scanline from its top vertex up to, but not including, its bottom one
+    for (int i = 0; i < count; i++)
+    {
+        const uint16_t *y = &vertices->y[polygons[i].vertex];
+        int top = y[0], bottom = top;
+        for (int j = 1; j < polygons[i].size; j++)
+        {
+            if (y[j] < top) top = y[j];
+            if (y[j] > bottom) bottom = y[j];
+        }
+        polygonTop[i] = top;
+        polygonBottom[i] = bottom;
+
+        // Decode the polygon's texture, or find it already decoded
+        polygonTexels[i] = attribs[i].textureFmt ? getTexels(&attribs[i]) : nullptr;
+    }
+
+    // Bin the polygons by the bands of scanlines they cover, in the order they're drawn
+    // Solid polygons are drawn first, followed by translucent ones
+    memset(bandCounts, 0, sizeof(bandCounts));
+    for (int translucent = 0; translucent < 2; translucent++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (polygons[i].translucent != translucent)
+                continue;
+
+            if (polygonTop[i] >= polygonBottom[i] || polygonTop[i] >= 192)
+                continue;
+
+            int last = ((polygonBottom[i] > 192) ? 191 : (polygonBottom[i] - 1)) >> 3;
+            for (int band = polygonTop[i] >> 3; band <= last; band++)
+                bandPolygons[band][bandCounts[band]++] = i;
+        }
+    }
 }
 
+#ifndef PSP
 void Gpu3DRenderer::drawThreaded(int thread)
 {
-    // Draw the 3D scanlines in a threaded sequence
-    // The amount of scanlines skipped per thread depends on the number of active threads
-    // Together, they render the entire 3D image
-    for (int i = thread; i < 192; i += activeThreads)
+    uint64_t current = 0;
+
+    while (true)
     {
-        drawScanline1(i, thread);
-        ready[i] = true;
+        // Wait for the next frame to be started
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start.wait(lock, [&]{ return stopping || generation != current; });
+            if (stopping) return;
+            current = generation;
+        }
+
+        // Draw the 3D scanlines in a threaded sequence
+        // The amount of scanlines skipped per thread depends on the number of active threads
+        // Together, they render the entire 3D image
+        for (int i = thread; i < 192; i += activeThreads)
+        {
+            drawScanline1(i, thread);
+            ready[i] = true;
+        }
     }
 }
+#endif
 
 void Gpu3DRenderer::drawScanline1(int line, int thread)
 {
@@ -85,86 +285,58 @@ void Gpu3DRenderer::drawScanline1(int line, int thread)
         attribBuffer[thread][i] = attrib;
     }
 
-    stencilClear[thread] = false;
+    // Start every scanline with a clear stencil buffer, so it doesn't depend on which line the thread drew before
+    memset(stencilBuffer[thread], 0, 256 * sizeof(uint8_t));
+    stencilClear[thread] = true;
 
-    std::vector<_Polygon*> translucent;
-
-    // Draw the solid polygons
-    for (int i = 0; i < core->gpu3D.getPolygonCount(); i++)
+    // Draw the polygons in the scanline's band that cover it, already in order with translucent ones last
+    _Polygon *polygons = core->gpu3D.getPolygons();
+    PolygonAttribs *attribs = core->gpu3D.getPolygonAttribs();
+    int band = line >> 3;
+    for (int i = 0; i < bandCounts[band]; i++)
     {
-        _Polygon *polygon = &core->gpu3D.getPolygons()[i];
-
-        // If the polygon is translucent, save it for last
-        if (polygon->alpha < 0x3F || polygon->textureFmt == 1 || polygon->textureFmt == 6)
-            translucent.push_back(polygon);
-        else
-            drawPolygon(line, thread, polygon);
+        int index = bandPolygons[band][i];
+        if (line >= polygonTop[index] && line < polygonBottom[index])
+            drawPolygon(line, thread, &polygons[index], &attribs[index], polygonTexels[index]);
     }
 
-    // Draw the translucent polygons
-    for (unsigned int i = 0; i < translucent.size(); i++)
-        drawPolygon(line, thread, translucent[i]);
-
     // Draw fog if enabled
-    if (disp3DCnt & BIT(7))
+    // The framebuffer doesn't hold alpha, so fog that only applies to alpha leaves it unchanged
+    if ((disp3DCnt & BIT(7)) && !(disp3DCnt & BIT(6)))
     {
         uint32_t fog = rgba5ToRgba6(((fogColor & 0x001F0000) >> 1) | (fogColor & 0x00007FFF));
-        int fogStep = 0x400 >> ((disp3DCnt & 0x0F00) >> 8);
 
+        // Look up the fog density for each pixel's depth
+        // Pixels without the fog bit get a density of 0, which blends them back to themselves
+        __attribute__((aligned(16))) uint16_t densities[256];
         for (int i = 0; i < 256; i++)
         {
             if (attribBuffer[thread][i] & BIT(7)) // Fog bit
             {
-                // Determine the fog table index for the current pixel's depth
-                int32_t offset = ((depthBuffer[thread][i] / 0x200) - fogOffset);
-                int n = (fogStep > 0) ? (offset / fogStep) : ((offset > 0) ? 31 : 0);
-
-                // Get the fog density from the table
-                uint8_t density;
-                if (n >= 31) // Maximum
-                {
-                    density = fogTable[31];
-                }
-                else if (n < 0 || fogStep == 0) // Minimum
-                {
-                    density = fogTable[0];
-                }
-                else // Linear interpolation
-                {
-                    int m = offset % fogStep;
-                    density = ((m >= 0) ? ((fogTable[n + 1] * m + fogTable[n] * (fogStep - m)) / fogStep) : fogTable[0]);
-                }
-
-                // Blend the fog with the pixel
-                uint16_t *pixel = &framebuffer[line * 256 + i];
-                uint8_t a = (((fog >> 18) & 0x3F) * density + ((*pixel >> 18) & 0x3F) * (128 - density)) / 128;
-                if (disp3DCnt & BIT(6)) // Only alpha
-                {
-                    *pixel = (*pixel & ~(0x3F << 18)) | (a << 18);
-                }
-                else
-                {
-                    uint8_t r = (((fog >>  0) & 0x3F) * density + ((*pixel >>  0) & 0x3F) * (128 - density)) / 128;
-                    uint8_t g = (((fog >>  6) & 0x3F) * density + ((*pixel >>  6) & 0x3F) * (128 - density)) / 128;
-                    uint8_t b = (((fog >> 12) & 0x3F) * density + ((*pixel >> 12) & 0x3F) * (128 - density)) / 128;
-                    *pixel = BIT(26) | (a << 18) | (b << 12) | (g << 6) | r;
-                }
+                int32_t offset = (int32_t)(depthBuffer[thread][i] >> 9) - fogOffset;
+                densities[i] = fogDensities[(offset < 0) ? 0 : ((offset > fogLimit) ? fogLimit : offset)];
+            }
+            else
+            {
+                densities[i] = 0;
             }
         }
+
+        applyFog(&framebuffer[line * 256], densities, fog);
     }
 }
 
 uint8_t *Gpu3DRenderer::getTexture(uint32_t address)
 {
     // Get a pointer to texture data
-    uint8_t *slot = core->memory.getTex3D()[address >> 17];
+    uint8_t *slot = texSlots[(address >> 17) & 3];
     return slot ? &slot[address & 0x1FFFF] : nullptr;
 }
 
 uint8_t *Gpu3DRenderer::getPalette(uint32_t address)
 {
     // Get a pointer to palette data
-    uint8_t *slot = core->memory.getPal3D()[address >> 14];
+    uint8_t *slot = ((address >> 14) < 6) ? palSlots[address >> 14] : nullptr;
     return slot ? &slot[address & 0x3FFF] : nullptr;
 }
 
@@ -177,14 +349,41 @@ uint32_t Gpu3DRenderer::interpolateLinear(uint32_t v1, uint32_t v2, uint32_t x1,
         return v2 + (v1 - v2) * (x2 - x) / (x2 - x1);
 }
 
-uint32_t Gpu3DRenderer::interpolateFill(uint32_t v1, uint32_t v2, uint32_t x1, uint32_t x, uint32_t x2, uint32_t w1, uint32_t w2)
+void Divider::setup(uint32_t divisor)
 {
-    // Fall back to linear interpolation if the W values are equal and their lower bits are clear
-    if (w1 == w2 && !(w1 & 0x007F))
-        return interpolateLinear(v1, v2, x1, x, x2);
+    // Find a multiplier and shifts that divide by the value, as described in "Division by Invariant Integers using Multiplication"
+    int bits = (divisor > 1) ? (32 - __builtin_clz(divisor - 1)) : 0;
+    multiplier = (((uint64_t)1 << 32) * (((uint64_t)1 << bits) - divisor)) / divisor + 1;
+    shift1 = (bits > 0) ? 1 : 0;
+    shift2 = (bits > 0) ? (bits - 1) : 0;
+}
 
-    // Calculate the interpolation factor with a precision of 8 bits for polygon fills
-    uint32_t factor = ((w1 * (x - x1)) << 8) / (w2 * (x2 - x) + w1 * (x - x1));
+uint32_t Gpu3DRenderer::divideSmall(uint32_t a, uint32_t b)
+{
+    // Estimate the quotient using the reciprocal of the divisor's top 9 bits
+    // The estimate is close when the quotient is small, and the remainder is used to correct it
+    // This expects the remainder of the estimate to fit in 32 bits, which holds for quotients of up to 9 bits
+    // A divisor of 0 comes from spans whose W values are both 0, which are given a factor of 0 instead of never settling
+    if (b == 0) return 0;
+    int shift = (b >= 512) ? (23 - __builtin_clz(b)) : 0;
+    uint32_t q = ((uint64_t)a * reciprocals[b >> shift]) >> (32 + shift);
+    int32_t r = a - q * b;
+    while (r < 0)           { q--; r += b; }
+    while (r >= (int32_t)b) { q++; r -= b; }
+    return q;
+}
+
+uint32_t Gpu3DRenderer::interpolateFill(uint32_t v1, uint32_t v2, uint32_t x1, uint32_t x, uint32_t x2, uint32_t factor, const Divider &span)
+{
+    // Interpolate linearly if there's no factor, which is the case when the span's W values are equal and their lower bits are clear
+    // The division by the span width is done with a multiply
+    if (factor == (uint32_t)-1)
+    {
+        if (v1 <= v2)
+            return v1 + span.divide((v2 - v1) * (x - x1));
+        else
+            return v2 + span.divide((v1 - v2) * (x2 - x));
+    }
 
     // Interpolate a new value between the min and max values
     if (v1 <= v2)
@@ -225,67 +424,163 @@ uint32_t Gpu3DRenderer::interpolateColor(uint32_t c1, uint32_t c2, uint32_t x1,
     return (a << 18) | (b << 12) | (g << 6) | r;
 }
 
-uint32_t Gpu3DRenderer::readTexture(_Polygon *polygon, int s, int t)
+const uint32_t *Gpu3DRenderer::getTexels(PolygonAttribs *attribs)
+{
+    // Find the VRAM pages the texture reads, with texture pages as bits 0-31 and palette pages as bits 32-37
+    // The texel data of 4x4 compressed textures comes with palette data stored in slot 1
+    static const int bits[8] = { 0, 8, 2, 4, 8, 2, 8, 16 };
+    // Textures are only 8-byte aligned, so the range is taken from both ends in case it crosses a page boundary
+    uint32_t size = attribs->sizeS * attribs->sizeT;
+    uint32_t bytes = size * bits[attribs->textureFmt] / 8;
+    uint64_t pages = 0;
+    for (uint32_t i = attribs->textureAddr >> 14; i <= (attribs->textureAddr + bytes - 1) >> 14; i++)
+        pages |= (uint64_t)1 << (i & 31);
+
+    switch (attribs->textureFmt)
+    {
+        case 5: // 4x4 compressed
+        {
+            uint32_t address = 0x20000 + (attribs->textureAddr % 0x20000) / 2 + ((attribs->textureAddr / 0x20000 == 2) ? 0x10000 : 0);
+            for (uint32_t i = address >> 14; i <= (address + size / 8 - 1) >> 14; i++)
+                pages |= (uint64_t)1 << (i & 31);
+            pages |= (uint64_t)0x3F << 32;
+            break;
+        }
+
+        case 1: case 2: case 3: case 4: case 6: // Paletted
+        {
+            static const int colors[8] = { 0, 32, 4, 16, 256, 0, 8, 0 };
+            uint32_t end = attribs->paletteAddr + colors[attribs->textureFmt] * 2 - 1;
+            for (uint32_t i = attribs->paletteAddr >> 14; i <= end >> 14 && i < 6; i++)
+                pages |= (uint64_t)1 << (32 + i);
+            break;
+        }
+    }
+
+    // Look up the texture in the cache, and check that nothing it reads has changed
+    // A texture can be in one of a few entries after the one its parameters hash to
+    uint32_t index = (attribs->textureAddr * 7 + attribs->paletteAddr * 13 + attribs->textureFmt * 31 + size) % 256;
+    TextureEntry *entry = nullptr;
+    for (int i = 0; i < 4; i++)
+    {
+        TextureEntry *current = &textureCache[(index + i) % 256];
+        if (current->texels.size() == size && current->textureAddr == attribs->textureAddr && current->paletteAddr == attribs->paletteAddr &&
+            current->sizeS == attribs->sizeS && current->format == attribs->textureFmt && current->transparent0 == attribs->transparent0 &&
+            current->slotEpoch == slotEpoch && current->pages == pages)
+        {
+            bool changed = false;
+            for (uint64_t mask = pages; mask && !changed; mask &= mask - 1)
+            {
+                int j = __builtin_ctzll(mask);
+                changed = (current->versions[j] != pageVersions[j]);
+            }
+
+            if (!changed)
+            {
+                current->frame = frame;
+                return &current->texels[0];
+            }
+        }
+
+        // Entries used by other polygons this frame can't be replaced
+        if (!entry && current->frame != frame)
+            entry = current;
+    }
+
+    // Fall back to decoding texels as they're read if the texture can't be cached
+    // The cache is cleared at the start of a frame once it grows too large
+    if (!entry || size > TEXTURE_CACHE_LIMIT / 4 || cachedTexels - entry->texels.size() + size > TEXTURE_CACHE_LIMIT)
+        return nullptr;
+
+    // Decode the whole texture into the cache entry
+    cachedTexels += size - entry->texels.size();
+    entry->texels.resize(size);
+    for (int t = 0; t < attribs->sizeT; t++)
+        for (int s = 0; s < attribs->sizeS; s++)
+            entry->texels[t * attribs->sizeS + s] = decodeTexel(attribs, s, t);
+
+    entry->textureAddr = attribs->textureAddr;
+    entry->paletteAddr = attribs->paletteAddr;
+    entry->sizeS = attribs->sizeS;
+    entry->format = attribs->textureFmt;
+    entry->transparent0 = attribs->transparent0;
+    entry->slotEpoch = slotEpoch;
+    entry->pages = pages;
+    memcpy(entry->versions, pageVersions, sizeof(pageVersions));
+    entry->frame = frame;
+    return &entry->texels[0];
+}
+
+uint32_t Gpu3DRenderer::readTexture(PolygonAttribs *attribs, const uint32_t *texels, int s, int t)
 {
     // Handle S-coordinate overflows
-    if (polygon->repeatS)
+    if (attribs->repeatS)
     {
         // Wrap the S-coordinate
         int count = 0;
-        while (s < 0)               { s += polygon->sizeS; count++; }
-        while (s >= polygon->sizeS) { s -= polygon->sizeS; count++; }
+        while (s < 0)               { s += attribs->sizeS; count++; }
+        while (s >= attribs->sizeS) { s -= attribs->sizeS; count++; }
 
         // Flip the S-coordinate every second repeat
-        if (polygon->flipS && count % 2 != 0)
-            s = polygon->sizeS - 1 - s;
+        if (attribs->flipS && count % 2 != 0)
+            s = attribs->sizeS - 1 - s;
     }
     else if (s < 0)
     {
         // Clamp the S-coordinate on the left
         s = 0;
     }
-    else if (s >= polygon->sizeS)
+    else if (s >= attribs->sizeS)
     {
         // Clamp the S-coordinate on the right
-        s = polygon->sizeS - 1;
+        s = attribs->sizeS - 1;
     }
 
     // Handle T-coordinate overflows
-    if (polygon->repeatT)
+    if (attribs->repeatT)
     {
         // Wrap the T-coordinate
         int count = 0;
-        while (t < 0)               { t += polygon->sizeT; count++; }
-        while (t >= polygon->sizeT) { t -= polygon->sizeT; count++; }
+        while (t < 0)               { t += attribs->sizeT; count++; }
+        while (t >= attribs->sizeT) { t -= attribs->sizeT; count++; }
 
         // Flip the T-coordinate every second repeat
-        if (polygon->flipT && count % 2 != 0)
-            t = polygon->sizeT - 1 - t;
+        if (attribs->flipT && count % 2 != 0)
+            t = attribs->sizeT - 1 - t;
     }
     else if (t < 0)
     {
         // Clamp the T-coordinate on the top
         t = 0;
     }
-    else if (t >= polygon->sizeT)
+    else if (t >= attribs->sizeT)
     {
         // Clamp the T-coordinate on the bottom
-        t = polygon->sizeT - 1;
+        t = attribs->sizeT - 1;
     }
 
+    // Read a texel from the decoded texture if there is one
+    if (texels)
+        return texels[t * attribs->sizeS + s];
+
+    return decodeTexel(attribs, s, t);
+}
+
+uint32_t Gpu3DRenderer::decodeTexel(PolygonAttribs *attribs, int s, int t)
+{
     // Decode a texel
-    switch (polygon->textureFmt)
+    switch (attribs->textureFmt)
     {
         case 1: // A3I5 translucent
         {
             // Get the 8-bit palette index
-            uint32_t address = polygon->textureAddr + (t * polygon->sizeS + s);
+            uint32_t address = attribs->textureAddr + (t * attribs->sizeS + s);
             uint8_t *data = getTexture(address);
             if (!data) return 0;
             uint8_t index = *data;
 
             // Get the palette
-            uint8_t *palette = getPalette(polygon->paletteAddr);
+            uint8_t *palette = getPalette(attribs->paletteAddr);
             if (!palette) return 0;
 
             // Return the palette color
@@ -297,17 +592,17 @@ uint32_t Gpu3DRenderer::readTexture(_Polygon *polygon, int s, int t)
         case 2: // 4-color palette
         {
             // Get the 2-bit palette index
-            uint32_t address = polygon->textureAddr + (t * polygon->sizeS + s) / 4;
+            uint32_t address = attribs->textureAddr + (t * attribs->sizeS + s) / 4;
             uint8_t *data = getTexture(address);
             if (!data) return 0;
             uint8_t index = (*data >> ((s % 4) * 2)) & 0x03;
 
             // Return a transparent pixel if enabled
-            if (polygon->transparent0 && index == 0)
+            if (attribs->transparent0 && index == 0)
                 return 0;
 
             // Get the palette
-            uint8_t *palette = getPalette(polygon->paletteAddr);
+            uint8_t *palette = getPalette(attribs->paletteAddr);
             if (!palette) return 0;
 
             // Return the palette color
@@ -317,17 +612,17 @@ uint32_t Gpu3DRenderer::readTexture(_Polygon *polygon, int s, int t)
         case 3: // 16-color palette
         {
             // Get the 4-bit palette index
-            uint32_t address = polygon->textureAddr + (t * polygon->sizeS + s) / 2;
+            uint32_t address = attribs->textureAddr + (t * attribs->sizeS + s) / 2;
             uint8_t *data = getTexture(address);
             if (!data) return 0;
             uint8_t index = (*data >> ((s % 2) * 4)) & 0x0F;
 
             // Return a transparent pixel if enabled
-            if (polygon->transparent0 && index == 0)
+            if (attribs->transparent0 && index == 0)
                 return 0;
 
             // Get the palette
-            uint8_t *palette = getPalette(polygon->paletteAddr);
+            uint8_t *palette = getPalette(attribs->paletteAddr);
             if (!palette) return 0;
 
             // Return the palette color
@@ -337,17 +632,17 @@ uint32_t Gpu3DRenderer::readTexture(_Polygon *polygon, int s, int t)
         case 4: // 256-color palette
         {
             // Get the 8-bit palette index
-            uint32_t address = polygon->textureAddr + (t * polygon->sizeS + s);
+            uint32_t address = attribs->textureAddr + (t * attribs->sizeS + s);
             uint8_t *data = getTexture(address);
             if (!data) return 0;
             uint8_t index = *data;
 
             // Return a transparent pixel if enabled
-            if (polygon->transparent0 && index == 0)
+            if (attribs->transparent0 && index == 0)
                 return 0;
 
             // Get the palette
-            uint8_t *palette = getPalette(polygon->paletteAddr);
+            uint8_t *palette = getPalette(attribs->paletteAddr);
             if (!palette) return 0;
 
             // Return the palette color
@@ -357,16 +652,16 @@ uint32_t Gpu3DRenderer::readTexture(_Polygon *polygon, int s, int t)
         case 5: // 4x4 compressed
         {
             // Get the 2-bit palette index
-            int tile = (t / 4) * (polygon->sizeS / 4) + (s / 4);
-            uint32_t address = polygon->textureAddr + (tile * 4 + t % 4);
+            int tile = (t / 4) * (attribs->sizeS / 4) + (s / 4);
+            uint32_t address = attribs->textureAddr + (tile * 4 + t % 4);
             uint8_t *data = getTexture(address);
             if (!data) return 0;
             uint8_t index = (*data >> ((s % 4) * 2)) & 0x03;
 
             // Get the palette, using the base for the tile stored in slot 1
-            address = 0x20000 + (polygon->textureAddr % 0x20000) / 2 + ((polygon->textureAddr / 0x20000 == 2) ? 0x10000 : 0);
+            address = 0x20000 + (attribs->textureAddr % 0x20000) / 2 + ((attribs->textureAddr / 0x20000 == 2) ? 0x10000 : 0);
             uint16_t palBase = U8TO16(getTexture(address), tile * 2);
-            uint8_t *palette = getPalette(polygon->paletteAddr + (palBase & 0x3FFF) * 4);
+            uint8_t *palette = getPalette(attribs->paletteAddr + (palBase & 0x3FFF) * 4);
             if (!palette) return 0;
 
             // Return the palette color or a transparent or interpolated color based on the mode
@@ -436,13 +731,13 @@ uint32_t Gpu3DRenderer::readTexture(_Polygon *polygon, int s, int t)
         case 6: // A5I3 translucent
         {
             // Get the 8-bit palette index
-            uint32_t address = polygon->textureAddr + (t * polygon->sizeS + s);
+            uint32_t address = attribs->textureAddr + (t * attribs->sizeS + s);
             uint8_t *data = getTexture(address);
             if (!data) return 0;
             uint8_t index = *data;
 
             // Get the palette
-            uint8_t *palette = getPalette(polygon->paletteAddr);
+            uint8_t *palette = getPalette(attribs->paletteAddr);
             if (!palette) return 0;
 
             // Return the palette color
@@ -454,41 +749,165 @@ uint32_t Gpu3DRenderer::readTexture(_Polygon *polygon, int s, int t)
         default: // Direct color
         {
             // Get the color data
-            uint8_t *data = getTexture(polygon->textureAddr);
+            uint8_t *data = getTexture(attribs->textureAddr);
             if (!data) return 0;
 
             // Return the direct color
-            uint16_t color = U8TO16(data, (t * polygon->sizeS + s) * 2);
+            uint16_t color = U8TO16(data, (t * attribs->sizeS + s) * 2);
             uint8_t alpha = (color & BIT(15)) ? 0x1F : 0;
             return rgba5ToRgba6((alpha << 15) | color);
         }
     }
 }
 
-void Gpu3DRenderer::drawPolygon(int line, int thread, _Polygon *polygon)
+void Gpu3DRenderer::setBits(uint32_t *bits, uint32_t start, uint32_t end)
+{
+    // Set the bits of a range in a bitmask, a word at a time
+    while (start < end)
+    {
+        uint32_t last = ((start | 31) < end - 1) ? (start | 31) : (end - 1);
+        bits[start >> 5] |= (0xFFFFFFFF << (start & 31)) & (0xFFFFFFFF >> (31 - (last & 31)));
+        start = last + 1;
+    }
+}
+
+void Gpu3DRenderer::testDepth(const uint32_t *depths, const uint32_t *buffer, uint32_t margin, uint32_t *passes, uint32_t start, uint32_t end)
+{
+    // Set the bits of pixels that are in front of the depth buffer, or within the margin of it
+    // Depth values are 24-bit, so signed comparisons work as well as unsigned ones
+    // The SIMD loops start on a multiple of 4, so they can set bits before the start that have to be masked out by the caller
+    uint32_t x = start;
+
+#if defined(__SSE2__) && !defined(GPU3D_SCALAR)
+    // Test 4 pixels at a time, gathering the results into bits
+    __m128i add = _mm_set1_epi32(margin);
+    for (x = start & ~3; x + 4 <= end; x += 4)
+    {
+        __m128i pass = _mm_cmpgt_epi32(_mm_add_epi32(_mm_loadu_si128((__m128i*)&buffer[x]), add), _mm_load_si128((__m128i*)&depths[x]));
+        passes[x >> 5] |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(pass)) << (x & 31);
+    }
+#elif defined(__ARM_NEON) && !defined(GPU3D_SCALAR)
+    // Test 4 pixels at a time, gathering the results into bits
+    static const uint32_t weights[] = { 1, 2, 4, 8 };
+    uint32x4_t add = vdupq_n_u32(margin), weight = vld1q_u32(weights);
+    for (x = start & ~3; x + 4 <= end; x += 4)
+    {
+        uint32x4_t pass = vandq_u32(vcgtq_u32(vaddq_u32(vld1q_u32(&buffer[x]), add), vld1q_u32(&depths[x])), weight);
+        uint32x2_t sum = vpadd_u32(vget_low_u32(pass), vget_high_u32(pass));
+        passes[x >> 5] |= vget_lane_u32(vpadd_u32(sum, sum), 0) << (x & 31);
+    }
+#endif
+
+    // Test the remaining pixels one at a time
+    for (; x < end; x++)
+    {
+        if (buffer[x] + margin > depths[x])
+            passes[x >> 5] |= BIT(x & 31);
+    }
+}
+
+void Gpu3DRenderer::applyFog(uint16_t *pixels, const uint16_t *densities, uint32_t fog)
+{
+    // Blend the fog color with a scanline of pixels, using a density out of 128 for each
+    // Channels are at most 63, so the blends fit in 16 bits; blue only keeps the 4 bits that fit in a pixel
+    int x = 0;
+
+#if defined(__SSE2__) && !defined(GPU3D_SCALAR)
+    // Blend 8 pixels at a time
+    __m128i mask = _mm_set1_epi16(0x3F), full = _mm_set1_epi16(128);
+    __m128i fr = _mm_set1_epi16((fog >> 0) & 0x3F), fg = _mm_set1_epi16((fog >> 6) & 0x3F), fb = _mm_set1_epi16((fog >> 12) & 0x3F);
+    for (; x < 256; x += 8)
+    {
+        __m128i p = _mm_loadu_si128((__m128i*)&pixels[x]);
+        __m128i d = _mm_load_si128((__m128i*)&densities[x]), e = _mm_sub_epi16(full, d);
+        __m128i r = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(fr, d), _mm_mullo_epi16(_mm_and_si128(p, mask), e)), 7);
+        __m128i g = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(fg, d), _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(p, 6), mask), e)), 7);
+        __m128i b = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(fb, d), _mm_mullo_epi16(_mm_srli_epi16(p, 12), e)), 7);
+        _mm_storeu_si128((__m128i*)&pixels[x], _mm_or_si128(_mm_or_si128(r, _mm_slli_epi16(g, 6)), _mm_slli_epi16(b, 12)));
+    }
+#elif defined(__ARM_NEON) && !defined(GPU3D_SCALAR)
+    // Blend 8 pixels at a time
+    uint16x8_t mask = vdupq_n_u16(0x3F), full = vdupq_n_u16(128);
+    uint16x8_t fr = vdupq_n_u16((fog >> 0) & 0x3F), fg = vdupq_n_u16((fog >> 6) & 0x3F), fb = vdupq_n_u16((fog >> 12) & 0x3F);
+    for (; x < 256; x += 8)
+    {
+        uint16x8_t p = vld1q_u16(&pixels[x]);
+        uint16x8_t d = vld1q_u16(&densities[x]), e = vsubq_u16(full, d);
+        uint16x8_t r = vshrq_n_u16(vmlaq_u16(vmulq_u16(fr, d), vandq_u16(p, mask), e), 7);
+        uint16x8_t g = vshrq_n_u16(vmlaq_u16(vmulq_u16(fg, d), vandq_u16(vshrq_n_u16(p, 6), mask), e), 7);
+        uint16x8_t b = vshrq_n_u16(vmlaq_u16(vmulq_u16(fb, d), vshrq_n_u16(p, 12), e), 7);
+        vst1q_u16(&pixels[x], vorrq_u16(vorrq_u16(r, vshlq_n_u16(g, 6)), vshlq_n_u16(b, 12)));
+    }
+#endif
+
+    // Blend the remaining pixels one at a time, skipping the ones without fog
+    for (; x < 256; x++)
+    {
+        uint32_t d = densities[x];
+        if (d == 0) continue;
+
+        uint16_t p = pixels[x];
+        uint8_t r = (((fog >>  0) & 0x3F) * d + ((p >>  0) & 0x3F) * (128 - d)) / 128;
+        uint8_t g = (((fog >>  6) & 0x3F) * d + ((p >>  6) & 0x3F) * (128 - d)) / 128;
+        uint8_t b = (((fog >> 12) & 0x3F) * d + ((p >> 12) & 0x3F) * (128 - d)) / 128;
+        pixels[x] = (b << 12) | (g << 6) | r;
+    }
+}
+
+void Gpu3DRenderer::updateFogDensities()
+{
+    // Work out the fog density for every depth offset from the fog offset
+    // The density stops changing at the last table entry, so offsets are clamped to where that's reached
+    int fogStep = 0x400 >> ((disp3DCnt & 0x0F00) >> 8);
+    fogLimit = (fogStep > 0) ? (fogStep * 31) : 1;
+
+    for (int offset = 0; offset <= fogLimit; offset++)
+    {
+        int n = (fogStep > 0) ? (offset / fogStep) : ((offset > 0) ? 31 : 0);
+
+        if (n >= 31) // Maximum
+        {
+            fogDensities[offset] = fogTable[31];
+        }
+        else if (fogStep == 0) // Minimum
+        {
+            fogDensities[offset] = fogTable[0];
+        }
+        else // Linear interpolation
+        {
+            int m = offset % fogStep;
+            fogDensities[offset] = (fogTable[n + 1] * m + fogTable[n] * (fogStep - m)) / fogStep;
+        }
+    }
+
+    fogDirty = false;
+}
+
+void Gpu3DRenderer::drawPolygon(int line, int thread, _Polygon *polygon, PolygonAttribs *attribs, const uint32_t *texels)
 {
-    // Get the polygon vertices
-    Vertex *vertices[10];
+    // Get the polygon vertices, as indices into the vertex list
+    const VertexList *list = core->gpu3D.getVertices();
+    int vertices[10];
     for (int i = 0; i < polygon->size; i++)
-        vertices[i] = &polygon->vertices[i];
+        vertices[i] = polygon->vertex + i;
 
     // Unclipped quad strip polygons have their vertices crossed, so uncross them
     if (polygon->crossed)
         SWAP(vertices[2], vertices[3]);
 
-    Vertex *vCur[4];
+    int vCur[4];
     int countCur = 0;
 
     // Find the polygon edges that intersect with the current line
     for (int i = 0; i < polygon->size && countCur < 4; i++)
     {
-        Vertex *current = vertices[i];
-        Vertex *previous = vertices[(i - 1 + polygon->size) % polygon->size];
+        int current = vertices[i];
+        int previous = vertices[(i - 1 + polygon->size) % polygon->size];
 
-        if (current->y > previous->y)
+        if (list->y[current] > list->y[previous])
             SWAP(current, previous);
 
-        if (previous->y > line && current->y <= line)
+        if (list->y[previous] > line && list->y[current] <= line)
         {
             vCur[countCur++] = current;
             vCur[countCur++] = previous;
@@ -499,8 +918,8 @@ void Gpu3DRenderer::drawPolygon(int line, int thread, _Polygon *polygon)
     if (countCur < 4) return;
 
     // Calculate the X bounds of the polygon on the current line
-    uint32_t x1 = interpolateLinear(vCur[0]->x, vCur[1]->x, vCur[0]->y, line, vCur[1]->y);
-    uint32_t x2 = interpolateLinear(vCur[2]->x, vCur[3]->x, vCur[2]->y, line, vCur[3]->y);
+    uint32_t x1 = interpolateLinear(list->x[vCur[0]], list->x[vCur[1]], list->y[vCur[0]], line, list->y[vCur[1]]);
+    uint32_t x2 = interpolateLinear(list->x[vCur[2]], list->x[vCur[3]], list->y[vCur[2]], line, list->y[vCur[3]]);
 
     // Swap the bounds if the first one is on the right
     if (x1 > x2)
@@ -514,28 +933,28 @@ void Gpu3DRenderer::drawPolygon(int line, int thread, _Polygon *polygon)
 
     // Polygons with an alpha value of 0 are rendered as opaque wireframe polygons
     // In this case, calculate the X bounds of the polygon interior so it can be skipped during rendering
-    if (polygon->alpha == 0)
+    if (attribs->alpha == 0)
     {
-        Vertex *vTop[4], *vBot[4];
+        int vTop[4], vBot[4];
         int countTop = 0, countBot = 0;
 
         // Find the polygon edges that intersect with the above and below lines
         // If either line doesn't intersect, the current line is along an edge and can be drawn normally
         for (int i = 0; i < polygon->size && (countTop < 4 || countBot < 4); i++)
         {
-            Vertex *current = vertices[i];
-            Vertex *previous = vertices[(i - 1 + polygon->size) % polygon->size];
+            int current = vertices[i];
+            int previous = vertices[(i - 1 + polygon->size) % polygon->size];
 
-            if (current->y > previous->y)
+            if (list->y[current] > list->y[previous])
                 SWAP(current, previous);
 
-            if (previous->y > line - 1 && current->y <= line - 1)
+            if (countTop < 4 && list->y[previous] > line - 1 && list->y[current] <= line - 1)
             {
                 vTop[countTop++] = current;
                 vTop[countTop++] = previous;
             }
 
-            if (previous->y > line + 1 && current->y <= line + 1)
+            if (countBot < 4 && list->y[previous] > line + 1 && list->y[current] <= line + 1)
             {
                 vBot[countBot++] = current;
                 vBot[countBot++] = previous;
@@ -545,10 +964,10 @@ void Gpu3DRenderer::drawPolygon(int line, int thread, _Polygon *polygon)
         if (countTop >= 4 && countBot >= 4) // Both lines intersect
         {
             // Calculate the X bounds of the polygon on the above and below lines
-            uint32_t xa = interpolateLinear(vTop[0]->x, vTop[1]->x, vTop[0]->y, line - 1, vTop[1]->y);
-            uint32_t xb = interpolateLinear(vTop[2]->x, vTop[3]->x, vTop[2]->y, line - 1, vTop[3]->y);
-            uint32_t xc = interpolateLinear(vBot[0]->x, vBot[1]->x, vBot[0]->y, line + 1, vBot[1]->y);
-            uint32_t xd = interpolateLinear(vBot[2]->x, vBot[3]->x, vBot[2]->y, line + 1, vBot[3]->y);
+            uint32_t xa = interpolateLinear(list->x[vTop[0]], list->x[vTop[1]], list->y[vTop[0]], line - 1, list->y[vTop[1]]);
+            uint32_t xb = interpolateLinear(list->x[vTop[2]], list->x[vTop[3]], list->y[vTop[2]], line - 1, list->y[vTop[3]]);
+            uint32_t xc = interpolateLinear(list->x[vBot[0]], list->x[vBot[1]], list->y[vBot[0]], line + 1, list->y[vBot[1]]);
+            uint32_t xd = interpolateLinear(list->x[vBot[2]], list->x[vBot[3]], list->y[vBot[2]], line + 1, list->y[vBot[3]]);
 
             // Swap the bounds if the first one is on the right
             if (xa > xb) SWAP(xa, xb);
@@ -572,12 +991,12 @@ void Gpu3DRenderer::drawPolygon(int line, int thread, _Polygon *polygon)
     if (polygon->wShift >= 0)
     {
         for (int i = 0; i < 4; i++)
-            vw[i] = vCur[i]->w >> polygon->wShift;
+            vw[i] = list->w[vCur[i]] >> polygon->wShift;
     }
     else
     {
         for (int i = 0; i < 4; i++)
-            vw[i] = vCur[i]->w << -polygon->wShift;
+            vw[i] = list->w[vCur[i]] << -polygon->wShift;
     }
 
     int e[4];
@@ -585,52 +1004,52 @@ void Gpu3DRenderer::drawPolygon(int line, int thread, _Polygon *polygon)
     uint32_t rx1, rx, rx2;
 
     // Choose between X and Y coordinates for edge interpolation on the left side (whichever is more precise)
-    if (abs(vCur[1]->x - vCur[0]->x) > vCur[1]->y - vCur[0]->y)
+    if (abs(list->x[vCur[1]] - list->x[vCur[0]]) > list->y[vCur[1]] - list->y[vCur[0]])
     {
         // Reorder the vertices so the greater X coordinate comes last
-        const bool greater = (vCur[1]->x > vCur[0]->x);
+        const bool greater = (list->x[vCur[1]] > list->x[vCur[0]]);
         e[0] = !greater;
         e[1] =  greater;
 
-        lx1 = vCur[e[0]]->x;
+        lx1 = list->x[vCur[e[0]]];
         lx = x1;
-        lx2 = vCur[e[1]]->x;
+        lx2 = list->x[vCur[e[1]]];
     }
     else
     {
         e[0] = 0;
         e[1] = 1;
 
-        lx1 = vCur[0]->y;
+        lx1 = list->y[vCur[0]];
         lx = line;
-        lx2 = vCur[1]->y;
+        lx2 = list->y[vCur[1]];
     }
 
     // Choose between X and Y coordinates for edge interpolation on the right side (whichever is more precise)
-    if (abs(vCur[3]->x - vCur[2]->x) > vCur[3]->y - vCur[2]->y)
+    if (abs(list->x[vCur[3]] - list->x[vCur[2]]) > list->y[vCur[3]] - list->y[vCur[2]])
     {
         // Reorder the vertices so the greater X coordinate comes last
-        const bool greater = (vCur[3]->x > vCur[2]->x);
+        const bool greater = (list->x[vCur[3]] > list->x[vCur[2]]);
         e[2] = 2 + !greater;
         e[3] = 2 +  greater;
 
-        rx1 = vCur[e[2]]->x;
+        rx1 = list->x[vCur[e[2]]];
         rx = x2;
-        rx2 = vCur[e[3]]->x;
+        rx2 = list->x[vCur[e[3]]];
     }
     else
     {
         e[2] = 2;
         e[3] = 3;
 
-        rx1 = vCur[2]->y;
+        rx1 = list->y[vCur[2]];
         rx = line;
-        rx2 = vCur[3]->y;
+        rx2 = list->y[vCur[3]];
     }
 
     // Calculate the Z values of the polygon edges on the current line
-    uint32_t z1 = interpolateLinear(vCur[e[0]]->z, vCur[e[1]]->z, lx1, lx, lx2);
-    uint32_t z2 = interpolateLinear(vCur[e[2]]->z, vCur[e[3]]->z, rx1, rx, rx2);
+    uint32_t z1 = interpolateLinear(list->z[vCur[e[0]]], list->z[vCur[e[1]]], lx1, lx, lx2);
+    uint32_t z2 = interpolateLinear(list->z[vCur[e[2]]], list->z[vCur[e[3]]], rx1, rx, rx2);
 
     // Calculate the W values of the polygon edges on the current line
     uint32_t w1 = interpolateEdge(vw[e[0]], vw[e[1]], lx1, lx, lx2, vw[e[0]], vw[e[1]]);
@@ -638,22 +1057,22 @@ void Gpu3DRenderer::drawPolygon(int line, int thread, _Polygon *polygon)
 
     // Interpolate the vertex color of the polygon edges on the current line
     // The color values are expanded to 9 bits during interpolation for extra precision
-    uint32_t r1 = interpolateEdge(((vCur[e[0]]->color >>  0) & 0x3F) << 3, ((vCur[e[1]]->color >>  0) & 0x3F) << 3, lx1, lx, lx2, vw[e[0]], vw[e[1]]);
-    uint32_t g1 = interpolateEdge(((vCur[e[0]]->color >>  6) & 0x3F) << 3, ((vCur[e[1]]->color >>  6) & 0x3F) << 3, lx1, lx, lx2, vw[e[0]], vw[e[1]]);
-    uint32_t b1 = interpolateEdge(((vCur[e[0]]->color >> 12) & 0x3F) << 3, ((vCur[e[1]]->color >> 12) & 0x3F) << 3, lx1, lx, lx2, vw[e[0]], vw[e[1]]);
-    uint32_t r2 = interpolateEdge(((vCur[e[2]]->color >>  0) & 0x3F) << 3, ((vCur[e[3]]->color >>  0) & 0x3F) << 3, rx1, rx, rx2, vw[e[2]], vw[e[3]]);
-    uint32_t g2 = interpolateEdge(((vCur[e[2]]->color >>  6) & 0x3F) << 3, ((vCur[e[3]]->color >>  6) & 0x3F) << 3, rx1, rx, rx2, vw[e[2]], vw[e[3]]);
-    uint32_t b2 = interpolateEdge(((vCur[e[2]]->color >> 12) & 0x3F) << 3, ((vCur[e[3]]->color >> 12) & 0x3F) << 3, rx1, rx, rx2, vw[e[2]], vw[e[3]]);
+    uint32_t r1 = interpolateEdge(((list->color[vCur[e[0]]] >>  0) & 0x3F) << 3, ((list->color[vCur[e[1]]] >>  0) & 0x3F) << 3, lx1, lx, lx2, vw[e[0]], vw[e[1]]);
+    uint32_t g1 = interpolateEdge(((list->color[vCur[e[0]]] >>  6) & 0x3F) << 3, ((list->color[vCur[e[1]]] >>  6) & 0x3F) << 3, lx1, lx, lx2, vw[e[0]], vw[e[1]]);
+    uint32_t b1 = interpolateEdge(((list->color[vCur[e[0]]] >> 12) & 0x3F) << 3, ((list->color[vCur[e[1]]] >> 12) & 0x3F) << 3, lx1, lx, lx2, vw[e[0]], vw[e[1]]);
+    uint32_t r2 = interpolateEdge(((list->color[vCur[e[2]]] >>  0) & 0x3F) << 3, ((list->color[vCur[e[3]]] >>  0) & 0x3F) << 3, rx1, rx, rx2, vw[e[2]], vw[e[3]]);
+    uint32_t g2 = interpolateEdge(((list->color[vCur[e[2]]] >>  6) & 0x3F) << 3, ((list->color[vCur[e[3]]] >>  6) & 0x3F) << 3, rx1, rx, rx2, vw[e[2]], vw[e[3]]);
+    uint32_t b2 = interpolateEdge(((list->color[vCur[e[2]]] >> 12) & 0x3F) << 3, ((list->color[vCur[e[3]]] >> 12) & 0x3F) << 3, rx1, rx, rx2, vw[e[2]], vw[e[3]]);
 
     // Interpolate the texture coordinates of the polygon edges on the current line
     // Interpolation is unsigned, so temporarily convert the signed values to unsigned
-    int s1 = interpolateEdge((int32_t)vCur[e[0]]->s + 0xFFFF, (int32_t)vCur[e[1]]->s + 0xFFFF, lx1, lx, lx2, vw[e[0]], vw[e[1]]) - 0xFFFF;
-    int s2 = interpolateEdge((int32_t)vCur[e[2]]->s + 0xFFFF, (int32_t)vCur[e[3]]->s + 0xFFFF, rx1, rx, rx2, vw[e[2]], vw[e[3]]) - 0xFFFF;
-    int t1 = interpolateEdge((int32_t)vCur[e[0]]->t + 0xFFFF, (int32_t)vCur[e[1]]->t + 0xFFFF, lx1, lx, lx2, vw[e[0]], vw[e[1]]) - 0xFFFF;
-    int t2 = interpolateEdge((int32_t)vCur[e[2]]->t + 0xFFFF, (int32_t)vCur[e[3]]->t + 0xFFFF, rx1, rx, rx2, vw[e[2]], vw[e[3]]) - 0xFFFF;
+    int s1 = interpolateEdge((int32_t)list->s[vCur[e[0]]] + 0xFFFF, (int32_t)list->s[vCur[e[1]]] + 0xFFFF, lx1, lx, lx2, vw[e[0]], vw[e[1]]) - 0xFFFF;
+    int s2 = interpolateEdge((int32_t)list->s[vCur[e[2]]] + 0xFFFF, (int32_t)list->s[vCur[e[3]]] + 0xFFFF, rx1, rx, rx2, vw[e[2]], vw[e[3]]) - 0xFFFF;
+    int t1 = interpolateEdge((int32_t)list->t[vCur[e[0]]] + 0xFFFF, (int32_t)list->t[vCur[e[1]]] + 0xFFFF, lx1, lx, lx2, vw[e[0]], vw[e[1]]) - 0xFFFF;
+    int t2 = interpolateEdge((int32_t)list->t[vCur[e[2]]] + 0xFFFF, (int32_t)list->t[vCur[e[3]]] + 0xFFFF, rx1, rx, rx2, vw[e[2]], vw[e[3]]) - 0xFFFF;
 
     // Keep track of shadow mask polygons
-    if (polygon->mode == 3 && polygon->id == 0) // Shadow mask polygon
+    if (attribs->mode == 3 && attribs->id == 0) // Shadow mask polygon
     {
         // Clear the stencil buffer at the start of a shadow mask polygon group
         if (!stencilClear[thread])
@@ -668,58 +1087,111 @@ void Gpu3DRenderer::drawPolygon(int line, int thread, _Polygon *polygon)
         stencilClear[thread] = false;
     }
 
-    // Draw a line segment
-    for (uint32_t x = x1; x < x2; x++)
+    // Get the division by the span width, so pixels can be interpolated without dividing
+    // X coordinates are 9-bit, so there's one for every possible width
+    const Divider &span = dividers[(x2 - x1) & 0x1FF];
+    bool linear = (w1 == w2 && !(w1 & 0x007F));
+
+    // Invalid viewports can cause out-of-bounds vertices, so only draw within bounds
+    uint32_t end = (x2 < 256) ? x2 : 256;
+    if (x1 >= end) return;
+
+    // Mark the pixels of the span to draw, leaving out the polygon interior for wireframe polygons
+    // The interior can extend past the screen like the span does, so it's clamped the same way
+    uint32_t pixels[8] = {}, interior[8] = {};
+    setBits(pixels, x1, end);
+    if (x4 > end) x4 = end;
+    if (x3 < x4)
     {
-        // Skip the polygon interior for wireframe polygons
-        if (x3 < x4 && x == x3) x = x4;
-
-        // Invalid viewports can cause out-of-bounds vertices, so only draw within bounds
-        if (x >= 256) break;
+        setBits(interior, x3, x4);
+        for (int i = 0; i < 8; i++)
+            pixels[i] &= ~interior[i];
+    }
 
-        // Calculate the depth value of the current pixel
-        uint32_t depth;
-        if (polygon->wBuffer)
+    // Calculate the depth values of the span up front
+    // With W-buffering, this needs the perspective-correct interpolation factor with a precision of 8 bits for polygon fills
+    // If the W values are equal and their lower bits are clear, linear interpolation is used instead
+    __attribute__((aligned(16))) uint32_t depths[256];
+    uint32_t factors[256];
+    if (attribs->wBuffer)
+    {
+        for (uint32_t x = x1; x < end; x++)
         {
-            depth = interpolateFill(w1, w2, x1, x, x2, w1, w2);
+            factors[x] = linear ? -1 : divideSmall((w1 * (x - x1)) << 8, w2 * (x2 - x) + w1 * (x - x1));
+            uint32_t depth = interpolateFill(w1, w2, x1, x, x2, factors[x], span);
             if (polygon->wShift > 0)
                 depth <<= polygon->wShift;
             else if (polygon->wShift < 0)
                 depth >>= -polygon->wShift;
-            depth &= 0xFFFFFF;
+            depths[x] = depth & 0xFFFFFF;
         }
-        else
+    }
+    else if (z1 <= z2)
+    {
+        for (uint32_t x = x1; x < end; x++)
+            depths[x] = z1 + span.divide((z2 - z1) * (x - x1));
+    }
+    else
+    {
+        for (uint32_t x = x1; x < end; x++)
+            depths[x] = z2 + span.divide((z1 - z2) * (x2 - x));
+    }
+
+    // Test the whole span against the depth buffer, so only pixels that pass are visited below
+    // The polygon can optionally use an "equal" depth test, which has a margin of 0x200
+    uint32_t passes[8] = {};
+    testDepth(depths, depthBuffer[thread], attribs->depthTestEqual ? 0x201 : 0, passes, x1, end);
+
+    // Set a stencil buffer bit for shadow mask pixels that fail the depth test
+    // Shadow mask pixels that pass aren't drawn, so there's nothing else to do for them
+    if (attribs->mode == 3 && attribs->id == 0)
+    {
+        for (uint32_t i = x1 >> 5; i <= (end - 1) >> 5; i++)
         {
-            depth = interpolateLinear(z1, z2, x1, x, x2);
+            for (uint32_t bits = pixels[i] & ~passes[i]; bits; bits &= bits - 1)
+                stencilBuffer[thread][(i << 5) + __builtin_ctz(bits)] = 1;
         }
+        return;
+    }
 
-        // Draw a new pixel if the old one is behind the new one
-        // The polygon can optionally use an "equal" depth test, which has a margin of 0x200
-        if ((polygon->depthTestEqual && depthBuffer[thread][x] + 0x200 >= depth) || depthBuffer[thread][x] > depth)
+    // Draw a line segment, visiting the pixels that passed the depth test in order
+    for (uint32_t i = x1 >> 5; i <= (end - 1) >> 5; i++)
+    {
+        for (uint32_t bits = pixels[i] & passes[i]; bits; bits &= bits - 1)
         {
-            // Only render non-mask shadow polygons if the stencil bit is set and the old pixel's polygon ID differs
-            if (polygon->mode == 3 && (polygon->id == 0 || !stencilBuffer[thread][x] || (attribBuffer[thread][x] & 0x3F) == polygon->id))
+            uint32_t x = (i << 5) + __builtin_ctz(bits);
+            uint32_t depth = depths[x];
+
+            // Only render shadow polygons if the stencil bit is set and the old pixel's polygon ID differs
+            if (attribs->mode == 3 && (!stencilBuffer[thread][x] || (attribBuffer[thread][x] & 0x3F) == attribs->id))
                 continue;
 
+            // The factor isn't needed for Z-buffered depth, so it's only calculated for pixels that pass the depth test
+            uint32_t factor = -1;
+            if (attribs->wBuffer)
+                factor = factors[x];
+            else if (!linear)
+                factor = divideSmall((w1 * (x - x1)) << 8, w2 * (x2 - x) + w1 * (x - x1));
+
             // Interpolate the vertex color at the current pixel
-            uint32_t r = interpolateFill(r1, r2, x1, x, x2, w1, w2) >> 3;
-            uint32_t g = interpolateFill(g1, g2, x1, x, x2, w1, w2) >> 3;
-            uint32_t b = interpolateFill(b1, b2, x1, x, x2, w1, w2) >> 3;
-            uint32_t color = ((polygon->alpha ? polygon->alpha : 0x3F) << 18) | (b << 12) | (g << 6) | r;
+            uint32_t r = interpolateFill(r1, r2, x1, x, x2, factor, span) >> 3;
+            uint32_t g = interpolateFill(g1, g2, x1, x, x2, factor, span) >> 3;
+            uint32_t b = interpolateFill(b1, b2, x1, x, x2, factor, span) >> 3;
+            uint32_t color = ((attribs->alpha ? attribs->alpha : 0x3F) << 18) | (b << 12) | (g << 6) | r;
 
             // Blend the texture with the vertex color
-            if (polygon->textureFmt != 0)
+            if (attribs->textureFmt != 0)
             {
                 // Interpolate the texture coordinates at the current pixel
-                int s = interpolateFill(s1 + 0xFFFF, s2 + 0xFFFF, x1, x, x2, w1, w2) - 0xFFFF;
-                int t = interpolateFill(t1 + 0xFFFF, t2 + 0xFFFF, x1, x, x2, w1, w2) - 0xFFFF;
+                int s = interpolateFill(s1 + 0xFFFF, s2 + 0xFFFF, x1, x, x2, factor, span) - 0xFFFF;
+                int t = interpolateFill(t1 + 0xFFFF, t2 + 0xFFFF, x1, x, x2, factor, span) - 0xFFFF;
 
                 // Read a texel from the texture
-                uint32_t texel = readTexture(polygon, s >> 4, t >> 4);
+                uint32_t texel = readTexture(attribs, texels, s >> 4, t >> 4);
 
                 // Apply texture blending
                 // These formulas are a translation of the pseudocode from GBATEK to C++
-                switch (polygon->mode)
+                switch (attribs->mode)
                 {
                     case 0: // Modulation
                     {
@@ -745,7 +1217,7 @@ void Gpu3DRenderer::drawPolygon(int line, int thread, _Polygon *polygon)
 
                     case 2: // Toon/Highlight
                     {
-                        uint32_t toon = rgba5ToRgba6(toonTable[(color & 0x3F) / 2]);
+                        uint32_t toon = toonColors[(color & 0x3F) / 2];
                         uint8_t r, g, b;
 
                         if (disp3DCnt & BIT(1)) // Highlight
@@ -770,9 +1242,9 @@ void Gpu3DRenderer::drawPolygon(int line, int thread, _Polygon *polygon)
                     }
                 }
             }
-            else if (polygon->mode == 2) // Toon/Highlight (no texture)
+            else if (attribs->mode == 2) // Toon/Highlight (no texture)
             {
-                uint32_t toon = rgba5ToRgba6(toonTable[(color & 0x3F) / 2]);
+                uint32_t toon = toonColors[(color & 0x3F) / 2];
                 uint8_t r, g, b;
 
                 if (disp3DCnt & BIT(1)) // Highlight
@@ -801,26 +1273,21 @@ void Gpu3DRenderer::drawPolygon(int line, int thread, _Polygon *polygon)
                 if ((disp3DCnt & BIT(3)) && ((color & 0xFC0000) >> 18) < 0x3F) // Alpha blending
                 {
                     // Only render transparent pixels if the old pixel isn't transparent or the polygon ID differs
-                    if (!(*attrib & BIT(6)) || (*attrib & 0x3F) != polygon->id)
+                    if (!(*attrib & BIT(6)) || (*attrib & 0x3F) != attribs->id)
                     {
                         *pixel = BIT(26) | ((*pixel & 0xFC0000) ? interpolateColor(*pixel, color, 0, color >> 18, 63) : color);
-                        if (polygon->transNewDepth) depthBuffer[thread][x] = depth;
-                        *attrib = (*attrib & (polygon->fog << 7)) | BIT(6) | polygon->id;
+                        if (attribs->transNewDepth) depthBuffer[thread][x] = depth;
+                        *attrib = (*attrib & (attribs->fog << 7)) | BIT(6) | attribs->id;
                     }
                 }
                 else
                 {
                     *pixel = BIT(26) | color;
                     depthBuffer[thread][x] = depth;
-                    *attrib = (polygon->fog << 7) | polygon->id;
+                    *attrib = (attribs->fog << 7) | attribs->id;
                 }
             }
         }
-        else if (polygon->mode == 3 && polygon->id == 0)
-        {
-            // Set a stencil buffer bit for shadow mask pixels that fail the depth test
-            stencilBuffer[thread][x] = 1;
-        }
     }
 }
 
@@ -833,6 +1300,7 @@ void Gpu3DRenderer::writeDisp3DCnt(uint16_t mask, uint16_t value)
     // Write to the DISP3DCNT register and invalidate the 3D if a parameter changed
     mask &= 0x4FFF;
     if ((value & mask) == (disp3DCnt & mask)) return;
+    if ((value ^ disp3DCnt) & mask & 0x0F00) fogDirty = true;
     disp3DCnt = (disp3DCnt & ~mask) | (value & mask);
     core->gpu.invalidate3D();
 }
@@ -861,6 +1329,7 @@ void Gpu3DRenderer::writeToonTable(int index, uint16_t mask, uint16_t value)
     mask &= 0x7FFF;
     if ((value & mask) == (toonTable[index] & mask)) return;
     toonTable[index] = (toonTable[index] & ~mask) | (value & mask);
+    toonColors[index] = rgba5ToRgba6(toonTable[index]);
     core->gpu.invalidate3D();
 }
 
@@ -887,5 +1356,48 @@ void Gpu3DRenderer::writeFogTable(int index, uint8_t value)
     // Write to one of the FOG_TABLE registers and invalidate the 3D if a parameter changed
     if ((value & 0x7F) == (fogTable[index] & 0x7F)) return;
     fogTable[index] = value & 0x7F;
+    fogDirty = true;
     core->gpu.invalidate3D();
 }
+
+void Gpu3DRenderer::saveState(FILE *file)
+{
+    // Let the threads finish drawing so the saved framebuffer is complete
+    for (int i = 0; i < 192; i++)
+        waitScanline(i);
+
+    // Write the state to a file
+    fwrite(framebuffer, sizeof(framebuffer), 1, file);
+    fwrite(&disp3DCnt, sizeof(disp3DCnt), 1, file);
+    fwrite(&clearColor, sizeof(clearColor), 1, file);
+    fwrite(&clearDepth, sizeof(clearDepth), 1, file);
+    fwrite(&fogColor, sizeof(fogColor), 1, file);
+    fwrite(&fogOffset, sizeof(fogOffset), 1, file);
+    fwrite(fogTable, sizeof(fogTable), 1, file);
+    fwrite(toonTable, sizeof(toonTable), 1, file);
+}
+
+void Gpu3DRenderer::loadState(FILE *file)
+{
+    // Let the threads finish drawing before their state is replaced
+    for (int i = 0; i < 192; i++)
+        waitScanline(i);
+
+    // Read the state from a file
+    fread(framebuffer, sizeof(framebuffer), 1, file);
+    fread(&disp3DCnt, sizeof(disp3DCnt), 1, file);
+    fread(&clearColor, sizeof(clearColor), 1, file);
+    fread(&clearDepth, sizeof(clearDepth), 1, file);
+    fread(&fogColor, sizeof(fogColor), 1, file);
+    fread(&fogOffset, sizeof(fogOffset), 1, file);
+    fread(fogTable, sizeof(fogTable), 1, file);
+    fread(toonTable, sizeof(toonTable), 1, file);
+
+    // Rebuild the tables derived from the registers
+    for (int i = 0; i < 32; i++)
+        toonColors[i] = rgba5ToRgba6(toonTable[i]);
+    fogDirty = true;
+
+    // The loaded framebuffer may not match the scene, so draw the next frame in full
+    frameValid = false;
+}
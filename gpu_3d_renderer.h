@@ -20,13 +20,70 @@
 #ifndef GPU_3D_RENDERER_H
 #define GPU_3D_RENDERER_H
 
-#include <atomic>
 #include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#ifndef PSP
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
+#endif
 
 class Core;
-struct Vertex;
 struct _Polygon;
+struct PolygonAttribs;
+
+struct Divider
+{
+    // Divides by a value set up in advance using a multiply and shifts, giving the same results as integer division
+    uint32_t multiplier = 1;
+    int shift1 = 0, shift2 = 0;
+
+    void setup(uint32_t divisor);
+
+    uint32_t divide(uint32_t value) const
+    {
+        uint32_t t = ((uint64_t)multiplier * value) >> 32;
+        return (t + ((value - t) >> shift1)) >> shift2;
+    }
+};
+
+// The most texels the texture cache can hold, at 4 bytes each
+// Every core has its own cache, so this is small on the PSP and kept modest elsewhere for pools of many cores
+// Textures over a quarter of the limit aren't cached, and the cache is cleared at the start of a frame once it's over half
+#ifdef PSP
+#define TEXTURE_CACHE_LIMIT 0x40000 // 1MB
+#else
+#define TEXTURE_CACHE_LIMIT 0x100000 // 4MB
+#endif
+
+struct TextureEntry
+{
+    // A texture decoded to RGBA6 texels, with the versions of the VRAM pages it was decoded from
+    uint32_t textureAddr = 0, paletteAddr = 0;
+    int sizeS = 0;
+    int format = 0;
+    bool transparent0 = false;
+    uint32_t slotEpoch = 0;
+    uint64_t pages = 0;
+    uint32_t versions[38] = {};
+    uint32_t frame = 0;
+    std::vector<uint32_t> texels;
+};
+
+struct FrameKey
+{
+    // The scene, registers and texture page versions that decide what a 3D frame looks like
+    uint64_t sceneHash;
+    uint32_t slotEpoch;
+    uint32_t pageVersions[38];
+    uint32_t clearColor, fogColor;
+    uint16_t disp3DCnt, clearDepth, fogOffset;
+    uint16_t toonTable[32];
+    uint8_t fogTable[32];
+};
 
 class Gpu3DRenderer
 {
@@ -34,7 +91,11 @@ class Gpu3DRenderer
         Gpu3DRenderer(Core *core);
         ~Gpu3DRenderer();
 
+        void saveState(FILE *file);
+        void loadState(FILE *file);
+
         void drawScanline(int line);
+        void waitScanline(int line);
 
         uint16_t *getFramebuffer(int line);
 
@@ -52,13 +113,50 @@ class Gpu3DRenderer
         Core *core;
 
         uint16_t framebuffer[256 * 192 * 2] = {};
-        uint32_t depthBuffer[3][256] = {};
-        uint8_t attribBuffer[3][256] = {};
-        uint8_t stencilBuffer[3][256] = {};
-        bool stencilClear[3] = {};
 
+        // Texture and palette slots as host pointers, copied from the memory map at the start of each frame
+        uint8_t *texSlots[4] = {};
+        uint8_t *palSlots[6] = {};
+        uint32_t slotEpoch = 0;
+        uint32_t pageVersions[38] = {};
+
+        // Decoded textures, looked up by their parameters and reused while their VRAM pages are unchanged
+        TextureEntry textureCache[256];
+        uint32_t cachedTexels = 0;
+        uint32_t frame = 0;
+        const uint32_t *polygonTexels[2048] = {};
+
+        // The last frame is reused instead of being drawn again if nothing it depends on has changed
+        FrameKey frameKey = {};
+        bool frameValid = false;
+        bool reuseFrame = false;
+        uint32_t depthBuffer[4][256] = {};
+        uint8_t attribBuffer[4][256] = {};
+        uint8_t stencilBuffer[4][256] = {};
+        bool stencilClear[4] = {};
+
+        // Polygons binned by the 8-scanline bands they cover, set up at the start of each frame
+        // The scanlines covered by each polygon are kept so the rest of a band can be skipped quickly
+        uint8_t polygonTop[2048] = {}, polygonBottom[2048] = {};
+        uint16_t bandPolygons[24][2048] = {};
+        int bandCounts[24] = {};
+
+        // Worker threads that draw interleaved scanlines of a frame, started at its first scanline
+        // Each scanline is marked ready once drawn, so users of the 3D only wait on the ones they need
+        // The PSP has no threads to spare, so it always draws scanlines as they're requested
         int activeThreads = 0;
-        bool ready[192];
+#ifndef PSP
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable start;
+        uint64_t generation = 0;
+        bool stopping = false;
+        std::atomic<bool> ready[192];
+#endif
+
+        // Reciprocals of 9-bit values used to estimate divisions, and exact dividers for every span width
+        uint32_t reciprocals[512] = {};
+        Divider dividers[512];
 
         uint16_t disp3DCnt = 0;
         uint32_t clearColor = 0;
@@ -68,21 +166,41 @@ class Gpu3DRenderer
         uint8_t fogTable[32] = {};
         uint16_t toonTable[32] = {};
 
+        // Fog densities for each depth offset from the fog offset, rebuilt at the start of a frame if the fog registers changed
+        // Toon colors are converted to RGB6 as the table is written
+        uint8_t fogDensities[0x400 * 31 + 1] = {};
+        int fogLimit = 1;
+        bool fogDirty = true;
+        uint32_t toonColors[32] = {};
+
         uint32_t rgba5ToRgba6(uint32_t color);
 
+        void getFrameKey(FrameKey *key);
+        void setupPolygons();
+#ifndef PSP
+        void startThreads(int count);
+        void stopThreads();
         void drawThreaded(int thread);
+#endif
         void drawScanline1(int line, int thread);
 
         uint8_t *getTexture(uint32_t address);
         uint8_t *getPalette(uint32_t address);
 
         uint32_t interpolateLinear(uint32_t v1, uint32_t v2, uint32_t x1, uint32_t x, uint32_t x2);
-        uint32_t interpolateFill(uint32_t v1, uint32_t v2, uint32_t x1, uint32_t x, uint32_t x2, uint32_t w1, uint32_t w2);
+        uint32_t divideSmall(uint32_t a, uint32_t b);
+        uint32_t interpolateFill(uint32_t v1, uint32_t v2, uint32_t x1, uint32_t x, uint32_t x2, uint32_t factor, const Divider &span);
         uint32_t interpolateEdge(uint32_t v1, uint32_t v2, uint32_t x1, uint32_t x, uint32_t x2, uint32_t w1, uint32_t w2);
         uint32_t interpolateColor(uint32_t c1, uint32_t c2, uint32_t x1, uint32_t x, uint32_t x2);
 
-        uint32_t readTexture(_Polygon *polygon, int s, int t);
-        void drawPolygon(int line, int thread, _Polygon *polygon);
+        const uint32_t *getTexels(PolygonAttribs *attribs);
+        uint32_t readTexture(PolygonAttribs *attribs, const uint32_t *texels, int s, int t);
+        uint32_t decodeTexel(PolygonAttribs *attribs, int s, int t);
+        static void setBits(uint32_t *bits, uint32_t start, uint32_t end);
+        static void applyFog(uint16_t *pixels, const uint16_t *densities, uint32_t fog);
+        void updateFogDensities();
+        static void testDepth(const uint32_t *depths, const uint32_t *buffer, uint32_t margin, uint32_t *passes, uint32_t start, uint32_t end);
+        void drawPolygon(int line, int thread, _Polygon *polygon, PolygonAttribs *attribs, const uint32_t *texels);
 };
 
 #endif // GPU_3D_RENDERER_H
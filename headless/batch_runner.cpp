@@ -0,0 +1,358 @@
+/*
+    Copyright 2020 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Headless batch runner
+// Runs a list of ROMs for a fixed number of frames across a pool of workers, one core per worker,
+// and writes a performance report for each ROM as JSON or CSV
+// Each ROM runs in its own child process, so its peak memory is measured on its own
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "settings.h"
+
+struct Stats
+{
+    // What a run measured, passed back from the child process as plain data
+    bool loaded = false;
+    int frames = 0;
+    double seconds = 0;
+    Profile profile;
+    uint64_t hash = 0;
+    uint64_t linesDrawn = 0, linesReused = 0;
+};
+
+struct Result
+{
+    std::string rom;
+    Stats stats;
+    long peakRssKb = 0;
+};
+
+static uint64_t hashFramebuffers(Core *core)
+{
+    // Hash the final framebuffers of both 2D engines using 64-bit FNV-1a
+    uint64_t hash = 0xCBF29CE484222325;
+    for (int i = 0; i < 2; i++)
+    {
+        uint8_t *data = (uint8_t*)core->gpu2D[i].getFramebuffer(0);
+        for (unsigned int j = 0; j < 256 * 192 * sizeof(uint16_t); j++)
+        {
+            hash ^= data[j];
+            hash *= 0x100000001B3;
+        }
+    }
+    return hash;
+}
+
+static void runRom(const std::string &path, Stats *stats, int frames, int renderFrames)
+{
+    // Skip ROMs that can't be opened, since direct boot expects a valid header
+    FILE *rom = fopen(path.c_str(), "rb");
+    stats->loaded = (rom != nullptr);
+    if (rom) fclose(rom);
+
+    if (stats->loaded)
+    {
+        // Load the ROM into a fresh core
+        Core *core = new Core(path);
+
+        // Run the ROM headless for the requested number of frames
+        core->setProfiling(true);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < frames; i++)
+        {
+            // Only render every few frames if requested; the engines take turns drawing,
+            // so the last two frames are always rendered to give the same hash as a full run
+            core->setRendering(renderFrames <= 1 || i % renderFrames == 0 || i >= frames - 2);
+            core->runFrame();
+        }
+        std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+
+        stats->frames = frames;
+        stats->seconds = time.count();
+        stats->profile = core->getProfile();
+        stats->hash = hashFramebuffers(core);
+
+        // Count the 2D scanlines of both engines that were drawn and that were reused from the last frame
+        for (int j = 0; j < 2; j++)
+        {
+            stats->linesDrawn += core->gpu2D[j].getLinesDrawn();
+            stats->linesReused += core->gpu2D[j].getLinesReused();
+        }
+
+        delete core;
+    }
+}
+
+static void runRomProcess(Result *result, int frames, int renderFrames)
+{
+    // Run the ROM in a child process that writes its stats back through a pipe
+    // Peak memory is per process, so this keeps other workers and earlier ROMs out of the ROM's figure
+    int fds[2];
+    if (pipe(fds) != 0) return;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        Stats stats;
+        runRom(result->rom, &stats, frames, renderFrames);
+        bool sent = (write(fds[1], &stats, sizeof(stats)) == sizeof(stats));
+        _exit(sent ? 0 : 1);
+    }
+
+    close(fds[1]);
+    if (pid < 0)
+    {
+        close(fds[0]);
+        return;
+    }
+
+    // A ROM that crashes its process is reported as not loaded
+    Stats stats;
+    if (read(fds[0], &stats, sizeof(stats)) == sizeof(stats))
+        result->stats = stats;
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == pid)
+        result->peakRssKb = usage.ru_maxrss;
+}
+
+static std::string escapeJson(const std::string &text)
+{
+    // Escape quotes, backslashes and control characters so a ROM path is always a valid JSON string
+    std::string escaped;
+    for (unsigned int i = 0; i < text.size(); i++)
+    {
+        uint8_t c = text[i];
+        switch (c)
+        {
+            case '"':  escaped += "\\\""; break;
+            case '\\': escaped += "\\\\"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\r': escaped += "\\r"; break;
+            case '\t': escaped += "\\t"; break;
+            default:
+                if (c < 0x20)
+                {
+                    char code[7];
+                    snprintf(code, sizeof(code), "\\u%04x", c);
+                    escaped += code;
+                }
+                else
+                {
+                    escaped += c;
+                }
+                break;
+        }
+    }
+    return escaped;
+}
+
+static std::string escapeCsv(const std::string &text)
+{
+    // Double any quotes so a ROM path stays in one quoted CSV field
+    std::string escaped;
+    for (unsigned int i = 0; i < text.size(); i++)
+    {
+        if (text[i] == '"') escaped += '"';
+        escaped += text[i];
+    }
+    return escaped;
+}
+
+static void writeJson(FILE *file, std::vector<Result> &results)
+{
+    fprintf(file, "[\n");
+    for (unsigned int i = 0; i < results.size(); i++)
+    {
+        Result *r = &results[i];
+        Stats *s = &r->stats;
+        fprintf(file, "  {\"rom\": \"%s\", \"loaded\": %s, \"frames\": %d, \"seconds\": %.3f, \"fps\": %.2f, "
+            "\"cpu_ms\": %.3f, \"gpu2d_ms\": %.3f, \"gpu3d_ms\": %.3f, \"dma_ms\": %.3f, "
+            "\"lines_drawn\": %llu, \"lines_reused\": %llu, "
+            "\"peak_rss_kb\": %ld, \"core_bytes\": %lu, \"framebuffer_hash\": \"%016llx\"}%s\n",
+            escapeJson(r->rom).c_str(), s->loaded ? "true" : "false", s->frames, s->seconds,
+            (s->seconds > 0) ? (s->frames / s->seconds) : 0.0,
+            s->profile.cpu / 1000000.0, s->profile.gpu2D / 1000000.0,
+            s->profile.gpu3D / 1000000.0, s->profile.dma / 1000000.0,
+            (unsigned long long)s->linesDrawn, (unsigned long long)s->linesReused,
+            r->peakRssKb, (unsigned long)sizeof(Core), (unsigned long long)s->hash,
+            (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(file, "]\n");
+}
+
+static void writeCsv(FILE *file, std::vector<Result> &results)
+{
+    fprintf(file, "rom,loaded,frames,seconds,fps,cpu_ms,gpu2d_ms,gpu3d_ms,dma_ms,lines_drawn,lines_reused,peak_rss_kb,core_bytes,framebuffer_hash\n");
+    for (unsigned int i = 0; i < results.size(); i++)
+    {
+        Result *r = &results[i];
+        Stats *s = &r->stats;
+        fprintf(file, "\"%s\",%d,%d,%.3f,%.2f,%.3f,%.3f,%.3f,%.3f,%llu,%llu,%ld,%lu,%016llx\n",
+            escapeCsv(r->rom).c_str(), s->loaded, s->frames, s->seconds,
+            (s->seconds > 0) ? (s->frames / s->seconds) : 0.0,
+            s->profile.cpu / 1000000.0, s->profile.gpu2D / 1000000.0,
+            s->profile.gpu3D / 1000000.0, s->profile.dma / 1000000.0,
+            (unsigned long long)s->linesDrawn, (unsigned long long)s->linesReused,
+            r->peakRssKb, (unsigned long)sizeof(Core), (unsigned long long)s->hash);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options] rom.nds [rom.nds ...]\n", name);
+    fprintf(stderr, "  -f <frames>   Number of frames to run each ROM for (default 600)\n");
+    fprintf(stderr, "  -j <workers>  Number of ROMs to run in parallel (default: hardware threads)\n");
+    fprintf(stderr, "  -l <file>     Read additional ROM paths from a file, one per line\n");
+    fprintf(stderr, "  -o <file>     Write the report to a file instead of stdout\n");
+    fprintf(stderr, "  -c            Write the report as CSV instead of JSON\n");
+    fprintf(stderr, "  -v <frames>   Only render every this many frames, plus the last two (default 1)\n");
+}
+
+int main(int argc, char **argv)
+{
+    int frames = 600;
+    int workers = std::thread::hardware_concurrency();
+    int renderFrames = 1;
+    std::string output;
+    bool csv = false;
+    std::vector<Result> results;
+
+    // Parse the command line arguments
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if ((arg == "-f" || arg == "-j" || arg == "-l" || arg == "-o" || arg == "-v") && i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+
+        if (arg == "-f")
+        {
+            frames = atoi(argv[++i]);
+        }
+        else if (arg == "-j")
+        {
+            workers = atoi(argv[++i]);
+        }
+        else if (arg == "-v")
+        {
+            renderFrames = atoi(argv[++i]);
+        }
+        else if (arg == "-o")
+        {
+            output = argv[++i];
+        }
+        else if (arg == "-c")
+        {
+            csv = true;
+        }
+        else if (arg == "-l")
+        {
+            // Read ROM paths from a list file, skipping empty lines
+            FILE *list = fopen(argv[++i], "r");
+            if (!list)
+            {
+                fprintf(stderr, "Failed to open ROM list: %s\n", argv[i]);
+                return 1;
+            }
+
+            char line[1024];
+            while (fgets(line, sizeof(line), list))
+            {
+                std::string path = line;
+                while (!path.empty() && (path.back() == '\n' || path.back() == '\r'))
+                    path.pop_back();
+                if (path.empty()) continue;
+                results.push_back(Result());
+                results.back().rom = path;
+            }
+            fclose(list);
+        }
+        else if (arg[0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+        {
+            results.push_back(Result());
+            results.back().rom = arg;
+        }
+    }
+
+    if (results.empty())
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (workers < 1) workers = 1;
+    if (workers > (int)results.size()) workers = results.size();
+
+    // Load the BIOS/firmware paths and boot settings shared by all cores
+    Settings::load();
+
+    // Run the ROMs on a pool of workers, each pulling the next ROM from the list when it finishes one
+    std::atomic<unsigned int> next(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < workers; i++)
+    {
+        threads.push_back(std::thread([&]
+        {
+            unsigned int index;
+            while ((index = next++) < results.size())
+                runRomProcess(&results[index], frames, renderFrames);
+        }));
+    }
+
+    for (unsigned int i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    // Write the report
+    FILE *file = output.empty() ? stdout : fopen(output.c_str(), "w");
+    if (!file)
+    {
+        fprintf(stderr, "Failed to open output file: %s\n", output.c_str());
+        return 1;
+    }
+
+    if (csv)
+        writeCsv(file, results);
+    else
+        writeJson(file, results);
+
+    if (file != stdout) fclose(file);
+    return 0;
+}
@@ -0,0 +1,164 @@
+/*
+    Copyright 2020 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Background renderer benchmark
+// Draws engine A scanlines from random VRAM in each BG mode and with color effects and windows, and reports scanlines per second
+// The layers scroll by a pixel every frame, so the renderers run on every line instead of it being reused from the last frame
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "core.h"
+
+struct BgCase
+{
+    const char *name;
+    uint32_t dispCnt;
+    uint16_t bgCnt;
+    uint16_t bldCnt;
+    uint16_t masterBright;
+};
+
+// Every case enables BG0-3 with the same settings, so each layer goes through the renderer its mode gives it
+static const BgCase cases[] =
+{
+    { "mode 0, text 4-bit",              0x00010F00, 0x4000, 0x0000, 0x0000 },
+    { "mode 0, text 8-bit",              0x00010F00, 0x4080, 0x0000, 0x0000 },
+    { "mode 0, text 8-bit ext palette",  0x40010F00, 0x4080, 0x0000, 0x0000 },
+    { "mode 1, text + affine",           0x00010F01, 0x6080, 0x0000, 0x0000 },
+    { "mode 2, affine",                  0x00010F02, 0x6080, 0x0000, 0x0000 },
+    { "mode 3, text + ext affine",       0x00010F03, 0x6000, 0x0000, 0x0000 },
+    { "mode 4, affine + ext affine",     0x00010F04, 0x6000, 0x0000, 0x0000 },
+    { "mode 5, ext affine ext palette",  0x40010F05, 0x6000, 0x0000, 0x0000 },
+    { "mode 5, 256-color bitmap",        0x00010F05, 0x6080, 0x0000, 0x0000 },
+    { "mode 5, direct color bitmap",     0x00010F05, 0x6084, 0x0000, 0x0000 },
+    { "mode 6, large bitmap",            0x00010F06, 0x6000, 0x0000, 0x0000 },
+    { "mode 0, alpha blending",          0x00010F00, 0x4000, 0x3F5F, 0x0000 },
+    { "mode 0, brightness decrease",     0x00010F00, 0x4000, 0x00FF, 0x0000 },
+    { "mode 0, master brightness",       0x00010F00, 0x4000, 0x0000, 0x8008 },
+    { "mode 0, windows 0 and 1",         0x00016F00, 0x4000, 0x3F5F, 0x0000 }
+};
+
+static uint32_t seed = 1;
+
+static uint32_t random32()
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) ^ (seed << 13);
+}
+
+int main(int argc, char **argv)
+{
+    int frames = 200;
+
+    // Parse the command line arguments
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-f" && i + 1 < argc)
+        {
+            frames = atoi(argv[++i]);
+            continue;
+        }
+
+        fprintf(stderr, "Usage: %s [-f <frames>]\n", argv[0]);
+        return 1;
+    }
+
+    Core *core = new Core();
+    Memory *memory = &core->memory;
+
+    // Power on both engines and map VRAM A-D to engine A backgrounds and E to its extended palettes
+    memory->write<uint16_t>(0, 0x4000304, 0x8003);
+    memory->write<uint8_t>(0, 0x4000240, 0x81);
+    memory->write<uint8_t>(0, 0x4000241, 0x89);
+    memory->write<uint8_t>(0, 0x4000242, 0x91);
+    memory->write<uint8_t>(0, 0x4000243, 0x99);
+    memory->write<uint8_t>(0, 0x4000244, 0x84);
+
+    // Fill the backgrounds and palette with random data, leaving some pixels transparent
+    for (uint32_t i = 0; i < 0x80000; i += 4)
+        memory->write<uint32_t>(0, 0x6000000 + i, (random32() % 3 == 0) ? 0 : random32());
+    for (uint32_t i = 0; i < 0x400; i += 4)
+        memory->write<uint32_t>(0, 0x5000000 + i, random32());
+
+    // Fill the extended palettes, which are only accessible through LCDC mapping
+    memory->write<uint8_t>(0, 0x4000244, 0x80);
+    for (uint32_t i = 0; i < 0x8000; i += 4)
+        memory->write<uint32_t>(0, 0x6880000 + i, random32());
+    memory->write<uint8_t>(0, 0x4000244, 0x84);
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        // Set up the layers, with scrolling and a slight rotation so nothing is aligned
+        memory->write<uint32_t>(0, 0x4000000, cases[c].dispCnt);
+        for (int bg = 0; bg < 4; bg++)
+        {
+            memory->write<uint16_t>(0, 0x4000008 + bg * 2, cases[c].bgCnt | (bg << 2) | (bg << 9));
+            memory->write<uint16_t>(0, 0x4000010 + bg * 4, bg * 13 + 3);
+            memory->write<uint16_t>(0, 0x4000012 + bg * 4, bg * 7 + 5);
+        }
+        memory->write<uint16_t>(0, 0x4000040, 0x20A0);
+        memory->write<uint16_t>(0, 0x4000042, 0x80F0);
+        memory->write<uint16_t>(0, 0x4000044, 0x1060);
+        memory->write<uint16_t>(0, 0x4000046, 0x40C0);
+        memory->write<uint16_t>(0, 0x4000048, 0x1B3F);
+        memory->write<uint16_t>(0, 0x400004A, 0x0037);
+        memory->write<uint16_t>(0, 0x4000050, cases[c].bldCnt);
+        memory->write<uint16_t>(0, 0x4000052, 0x0A06);
+        memory->write<uint8_t>(0, 0x4000054, 0x08);
+        memory->write<uint16_t>(0, 0x400006C, cases[c].masterBright);
+        for (int i = 0; i < 2; i++)
+        {
+            memory->write<uint16_t>(0, 0x4000020 + i * 16, 0x0F0);
+            memory->write<uint16_t>(0, 0x4000022 + i * 16, 0x020);
+            memory->write<uint16_t>(0, 0x4000024 + i * 16, 0xFFE0);
+            memory->write<uint16_t>(0, 0x4000026 + i * 16, 0x0F0);
+            memory->write<uint32_t>(0, 0x4000028 + i * 16, 0x1234);
+            memory->write<uint32_t>(0, 0x400002C + i * 16, 0x5678);
+        }
+
+        // Draw whole frames, so the internal affine registers are reloaded as usual
+        uint64_t drawn = core->gpu2D[0].getLinesDrawn(), reused = core->gpu2D[0].getLinesReused();
+        auto start = std::chrono::steady_clock::now();
+        for (int f = 0; f < frames; f++)
+        {
+            for (int bg = 0; bg < 4; bg++)
+                memory->write<uint16_t>(0, 0x4000010 + bg * 4, bg * 13 + 3 + f);
+
+            for (int line = 0; line < 192; line++)
+            {
+                core->gpu2D[0].drawScanline(line);
+                core->gpu2D[0].finishScanline(line);
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        drawn = core->gpu2D[0].getLinesDrawn() - drawn;
+        reused = core->gpu2D[0].getLinesReused() - reused;
+
+        fprintf(stdout, "%-32s %10.0f scanlines/s (%llu drawn, %llu reused)\n", cases[c].name, frames * 192 / seconds,
+            (unsigned long long)drawn, (unsigned long long)reused);
+    }
+
+    delete core;
+    return 0;
+}
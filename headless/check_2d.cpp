@@ -0,0 +1,206 @@
+/*
+    Copyright 2020 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// 2D renderer check
+// Draws both engines from random registers and VRAM, changing a little every frame so stale cached lines show up,
+// and compares a hash of the frames for each seed with the one recorded from the original scanline renderer
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "core.h"
+
+// Frame hashes for each seed, from the 2D renderer before it cached and reused anything
+static const uint64_t expected[] =
+{
+    0xA22C567F5E69A15F, 0x840558B2F29ED8EB, 0x96F3E66A024C0AA8, 0x2E3777BAE53AA026,
+    0x4882F0B7A90F9123, 0x99F4D84E2F2AF2C1, 0x887EF2DA5215582E, 0x5F1D6ECA78B4C704
+};
+
+static uint32_t seed = 1;
+
+static uint32_t random32()
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) ^ (seed << 13);
+}
+
+static void randomRegisters(Memory *memory, uint32_t io)
+{
+    // Pick a BG mode and randomize the layer, window and color effect registers
+    // Engine B has no mode 6, and the affine parameters are kept near identity so layers stay visible
+    uint32_t dispCnt = (random32() & ~0x30007) | 0x10000 | (random32() % ((io == 0x4000000) ? 7 : 6));
+    if (random32() & 1) dispCnt &= ~BIT(3);
+    memory->write<uint32_t>(0, io + 0x000, dispCnt);
+
+    for (int i = 0; i < 4; i++)
+    {
+        memory->write<uint16_t>(0, io + 0x008 + i * 2, random32());
+        memory->write<uint16_t>(0, io + 0x010 + i * 4, random32());
+        memory->write<uint16_t>(0, io + 0x012 + i * 4, random32());
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        memory->write<uint16_t>(0, io + 0x020 + i * 16, 0x100 + (random32() % 0x80) - 0x40);
+        memory->write<uint16_t>(0, io + 0x022 + i * 16, (random32() % 0x80) - 0x40);
+        memory->write<uint16_t>(0, io + 0x024 + i * 16, (random32() % 0x80) - 0x40);
+        memory->write<uint16_t>(0, io + 0x026 + i * 16, 0x100 + (random32() % 0x80) - 0x40);
+        memory->write<uint32_t>(0, io + 0x028 + i * 16, random32() & 0xFFFFF);
+        memory->write<uint32_t>(0, io + 0x02C + i * 16, random32() & 0xFFFFF);
+    }
+
+    for (uint32_t address = 0x040; address <= 0x04A; address += 2)
+        memory->write<uint16_t>(0, io + address, random32());
+    for (uint32_t address = 0x050; address <= 0x054; address += 2)
+        memory->write<uint16_t>(0, io + address, random32());
+    memory->write<uint16_t>(0, io + 0x06C, random32());
+}
+
+static void randomVram(Memory *memory)
+{
+    // Remap VRAM to random banks, and fill the backgrounds, objects and palettes with data that's partly transparent
+    for (int i = 0; i < 9; i++)
+        memory->write<uint8_t>(0, 0x4000240 + i + (i >= 7), 0x80 | (random32() & 0x1F));
+
+    for (int i = 0; i < 0x20000; i++)
+        memory->write<uint32_t>(0, 0x6000000 + (random32() & 0x7FFFC), (random32() % 3 == 0) ? 0 : random32());
+    for (int i = 0; i < 0x8000; i++)
+        memory->write<uint32_t>(0, 0x6200000 + (random32() & 0x1FFFC), (random32() % 3 == 0) ? 0 : random32());
+    for (int i = 0; i < 0x8000; i++)
+        memory->write<uint32_t>(0, 0x6400000 + (random32() & 0x3FFFC), (random32() % 3 == 0) ? 0 : random32());
+    for (int i = 0; i < 0x4000; i++)
+        memory->write<uint32_t>(0, 0x6600000 + (random32() & 0x1FFFC), (random32() % 3 == 0) ? 0 : random32());
+    for (int i = 0; i < 0x200; i++)
+        memory->write<uint32_t>(0, 0x5000000 + i * 4, random32());
+    for (int i = 0; i < 0x200; i++)
+        memory->write<uint32_t>(0, 0x7000000 + i * 4, random32());
+
+    // Extended palettes are only accessible through LCDC mapping
+    for (int i = 0; i < 0x4000; i++)
+        memory->write<uint32_t>(0, 0x6800000 + (random32() & 0xFFFFC), random32());
+}
+
+static void smallChanges(Memory *memory)
+{
+    // Touch a few words of VRAM, palettes and OAM, and sometimes a scroll, layer or bank register
+    int count = random32() % 64;
+    for (int i = 0; i < count; i++)
+        memory->write<uint16_t>(0, 0x6000000 + (random32() & 0x7FFFE), random32());
+    for (int i = 0; i < count; i++)
+        memory->write<uint16_t>(0, 0x6200000 + (random32() & 0x1FFFE), random32());
+    for (int i = 0; i < count / 4; i++)
+        memory->write<uint16_t>(0, 0x6800000 + (random32() & 0xFFFFE), random32());
+    for (int i = 0; i < count / 4; i++)
+        memory->write<uint16_t>(0, 0x5000000 + (random32() & 0x7FE), random32());
+    for (int i = 0; i < count / 4; i++)
+        memory->write<uint16_t>(0, 0x7000000 + (random32() & 0x7FE), random32());
+
+    if (random32() % 4 == 0)
+        memory->write<uint16_t>(0, 0x4000008 + (random32() % 4) * 2, random32());
+    if (random32() % 4 == 0)
+        memory->write<uint16_t>(0, 0x4000010 + (random32() % 8) * 2, random32());
+    if (random32() % 8 == 0)
+        memory->write<uint8_t>(0, 0x4000240 + random32() % 7, 0x80 | (random32() & 0x1F));
+}
+
+static uint64_t runSeed(int index, int frames)
+{
+    seed = index + 1;
+    Core *core = new Core();
+    Memory *memory = &core->memory;
+    memory->write<uint16_t>(0, 0x4000304, 0x8003);
+
+    // Hash the frames of both engines using 64-bit FNV-1a
+    uint64_t hash = 0xCBF29CE484222325;
+
+    for (int f = 0; f < frames; f++)
+    {
+        if (f % 50 == 0)
+            randomVram(memory);
+        if (f % 10 == 0)
+        {
+            randomRegisters(memory, 0x4000000);
+            randomRegisters(memory, 0x4001000);
+        }
+        smallChanges(memory);
+
+        for (int i = 0; i < 2; i++)
+        {
+            for (int line = 0; line < 192; line++)
+            {
+                core->gpu2D[i].drawScanline(line);
+                core->gpu2D[i].finishScanline(line);
+            }
+
+            uint8_t *data = (uint8_t*)core->gpu2D[i].getFramebuffer(0);
+            for (unsigned int j = 0; j < 256 * 192 * sizeof(uint16_t); j++)
+            {
+                hash ^= data[j];
+                hash *= 0x100000001B3;
+            }
+        }
+    }
+
+    delete core;
+    return hash;
+}
+
+int main(int argc, char **argv)
+{
+    int seeds = sizeof(expected) / sizeof(expected[0]);
+    int frames = 200;
+    bool record = false;
+
+    // Parse the command line arguments
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-r")
+        {
+            record = true;
+            continue;
+        }
+
+        fprintf(stderr, "Usage: %s [-r]\n", argv[0]);
+        fprintf(stderr, "  -r   Print the hash for each seed instead of checking it\n");
+        return 1;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < seeds; i++)
+    {
+        uint64_t hash = runSeed(i, frames);
+        if (record)
+        {
+            fprintf(stdout, "0x%016llX\n", (unsigned long long)hash);
+        }
+        else if (hash != expected[i])
+        {
+            fprintf(stdout, "2D seed %d: got %016llx, expected %016llx\n", i + 1,
+                (unsigned long long)hash, (unsigned long long)expected[i]);
+            failed++;
+        }
+    }
+
+    if (!record)
+        fprintf(stdout, "2D check: %d of %d seeds match\n", seeds - failed, seeds);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,231 @@
+/*
+    Copyright 2020 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// 3D renderer check
+// Sends random scenes through the geometry engine, draws them over random textures,
+// and compares a hash of each frame with the one recorded from the original renderer
+// Wireframe polygons are left out, since the original wrote past its edge arrays when drawing some of them
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "core.h"
+#include "settings.h"
+
+struct SceneSet
+{
+    const char *name;
+    int polygons;
+    bool fog;
+    uint64_t expected[8];
+};
+
+// Frame hashes for each seed of each set, from the renderer before it cached textures or stopped dividing per pixel
+// That renderer was recorded with its stencil buffer cleared at the start of each scanline, as it is now
+static const SceneSet sets[] =
+{
+    { "small polygons", 300, false, {
+        0x86D076D2CAA888D0, 0x882B15AA8B51EBF9, 0x00661B5E3525B37F, 0x551CB1F9DD47F492,
+        0x63A8A65B91A01282, 0x10F9AED5E5E7CB94, 0x74C22DF214294839, 0x12F1269D5FD61AB5 } },
+    { "many polygons", 2000, false, {
+        0xB8EC8BD38B51635F, 0x0159204F932DCBCA, 0x509D34F889068621, 0xC51915D636A778D9,
+        0xC4809DF36E60D05B, 0x029DD77B9E85A347, 0xD1BD57DE0F24213E, 0xFC8F973F668ACB83 } },
+    { "fog", 300, true, {
+        0xE1D461247D5B3BEA, 0x0BCB87E7A4E424B2, 0x9725A0BDCD82A544, 0x9BD20ED5DE2F573D,
+        0x572051711DB29DD9, 0x465779067DD0FE03, 0x4A060D81EF1421E7, 0xA06959FF23ECC512 } }
+};
+
+static uint32_t seed = 1;
+
+static uint32_t random32()
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) ^ (seed << 13);
+}
+
+static int randomRange(int min, int max)
+{
+    return min + random32() % (max - min + 1);
+}
+
+static void randomVram(Memory *memory)
+{
+    // Fill VRAM A-D with texture data and E with palettes through LCDC, then map them to the 3D engine
+    for (int i = 0; i < 5; i++)
+        memory->write<uint8_t>(0, 0x4000240 + i, 0x80);
+    for (uint32_t i = 0; i < 0x90000; i += 4)
+        memory->write<uint32_t>(0, 0x6800000 + i, random32());
+
+    memory->write<uint8_t>(0, 0x4000240, 0x83);
+    memory->write<uint8_t>(0, 0x4000241, 0x8B);
+    memory->write<uint8_t>(0, 0x4000242, 0x93);
+    memory->write<uint8_t>(0, 0x4000243, 0x9B);
+    memory->write<uint8_t>(0, 0x4000244, 0x83);
+}
+
+static void randomScene(Core *core, const SceneSet *set)
+{
+    Gpu3D *gpu3D = &core->gpu3D;
+    Gpu3DRenderer *renderer = &core->gpu3DRenderer;
+
+    // Randomize the rendering registers, keeping fog on for the fog set
+    uint16_t disp3DCnt = random32() & 0x0FCB;
+    if (set->fog) disp3DCnt = (disp3DCnt | BIT(7)) & ~BIT(6);
+    renderer->writeDisp3DCnt(0xFFFF, disp3DCnt);
+    renderer->writeClearColor(0xFFFFFFFF, random32());
+    renderer->writeClearDepth(0xFFFF, 0x7000 | (random32() & 0xFFF)); // Far enough that polygons show
+    renderer->writeFogColor(0xFFFFFFFF, random32());
+    renderer->writeFogOffset(0xFFFF, random32());
+    for (int i = 0; i < 32; i++)
+        renderer->writeFogTable(i, random32());
+    for (int i = 0; i < 32; i++)
+        renderer->writeToonTable(i, 0xFFFF, random32());
+
+    // Load a projection with a random perspective W, and sometimes scale the scene
+    int32_t projection[16] = { 0x1000, 0, 0, 0, 0, 0x1000, 0, 0, 0, 0, 0x1000, randomRange(0, 0x1800), 0, 0, 0, randomRange(0x800, 0x3000) };
+    if (random32() % 4 == 0) projection[11] = 0;
+    gpu3D->writeMtxMode(0xFFFFFFFF, 0);
+    for (int i = 0; i < 16; i++)
+        gpu3D->writeMtxLoad44(0xFFFFFFFF, projection[i]);
+    gpu3D->writeMtxMode(0xFFFFFFFF, 1);
+    gpu3D->writeMtxIdentity(0xFFFFFFFF, 0);
+    if (random32() % 2)
+    {
+        gpu3D->writeMtxScale(0xFFFFFFFF, randomRange(0x800, 0x1800));
+        gpu3D->writeMtxScale(0xFFFFFFFF, randomRange(0x800, 0x1800));
+        gpu3D->writeMtxScale(0xFFFFFFFF, 0x1000);
+    }
+    gpu3D->writeViewport(0xFFFFFFFF, 0xBFFF0000);
+
+    for (int p = 0; p < set->polygons; p++)
+    {
+        // Draw front and back faces in a random mode, with random depth and fog settings, alpha and ID
+        uint32_t attrib = 0xC0 | ((random32() % 4) << 4);
+        attrib |= (random32() & 1) << 11;
+        attrib |= (random32() % 8 == 0) << 14;
+        attrib |= (set->fog ? 1 : (random32() & 1)) << 15;
+        attrib |= ((random32() % 2) ? 31 : randomRange(1, 30)) << 16;
+        attrib |= (random32() % 4) << 24;
+        gpu3D->writePolygonAttr(0xFFFFFFFF, attrib);
+
+        // Use a random texture of any format and size
+        uint32_t texParam = (random32() & 0x3FFF) | ((random32() & 0xF) << 16) | (randomRange(0, 4) << 20) |
+            (randomRange(0, 4) << 23) | ((random32() % 8) << 26) | ((random32() & 1) << 29);
+        gpu3D->writeTexImageParam(0xFFFFFFFF, texParam);
+        gpu3D->writePlttBase(0xFFFFFFFF, random32() & 0xFFF);
+
+        // Send a triangle, quad or strip of vertices around a random point, with random colors and texture coordinates
+        int type = random32() % 4;
+        int count = ((type & 1) ? 4 : 3) + ((type >= 2) ? (2 * randomRange(0, 2)) : 0);
+        int x = randomRange(-0x1400, 0x1400), y = randomRange(-0x1400, 0x1400), size = randomRange(0x80, 0x1400);
+        gpu3D->writeBeginVtxs(0xFFFFFFFF, type);
+        for (int v = 0; v < count; v++)
+        {
+            gpu3D->writeColor(0xFFFFFFFF, random32() & 0x7FFF);
+            gpu3D->writeTexCoord(0xFFFFFFFF, (randomRange(-0x2000, 0x2000) & 0xFFFF) | (randomRange(-0x2000, 0x2000) << 16));
+            int vx = x + randomRange(-size, size), vy = y + randomRange(-size, size), vz = randomRange(-0x1400, 0x1400);
+            gpu3D->writeVtx16(0xFFFFFFFF, (vx & 0xFFFF) | (vy << 16));
+            gpu3D->writeVtx16(0xFFFFFFFF, vz & 0xFFFF);
+        }
+        gpu3D->writeEndVtxs(0xFFFFFFFF, 0);
+    }
+
+    // Finish the scene and swap it in for drawing
+    gpu3D->writeSwapBuffers(0xFFFFFFFF, random32() & 3);
+    while (gpu3D->shouldRun())
+        gpu3D->runCommands(1 << 30);
+    gpu3D->swapBuffers();
+}
+
+static uint64_t runSeed(const SceneSet *set, int index)
+{
+    seed = index + 1;
+    Core *core = new Core();
+    randomVram(&core->memory);
+    randomScene(core, set);
+
+    for (int line = 0; line < 192; line++)
+        core->gpu3DRenderer.drawScanline(line);
+    for (int line = 0; line < 192; line++)
+        core->gpu3DRenderer.waitScanline(line);
+
+    // Hash the frame using 64-bit FNV-1a
+    uint64_t hash = 0xCBF29CE484222325;
+    uint8_t *data = (uint8_t*)core->gpu3DRenderer.getFramebuffer(0);
+    for (unsigned int i = 0; i < 256 * 192 * sizeof(uint16_t); i++)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001B3;
+    }
+
+    delete core;
+    return hash;
+}
+
+int main(int argc, char **argv)
+{
+    bool record = false;
+
+    // Parse the command line arguments
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-r")
+        {
+            record = true;
+            continue;
+        }
+        else if (arg == "-t" && i + 1 < argc)
+        {
+            Settings::setThreaded3D(atoi(argv[++i]));
+            continue;
+        }
+
+        fprintf(stderr, "Usage: %s [-r] [-t <threads>]\n", argv[0]);
+        fprintf(stderr, "  -r   Print the hash for each seed instead of checking it\n");
+        fprintf(stderr, "  -t   Draw with this many 3D threads, which must give the same frames\n");
+        return 1;
+    }
+
+    int failed = 0, total = 0;
+    for (size_t s = 0; s < sizeof(sets) / sizeof(sets[0]); s++)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            uint64_t hash = runSeed(&sets[s], i);
+            total++;
+
+            if (record)
+            {
+                fprintf(stdout, "%s seed %d: 0x%016llX\n", sets[s].name, i + 1, (unsigned long long)hash);
+            }
+            else if (hash != sets[s].expected[i])
+            {
+                fprintf(stdout, "3D %s seed %d: got %016llx, expected %016llx\n", sets[s].name, i + 1,
+                    (unsigned long long)hash, (unsigned long long)sets[s].expected[i]);
+                failed++;
+            }
+        }
+    }
+
+    if (!record)
+        fprintf(stdout, "3D check (%d threads): %d of %d seeds match\n", Settings::getThreaded3D(), total - failed, total);
+    return failed ? 1 : 0;
+}
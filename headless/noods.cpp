@@ -0,0 +1,176 @@
+/*
+    Copyright 2020 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <vector>
+
+#include "noods.h"
+#include "core.h"
+
+struct noods
+{
+    Core *core = nullptr;
+    std::vector<uint8_t> bios9, bios7, firmware;
+    uint32_t keys = 0;
+    bool rendering = true;
+};
+
+static int bootCore(noods_t *nds, Core *core)
+{
+    delete nds->core;
+    nds->core = core;
+    nds->keys = 0;
+    core->setRendering(nds->rendering);
+
+    if (core->cartridge.getNdsRomSize() > 0)
+        return 0;
+
+    delete nds->core;
+    nds->core = nullptr;
+    return -1;
+}
+
+noods_t *noods_create(void)
+{
+    return new noods();
+}
+
+void noods_destroy(noods_t *nds)
+{
+    if (!nds) return;
+    delete nds->core;
+    delete nds;
+}
+
+int noods_load_bios(noods_t *nds, const void *bios9, size_t bios9Size, const void *bios7, size_t bios7Size)
+{
+    if (bios9Size < 0x1000 || bios7Size < 0x4000) return -1;
+    nds->bios9.assign((const uint8_t*)bios9, (const uint8_t*)bios9 + 0x1000);
+    nds->bios7.assign((const uint8_t*)bios7, (const uint8_t*)bios7 + 0x4000);
+    return 0;
+}
+
+int noods_load_firmware(noods_t *nds, const void *data, size_t size)
+{
+    if (size < 0x40000) return -1;
+    nds->firmware.assign((const uint8_t*)data, (const uint8_t*)data + 0x40000);
+    return 0;
+}
+
+static int loadRom(noods_t *nds, const void *data, size_t size, bool copy)
+{
+    // The ROM header has to be present for the core to boot it
+    if (size < 0x200 || size > 0x7FFFFFFF) return -1;
+
+    return bootCore(nds, new Core((const uint8_t*)data, size,
+        nds->bios9.empty()    ? nullptr : &nds->bios9[0],
+        nds->bios7.empty()    ? nullptr : &nds->bios7[0],
+        nds->firmware.empty() ? nullptr : &nds->firmware[0], copy));
+}
+
+int noods_load_rom(noods_t *nds, const void *data, size_t size)
+{
+    return loadRom(nds, data, size, true);
+}
+
+int noods_load_rom_file(noods_t *nds, const char *path)
+{
+    // Read the whole ROM so it boots the same way as one given from memory
+    FILE *file = fopen(path, "rb");
+    if (!file) return -1;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    std::vector<uint8_t> rom((size > 0) ? size : 0);
+    size_t count = rom.empty() ? 0 : fread(&rom[0], sizeof(uint8_t), rom.size(), file);
+    fclose(file);
+
+    if (count != rom.size() || rom.empty()) return -1;
+    return noods_load_rom(nds, &rom[0], rom.size());
+}
+
+void noods_run_frame(noods_t *nds)
+{
+    if (nds->core) nds->core->runFrame();
+}
+
+void noods_run_cycles(noods_t *nds, int cycles)
+{
+    if (nds->core) nds->core->runCycles(cycles);
+}
+
+void noods_set_rendering(noods_t *nds, int enabled)
+{
+    nds->rendering = enabled;
+    if (nds->core) nds->core->setRendering(enabled);
+}
+
+void noods_set_keys(noods_t *nds, uint32_t keys)
+{
+    if (!nds->core) return;
+
+    // Only update the keys that changed
+    uint32_t changed = (keys ^ nds->keys) & 0xFFF;
+    for (int i = 0; i < 12; i++)
+    {
+        if (!(changed & BIT(i))) continue;
+        if (keys & BIT(i))
+            nds->core->input.pressKey(i);
+        else
+            nds->core->input.releaseKey(i);
+    }
+    nds->keys = keys;
+}
+
+void noods_set_touch(noods_t *nds, int pressed, int x, int y)
+{
+    if (!nds->core) return;
+
+    if (pressed)
+    {
+        nds->core->input.pressScreen();
+        nds->core->spi.setTouch(x, y);
+    }
+    else
+    {
+        nds->core->input.releaseScreen();
+        nds->core->spi.clearTouch();
+    }
+}
+
+const uint16_t *noods_get_framebuffer(noods_t *nds, int screen)
+{
+    if (!nds->core) return nullptr;
+
+    // The display swap bit decides which engine is shown on the top screen
+    bool engine = (nds->core->gpu.readPowCnt1() & BIT(15)) ? screen : !screen;
+    return nds->core->gpu2D[engine].getFramebuffer(0);
+}
+
+Core *noods_get_core(noods_t *nds)
+{
+    return nds->core;
+}
+
+int noods_load_rom_shared(noods_t *nds, const uint8_t *data, size_t size)
+{
+    return loadRom(nds, data, size, false);
+}
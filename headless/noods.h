@@ -0,0 +1,142 @@
+/*
+    Copyright 2020 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef NOODS_H
+#define NOODS_H
+
+// Embeddable interface to the emulator core, usable from C and C++
+// Each handle owns one core; separate handles can be driven from separate threads
+// There is no audio output, since this port doesn't run the sound mixer
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct noods noods_t;
+
+// Key bits for noods_set_keys, in the order the core's input indices use
+enum
+{
+    NOODS_KEY_A      = 1 << 0,
+    NOODS_KEY_B      = 1 << 1,
+    NOODS_KEY_SELECT = 1 << 2,
+    NOODS_KEY_START  = 1 << 3,
+    NOODS_KEY_RIGHT  = 1 << 4,
+    NOODS_KEY_LEFT   = 1 << 5,
+    NOODS_KEY_UP     = 1 << 6,
+    NOODS_KEY_DOWN   = 1 << 7,
+    NOODS_KEY_R      = 1 << 8,
+    NOODS_KEY_L      = 1 << 9,
+    NOODS_KEY_X      = 1 << 10,
+    NOODS_KEY_Y      = 1 << 11
+};
+
+// Screen size in pixels; framebuffers are 16-bit BGR555
+#define NOODS_SCREEN_WIDTH  256
+#define NOODS_SCREEN_HEIGHT 192
+
+// Create and destroy a handle
+// A new handle has no core until a ROM is loaded
+noods_t *noods_create(void);
+void noods_destroy(noods_t *nds);
+
+// Provide the BIOS and firmware from memory, copied when the next ROM is loaded
+// The ARM9 BIOS must be at least 4KB, the ARM7 BIOS 16KB and the firmware 256KB
+// Without these, the files named in the settings are used instead
+// Returns 0 on success, or -1 if a buffer is too small
+int noods_load_bios(noods_t *nds, const void *bios9, size_t bios9Size, const void *bios7, size_t bios7Size);
+int noods_load_firmware(noods_t *nds, const void *data, size_t size);
+
+// Create a fresh core and boot an NDS ROM from memory or a file, replacing any previous core
+// ROMs loaded from memory are copied and get a blank save that is never written to disk
+// Returns 0 on success, or -1 if the ROM couldn't be loaded
+int noods_load_rom(noods_t *nds, const void *data, size_t size);
+int noods_load_rom_file(noods_t *nds, const char *path);
+
+// Run the core for one frame, or for a number of ARM7 cycles (1065 per scanline, 263 scanlines per frame)
+// Stepping by cycles can stop partway through a frame, and the next step continues from there
+// A step can run slightly past the requested cycles when both CPUs halt, since the rest of that scanline is skipped
+void noods_run_frame(noods_t *nds);
+void noods_run_cycles(noods_t *nds, int cycles);
+
+// Turn rendering on or off for the following frames (on by default)
+// With rendering off, frames run at the same emulated timing but the framebuffers aren't updated
+// Turning it back on brings both screens up to date on the next frame
+void noods_set_rendering(noods_t *nds, int enabled);
+
+// Set the held keys as a mask of NOODS_KEY_* bits, and the touch screen state
+void noods_set_keys(noods_t *nds, uint32_t keys);
+void noods_set_touch(noods_t *nds, int pressed, int x, int y);
+
+// Borrow the framebuffer of a screen (0 for top, 1 for bottom), NOODS_SCREEN_WIDTH * NOODS_SCREEN_HEIGHT pixels
+// The pointer stays valid until the core is replaced or destroyed, and is updated in place as frames run
+// Returns NULL if no ROM is loaded
+const uint16_t *noods_get_framebuffer(noods_t *nds, int screen);
+
+// Batched environments
+// A pool owns several cores running the same ROM, and steps them all by one frame in parallel
+// Each environment can be reset from a boot snapshot that is taken once, when the ROM is loaded
+typedef struct noods_pool noods_pool_t;
+
+// Create a pool of environments stepped on a number of threads (0 to use every hardware thread)
+noods_pool_t *noods_pool_create(int envCount, int threadCount);
+void noods_pool_destroy(noods_pool_t *pool);
+int noods_pool_get_env_count(noods_pool_t *pool);
+
+// Use the BIOS and firmware for every environment, as with noods_load_bios and noods_load_firmware
+int noods_pool_load_bios(noods_pool_t *pool, const void *bios9, size_t bios9Size, const void *bios7, size_t bios7Size);
+int noods_pool_load_firmware(noods_pool_t *pool, const void *data, size_t size);
+
+// Boot an NDS ROM in every environment, run it for a number of warm-up frames, and snapshot that state
+// Every environment starts from the snapshot, and resets go back to it
+// The ROM is copied once and read in place by every environment
+// Returns 0 on success, or -1 if the ROM couldn't be loaded
+int noods_pool_load_rom(noods_pool_t *pool, const void *data, size_t size, int warmupFrames);
+
+// Reset the environments whose entries in the mask are non-zero back to the snapshot (all of them if the mask is NULL)
+// The snapshot is checked when the ROM is loaded, and resets are spread over the pool's threads like steps
+void noods_pool_reset(noods_pool_t *pool, const uint8_t *mask);
+
+// Set each environment's keys from an array of NOODS_KEY_* masks, run every environment for one frame,
+// and write the frames into a caller-provided buffer of envCount * 2 * (192 / scale) * (256 / scale) pixels,
+// laid out as [environment][screen][y][x] with the top screen first
+// The scale (1, 2, 4 or 8) downsamples by keeping every scale-th pixel; keys or frames can be NULL to skip them
+// Rendering is skipped entirely for steps without a frame buffer, so frames can be requested only every Nth step
+void noods_pool_step(noods_pool_t *pool, const uint32_t *keys, uint16_t *frames, int scale);
+
+// Access a single environment, for example to read its memory or set touch input
+noods_t *noods_pool_get_env(noods_pool_t *pool, int env);
+
+#ifdef __cplusplus
+}
+
+class Core;
+
+// Access the underlying core from C++, or NULL if no ROM is loaded
+Core *noods_get_core(noods_t *nds);
+
+// Boot an NDS ROM like noods_load_rom, but read it in place instead of copying it
+// The buffer must stay unchanged until the core is replaced or destroyed
+int noods_load_rom_shared(noods_t *nds, const uint8_t *data, size_t size);
+#endif
+
+#endif // NOODS_H
@@ -0,0 +1,299 @@
+/*
+    Copyright 2020 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "noods.h"
+#include "core.h"
+
+struct noods_pool
+{
+    std::vector<noods_t*> envs;
+    std::vector<std::thread> threads;
+
+    // One copy of the ROM that every environment's cartridge reads from
+    std::vector<uint8_t> rom;
+
+    // The snapshot every environment starts from and resets to
+    std::vector<uint8_t> snapshot;
+
+    // Work for the current step, shared with the worker threads
+    std::mutex mutex;
+    std::condition_variable start, finish;
+    uint64_t generation = 0;
+    int working = 0;
+    bool stopping = false;
+    std::atomic<int> next;
+
+    const uint32_t *keys = nullptr;
+    uint16_t *frames = nullptr;
+    int scale = 1;
+
+    // Set instead when the work is resetting environments rather than stepping them
+    bool resetting = false;
+    const uint8_t *resetMask = nullptr;
+};
+
+static bool saveState(Core *core, std::vector<uint8_t> &state)
+{
+    char *buffer = nullptr;
+    size_t length = 0;
+    FILE *file = open_memstream(&buffer, &length);
+    if (!file) return false;
+    bool saved = core->saveState(file);
+    fclose(file);
+
+    if (saved)
+        state.assign((uint8_t*)buffer, (uint8_t*)buffer + length);
+    free(buffer);
+    return saved;
+}
+
+static bool loadState(Core *core, std::vector<uint8_t> &state)
+{
+    if (state.empty()) return false;
+    FILE *file = fmemopen(&state[0], state.size(), "rb");
+    if (!file) return false;
+    bool loaded = core->loadState(file);
+    fclose(file);
+    return loaded;
+}
+
+static void loadSnapshot(noods_pool_t *pool, int env)
+{
+    // The snapshot was checked when it was taken, so loading it again can't fail
+    loadState(noods_get_core(pool->envs[env]), pool->snapshot);
+
+    // The state includes the keys, so forget the ones that were last set
+    noods_set_keys(pool->envs[env], 0);
+}
+
+static void stepEnv(noods_pool_t *pool, int env)
+{
+    noods_t *nds = pool->envs[env];
+    if (pool->keys) noods_set_keys(nds, pool->keys[env]);
+    noods_set_rendering(nds, pool->frames != nullptr);
+    noods_run_frame(nds);
+
+    if (!pool->frames) return;
+
+    // Copy both screens into the environment's slice of the output, keeping every scale-th pixel
+    int scale = pool->scale;
+    int width = NOODS_SCREEN_WIDTH / scale, height = NOODS_SCREEN_HEIGHT / scale;
+
+    for (int screen = 0; screen < 2; screen++)
+    {
+        const uint16_t *src = noods_get_framebuffer(nds, screen);
+        uint16_t *out = &pool->frames[(env * 2 + screen) * width * height];
+        if (!src) continue;
+
+        if (scale == 1)
+        {
+            memcpy(out, src, width * height * sizeof(uint16_t));
+            continue;
+        }
+
+        for (int y = 0; y < height; y++)
+        {
+            const uint16_t *line = &src[y * scale * NOODS_SCREEN_WIDTH];
+            for (int x = 0; x < width; x++)
+                *out++ = line[x * scale];
+        }
+    }
+}
+
+static void runWork(noods_pool_t *pool)
+{
+    // Claim environments until every one has been stepped
+    int env;
+    while ((env = pool->next++) < (int)pool->envs.size())
+    {
+        if (!pool->resetting)
+            stepEnv(pool, env);
+        else if (!pool->resetMask || pool->resetMask[env])
+            loadSnapshot(pool, env);
+    }
+}
+
+static void worker(noods_pool_t *pool)
+{
+    uint64_t generation = 0;
+
+    while (true)
+    {
+        // Wait for the next step to be posted
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->start.wait(lock, [&]{ return pool->stopping || pool->generation != generation; });
+            if (pool->stopping) return;
+            generation = pool->generation;
+        }
+
+        runWork(pool);
+
+        // Signal that this thread is done with the step
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if (--pool->working == 0)
+            pool->finish.notify_one();
+    }
+}
+
+static void postWork(noods_pool_t *pool)
+{
+    // Post the work to the worker threads
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->next = 0;
+        pool->working = pool->threads.size();
+        pool->generation++;
+    }
+    pool->start.notify_all();
+
+    // Help with the work, then wait for the other threads to finish theirs
+    runWork(pool);
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->finish.wait(lock, [&]{ return pool->working == 0; });
+}
+
+noods_pool_t *noods_pool_create(int envCount, int threadCount)
+{
+    if (envCount < 1) return nullptr;
+
+    noods_pool_t *pool = new noods_pool();
+    pool->next = 0;
+    for (int i = 0; i < envCount; i++)
+        pool->envs.push_back(noods_create());
+
+    // The calling thread also steps environments, so it counts as one of the threads
+    if (threadCount <= 0) threadCount = std::thread::hardware_concurrency();
+    if (threadCount > envCount) threadCount = envCount;
+    for (int i = 1; i < threadCount; i++)
+        pool->threads.push_back(std::thread(worker, pool));
+
+    return pool;
+}
+
+void noods_pool_destroy(noods_pool_t *pool)
+{
+    if (!pool) return;
+
+    // Stop the worker threads
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->stopping = true;
+    }
+    pool->start.notify_all();
+    for (unsigned int i = 0; i < pool->threads.size(); i++)
+        pool->threads[i].join();
+
+    for (unsigned int i = 0; i < pool->envs.size(); i++)
+        noods_destroy(pool->envs[i]);
+    delete pool;
+}
+
+int noods_pool_get_env_count(noods_pool_t *pool)
+{
+    return pool->envs.size();
+}
+
+int noods_pool_load_bios(noods_pool_t *pool, const void *bios9, size_t bios9Size, const void *bios7, size_t bios7Size)
+{
+    for (unsigned int i = 0; i < pool->envs.size(); i++)
+    {
+        if (noods_load_bios(pool->envs[i], bios9, bios9Size, bios7, bios7Size) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int noods_pool_load_firmware(noods_pool_t *pool, const void *data, size_t size)
+{
+    for (unsigned int i = 0; i < pool->envs.size(); i++)
+    {
+        if (noods_load_firmware(pool->envs[i], data, size) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int noods_pool_load_rom(noods_pool_t *pool, const void *data, size_t size, int warmupFrames)
+{
+    pool->snapshot.clear();
+
+    // Copy the ROM once and boot it in every environment, with each cartridge reading the shared copy
+    // Every environment boots the same data, so the rest can't fail once the first has succeeded
+    // The old copy is only released after every core that read from it has been replaced
+    std::vector<uint8_t> rom((const uint8_t*)data, (const uint8_t*)data + size);
+    if (rom.empty() || noods_load_rom_shared(pool->envs[0], &rom[0], rom.size()) != 0)
+        return -1;
+    for (unsigned int i = 1; i < pool->envs.size(); i++)
+        noods_load_rom_shared(pool->envs[i], &rom[0], rom.size());
+    pool->rom.swap(rom);
+
+    // Warm up the first environment and take the snapshot from it
+    // Loading it back into the same environment checks it once, so resets don't have to
+    for (int i = 0; i < warmupFrames; i++)
+        noods_run_frame(pool->envs[0]);
+    Core *core = noods_get_core(pool->envs[0]);
+    if (!saveState(core, pool->snapshot) || !loadState(core, pool->snapshot))
+    {
+        pool->snapshot.clear();
+        return -1;
+    }
+
+    // Start every environment from the snapshot
+    noods_pool_reset(pool, nullptr);
+    return 0;
+}
+
+void noods_pool_reset(noods_pool_t *pool, const uint8_t *mask)
+{
+    if (pool->snapshot.empty()) return;
+
+    // Load the snapshot into the masked environments on the worker threads
+    pool->resetting = true;
+    pool->resetMask = mask;
+    postWork(pool);
+}
+
+void noods_pool_step(noods_pool_t *pool, const uint32_t *keys, uint16_t *frames, int scale)
+{
+    if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+        return;
+
+    // Step every environment on the worker threads
+    pool->resetting = false;
+    pool->keys = keys;
+    pool->frames = frames;
+    pool->scale = scale;
+    postWork(pool);
+}
+
+noods_t *noods_pool_get_env(noods_pool_t *pool, int env)
+{
+    if (env < 0 || env >= (int)pool->envs.size()) return nullptr;
+    return pool->envs[env];
+}
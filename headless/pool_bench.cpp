@@ -0,0 +1,130 @@
+/*
+    Copyright 2020 Hydr8gon
+
+    This file is part of NooDS.
+
+    NooDS is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NooDS is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NooDS. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Batched environment benchmark
+// Steps a pool of environments running the same ROM with random input, and reports environment-steps per second
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "noods.h"
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options] rom.nds\n", name);
+    fprintf(stderr, "  -n <envs>     Number of environments (default 16)\n");
+    fprintf(stderr, "  -j <threads>  Number of threads (default: hardware threads)\n");
+    fprintf(stderr, "  -f <steps>    Number of steps to run (default 300)\n");
+    fprintf(stderr, "  -s <scale>    Frame downsampling factor: 1, 2, 4 or 8 (default 2)\n");
+    fprintf(stderr, "  -w <frames>   Warm-up frames before the boot snapshot (default 0)\n");
+    fprintf(stderr, "  -r <steps>    Reset every environment after this many steps (default: never)\n");
+    fprintf(stderr, "  -v <steps>    Only request frames every this many steps (default 1)\n");
+}
+
+int main(int argc, char **argv)
+{
+    int envs = 16, threads = 0, steps = 300, scale = 2, warmup = 0, resetSteps = 0, renderSteps = 1;
+    std::string rom;
+
+    // Parse the command line arguments
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.size() == 2 && arg[0] == '-' && i + 1 < argc)
+        {
+            int value = atoi(argv[++i]);
+            switch (arg[1])
+            {
+                case 'n': envs       = value; continue;
+                case 'j': threads    = value; continue;
+                case 'f': steps      = value; continue;
+                case 's': scale      = value; continue;
+                case 'w': warmup     = value; continue;
+                case 'r': resetSteps = value; continue;
+                case 'v': renderSteps = value; continue;
+            }
+        }
+        else if (arg[0] != '-' && rom.empty())
+        {
+            rom = arg;
+            continue;
+        }
+
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (rom.empty() || envs < 1 || (scale != 1 && scale != 2 && scale != 4 && scale != 8))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Read the ROM
+    FILE *file = fopen(rom.c_str(), "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Failed to open ROM: %s\n", rom.c_str());
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    std::vector<uint8_t> data(ftell(file));
+    fseek(file, 0, SEEK_SET);
+    size_t size = data.empty() ? 0 : fread(&data[0], sizeof(uint8_t), data.size(), file);
+    fclose(file);
+
+    noods_pool_t *pool = noods_pool_create(envs, threads);
+    if (size != data.size() || noods_pool_load_rom(pool, &data[0], data.size(), warmup) != 0)
+    {
+        fprintf(stderr, "Failed to load ROM: %s\n", rom.c_str());
+        noods_pool_destroy(pool);
+        return 1;
+    }
+
+    // Allocate the input and output once, as a training loop would
+    std::vector<uint32_t> keys(envs);
+    std::vector<uint16_t> frames(envs * 2 * (NOODS_SCREEN_WIDTH / scale) * (NOODS_SCREEN_HEIGHT / scale));
+    uint32_t random = 1;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < steps; i++)
+    {
+        for (int j = 0; j < envs; j++)
+        {
+            random = random * 1103515245 + 12345;
+            keys[j] = (random >> 16) & 0xFFF;
+        }
+
+        bool render = (renderSteps <= 1 || i % renderSteps == renderSteps - 1);
+        noods_pool_step(pool, &keys[0], render ? &frames[0] : nullptr, scale);
+
+        if (resetSteps > 0 && (i + 1) % resetSteps == 0)
+            noods_pool_reset(pool, nullptr);
+    }
+    std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+
+    fprintf(stdout, "%d environments, %d steps in %.3f seconds: %.1f environment-steps per second\n",
+        envs, steps, time.count(), envs * steps / time.count());
+
+    noods_pool_destroy(pool);
+    return 0;
+}
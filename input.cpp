@@ -49,3 +49,17 @@ void Input::releaseScreen()
     // Set the pen down bit to indicate a touch release
     extKeyIn |= BIT(6);
 }
+
+void Input::saveState(FILE *file)
+{
+    // Write the state to a file
+    fwrite(&keyInput, sizeof(keyInput), 1, file);
+    fwrite(&extKeyIn, sizeof(extKeyIn), 1, file);
+}
+
+void Input::loadState(FILE *file)
+{
+    // Read the state from a file
+    fread(&keyInput, sizeof(keyInput), 1, file);
+    fread(&extKeyIn, sizeof(extKeyIn), 1, file);
+}
@@ -21,6 +21,7 @@
 #define INPUT_H
 
 #include <cstdint>
+#include <cstdio>
 
 class Core;
 
@@ -29,6 +30,9 @@ class Input
     public:
         Input(Core *core): core(core) {}
 
+        void saveState(FILE *file);
+        void loadState(FILE *file);
+
         void pressKey(int key);
         void releaseKey(int key);
         void pressScreen();
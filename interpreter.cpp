@@ -2593,3 +2593,67 @@ void Interpreter::writePostFlg(uint8_t value)
     postFlg |= value & 0x01;
     if (cpu == 0) postFlg = (postFlg & ~0x02) | (value & 0x02);
 }
+
+void Interpreter::saveState(FILE *file)
+{
+    // Write the state to a file
+    fwrite(registersUsr, sizeof(registersUsr), 1, file);
+    fwrite(registersFiq, sizeof(registersFiq), 1, file);
+    fwrite(registersSvc, sizeof(registersSvc), 1, file);
+    fwrite(registersAbt, sizeof(registersAbt), 1, file);
+    fwrite(registersIrq, sizeof(registersIrq), 1, file);
+    fwrite(registersUnd, sizeof(registersUnd), 1, file);
+    fwrite(&cpsr, sizeof(cpsr), 1, file);
+    fwrite(&spsrFiq, sizeof(spsrFiq), 1, file);
+    fwrite(&spsrSvc, sizeof(spsrSvc), 1, file);
+    fwrite(&spsrAbt, sizeof(spsrAbt), 1, file);
+    fwrite(&spsrIrq, sizeof(spsrIrq), 1, file);
+    fwrite(&spsrUnd, sizeof(spsrUnd), 1, file);
+    fwrite(&halted, sizeof(halted), 1, file);
+    fwrite(&ime, sizeof(ime), 1, file);
+    fwrite(&ie, sizeof(ie), 1, file);
+    fwrite(&irf, sizeof(irf), 1, file);
+    fwrite(&postFlg, sizeof(postFlg), 1, file);
+
+    // Write the register bank pointers as offsets, since the CPSR mode doesn't always match them
+    for (int i = 0; i < 16; i++)
+    {
+        int32_t offset = (uint8_t*)registers[i] - (uint8_t*)this;
+        fwrite(&offset, sizeof(offset), 1, file);
+    }
+    int32_t offset = spsr ? ((uint8_t*)spsr - (uint8_t*)this) : -1;
+    fwrite(&offset, sizeof(offset), 1, file);
+}
+
+void Interpreter::loadState(FILE *file)
+{
+    // Read the state from a file
+    fread(registersUsr, sizeof(registersUsr), 1, file);
+    fread(registersFiq, sizeof(registersFiq), 1, file);
+    fread(registersSvc, sizeof(registersSvc), 1, file);
+    fread(registersAbt, sizeof(registersAbt), 1, file);
+    fread(registersIrq, sizeof(registersIrq), 1, file);
+    fread(registersUnd, sizeof(registersUnd), 1, file);
+    fread(&cpsr, sizeof(cpsr), 1, file);
+    fread(&spsrFiq, sizeof(spsrFiq), 1, file);
+    fread(&spsrSvc, sizeof(spsrSvc), 1, file);
+    fread(&spsrAbt, sizeof(spsrAbt), 1, file);
+    fread(&spsrIrq, sizeof(spsrIrq), 1, file);
+    fread(&spsrUnd, sizeof(spsrUnd), 1, file);
+    fread(&halted, sizeof(halted), 1, file);
+    fread(&ime, sizeof(ime), 1, file);
+    fread(&ie, sizeof(ie), 1, file);
+    fread(&irf, sizeof(irf), 1, file);
+    fread(&postFlg, sizeof(postFlg), 1, file);
+
+    // Point the registers back into this interpreter's banks
+    for (int i = 0; i < 16; i++)
+    {
+        int32_t offset = 0;
+        fread(&offset, sizeof(offset), 1, file);
+        registers[i] = (uint32_t*)((uint8_t*)this + offset);
+    }
+    int32_t offset = -1;
+    fread(&offset, sizeof(offset), 1, file);
+    spsr = (offset < 0) ? nullptr : (uint32_t*)((uint8_t*)this + offset);
+}
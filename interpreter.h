@@ -21,6 +21,7 @@
 #define INTERPRETER_H
 
 #include <cstdint>
+#include <cstdio>
 
 #include "defines.h"
 
@@ -31,6 +32,9 @@ class Interpreter
     public:
         Interpreter(Core *core, bool cpu);
 
+        void saveState(FILE *file);
+        void loadState(FILE *file);
+
         void directBoot();
         void enterGbaMode();
 
@@ -40,6 +44,7 @@ class Interpreter
         void sendInterrupt(int bit);
 
         bool shouldRun() { return !halted;  }
+        uint32_t getPc() { return *registers[15]; }
 
         uint8_t  readIme()     { return ime;     }
         uint32_t readIe()      { return ie;      }
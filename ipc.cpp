@@ -143,3 +143,39 @@ uint32_t Ipc::readIpcFifoRecv(bool cpu)
 
     return ipcFifoRecv[cpu];
 }
+
+void Ipc::saveState(FILE *file)
+{
+    // Write the state to a file
+    fwrite(ipcSync, sizeof(ipcSync), 1, file);
+    fwrite(ipcFifoCnt, sizeof(ipcFifoCnt), 1, file);
+    fwrite(ipcFifoRecv, sizeof(ipcFifoRecv), 1, file);
+
+    // Write the FIFO contents, oldest first
+    for (int i = 0; i < 2; i++)
+    {
+        std::queue<uint32_t> fifo = fifos[i];
+        uint32_t size = fifo.size();
+        fwrite(&size, sizeof(size), 1, file);
+        for (; !fifo.empty(); fifo.pop())
+            fwrite(&fifo.front(), sizeof(uint32_t), 1, file);
+    }
+}
+
+void Ipc::loadState(FILE *file)
+{
+    // Read the state from a file
+    fread(ipcSync, sizeof(ipcSync), 1, file);
+    fread(ipcFifoCnt, sizeof(ipcFifoCnt), 1, file);
+    fread(ipcFifoRecv, sizeof(ipcFifoRecv), 1, file);
+
+    // Read the FIFO contents
+    for (int i = 0; i < 2; i++)
+    {
+        uint32_t size = 0, value;
+        fread(&size, sizeof(size), 1, file);
+        fifos[i] = std::queue<uint32_t>();
+        for (uint32_t j = 0; j < size && fread(&value, sizeof(value), 1, file); j++)
+            fifos[i].push(value);
+    }
+}
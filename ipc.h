@@ -21,6 +21,7 @@
 #define IPC_H
 
 #include <cstdint>
+#include <cstdio>
 #include <queue>
 
 class Core;
@@ -30,6 +31,9 @@ class Ipc
     public:
         Ipc(Core *core): core(core) {}
 
+        void saveState(FILE *file);
+        void loadState(FILE *file);
+
         uint16_t readIpcSync(bool cpu)    { return ipcSync[cpu];    }
         uint16_t readIpcFifoCnt(bool cpu) { return ipcFifoCnt[cpu]; }
         uint32_t readIpcFifoRecv(bool cpu);
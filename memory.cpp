@@ -38,6 +38,13 @@ void Memory::loadBios()
     fclose(bios7File);
 }
 
+void Memory::loadBios(const uint8_t *bios9Data, const uint8_t *bios7Data)
+{
+    // Load the ARM9 and ARM7 BIOS from buffers
+    memcpy(bios9, bios9Data, 0x1000);
+    memcpy(bios7, bios7Data, 0x4000);
+}
+
 void Memory::loadGbaBios()
 {
     // Attempt to load the GBA BIOS
@@ -293,6 +300,7 @@ template <typename T> void Memory::write(bool cpu, uint32_t address, T value)
                 case 0x05000000: // Palettes
                 {
                     data = &palette[address & 0x7FF];
+                    paletteVersion++;
                     break;
                 }
 
@@ -306,13 +314,18 @@ template <typename T> void Memory::write(bool cpu, uint32_t address, T value)
                         case 0x06600000: data = engBObj[(address & 0x1FFFF) >> 14]; break;
                         default:         data =    lcdc[(address & 0xFFFFF) >> 14]; break;
                     }
-                    if (data) data += (address & 0x3FFF);
+                    if (data)
+                    {
+                        data += (address & 0x3FFF);
+                        vramVersion[(data - vramA) >> 14]++;
+                    }
                     break;
                 }
 
                 case 0x07000000: // OAM
                 {
                     data = &oam[address & 0x7FF];
+                    oamVersion++;
                     break;
                 }
 
@@ -379,7 +392,11 @@ template <typename T> void Memory::write(bool cpu, uint32_t address, T value)
             case 0x06000000: // VRAM
             {
                 data = vram7[(address & 0x3FFFF) >> 17];
-                if (data) data += (address & 0x1FFFF);
+                if (data)
+                {
+                    data += (address & 0x1FFFF);
+                    vramVersion[(data - vramA) >> 14]++;
+                }
                 break;
             }
 
@@ -2883,3 +2900,65 @@ void Memory::writeGbaHaltCnt(uint8_t value)
     if (value & BIT(7)) // Stop
         printf("Unhandled request for stop mode\n");
 }
+
+void Memory::saveState(FILE *file)
+{
+    // Write the state to a file
+    // The BIOS isn't included, since it's loaded with the core
+    fwrite(ram, sizeof(ram), 1, file);
+    fwrite(wram, sizeof(wram), 1, file);
+    fwrite(instrTcm, sizeof(instrTcm), 1, file);
+    fwrite(dataTcm, sizeof(dataTcm), 1, file);
+    fwrite(wram7, sizeof(wram7), 1, file);
+    fwrite(wifiRam, sizeof(wifiRam), 1, file);
+    fwrite(palette, sizeof(palette), 1, file);
+    fwrite(vramA, sizeof(vramA), 1, file);
+    fwrite(vramB, sizeof(vramB), 1, file);
+    fwrite(vramC, sizeof(vramC), 1, file);
+    fwrite(vramD, sizeof(vramD), 1, file);
+    fwrite(vramE, sizeof(vramE), 1, file);
+    fwrite(vramF, sizeof(vramF), 1, file);
+    fwrite(vramG, sizeof(vramG), 1, file);
+    fwrite(vramH, sizeof(vramH), 1, file);
+    fwrite(vramI, sizeof(vramI), 1, file);
+    fwrite(oam, sizeof(oam), 1, file);
+    fwrite(dmaFill, sizeof(dmaFill), 1, file);
+    fwrite(vramCnt, sizeof(vramCnt), 1, file);
+    fwrite(&wramCnt, sizeof(wramCnt), 1, file);
+    fwrite(&haltCnt, sizeof(haltCnt), 1, file);
+}
+
+void Memory::loadState(FILE *file)
+{
+    // Read the state from a file
+    fread(ram, sizeof(ram), 1, file);
+    fread(wram, sizeof(wram), 1, file);
+    fread(instrTcm, sizeof(instrTcm), 1, file);
+    fread(dataTcm, sizeof(dataTcm), 1, file);
+    fread(wram7, sizeof(wram7), 1, file);
+    fread(wifiRam, sizeof(wifiRam), 1, file);
+    fread(palette, sizeof(palette), 1, file);
+    fread(vramA, sizeof(vramA), 1, file);
+    fread(vramB, sizeof(vramB), 1, file);
+    fread(vramC, sizeof(vramC), 1, file);
+    fread(vramD, sizeof(vramD), 1, file);
+    fread(vramE, sizeof(vramE), 1, file);
+    fread(vramF, sizeof(vramF), 1, file);
+    fread(vramG, sizeof(vramG), 1, file);
+    fread(vramH, sizeof(vramH), 1, file);
+    fread(vramI, sizeof(vramI), 1, file);
+    fread(oam, sizeof(oam), 1, file);
+    fread(dmaFill, sizeof(dmaFill), 1, file);
+    fread(vramCnt, sizeof(vramCnt), 1, file);
+    fread(&wramCnt, sizeof(wramCnt), 1, file);
+    fread(&haltCnt, sizeof(haltCnt), 1, file);
+
+    // Rebuild the VRAM mappings, which also recalculates VRAMSTAT
+    writeVramCnt(0, vramCnt[0]);
+
+    // Everything in VRAM, the palettes and OAM may have changed
+    for (int i = 0; i < 41; i++)
+        vramVersion[i]++;
+    paletteVersion++;
+    oamVersion++;
+}
@@ -21,6 +21,7 @@
 #define MEMORY_H
 
 #include <cstdint>
+#include <cstdio>
 
 class Core;
 
@@ -29,19 +30,36 @@ class Memory
     public:
         Memory(Core *core): core(core) {};
 
+        void saveState(FILE *file);
+        void loadState(FILE *file);
+
         void loadBios();
+        void loadBios(const uint8_t *bios9Data, const uint8_t *bios7Data);
         void loadGbaBios();
 
         template <typename T> T read(bool cpu, uint32_t address);
         template <typename T> void write(bool cpu, uint32_t address, T value);
 
+        uint8_t  *getBios9()      { return bios9;      }
+        uint8_t  *getBios7()      { return bios7;      }
         uint8_t  *getPalette()    { return palette;    }
         uint8_t  *getOam()        { return oam;        }
+        uint8_t **getLcdc()       { return lcdc;       }
+        uint8_t **getEngABg()     { return engABg;     }
+        uint8_t **getEngBBg()     { return engBBg;     }
+        uint8_t **getEngAObj()    { return engAObj;    }
+        uint8_t **getEngBObj()    { return engBObj;    }
         uint8_t **getEngAExtPal() { return engAExtPal; }
         uint8_t **getEngBExtPal() { return engBExtPal; }
         uint8_t **getTex3D()      { return tex3D;      }
         uint8_t **getPal3D()      { return pal3D;      }
 
+        // Versions that change whenever a 16KB VRAM page or the palettes are written, for caching decoded data
+        // The VRAM blocks are laid out back to back, so a pointer into any of them identifies its page
+        uint32_t getVramVersion(const uint8_t *data) { return vramVersion[(data - vramA) >> 14]; }
+        uint32_t getPaletteVersion()                 { return paletteVersion;                   }
+        uint32_t getOamVersion()                     { return oamVersion;                       }
+
     private:
         Core *core;
 
@@ -68,6 +86,10 @@ class Memory
         uint8_t vramI[0x4000]  = {}; //  16KB VRAM block I
         uint8_t oam[0x800]     = {}; //   2KB OAM
 
+        uint32_t vramVersion[41] = {};
+        uint32_t paletteVersion = 0;
+        uint32_t oamVersion = 0;
+
         uint8_t *lcdc[64]      = {};
         uint8_t *engABg[32]    = {};
         uint8_t *engAObj[16]   = {};
@@ -171,4 +171,24 @@ void Rtc::writeRtc(uint8_t value)
     }
 
     rtc = value;
-}
\ No newline at end of file
+}
+
+void Rtc::saveState(FILE *file)
+{
+    // Write the state to a file
+    fwrite(&writeCount, sizeof(writeCount), 1, file);
+    fwrite(&command, sizeof(command), 1, file);
+    fwrite(&status1, sizeof(status1), 1, file);
+    fwrite(dateTime, sizeof(dateTime), 1, file);
+    fwrite(&rtc, sizeof(rtc), 1, file);
+}
+
+void Rtc::loadState(FILE *file)
+{
+    // Read the state from a file
+    fread(&writeCount, sizeof(writeCount), 1, file);
+    fread(&command, sizeof(command), 1, file);
+    fread(&status1, sizeof(status1), 1, file);
+    fread(dateTime, sizeof(dateTime), 1, file);
+    fread(&rtc, sizeof(rtc), 1, file);
+}
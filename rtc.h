@@ -21,6 +21,7 @@
 #define RTC_H
 
 #include <cstdint>
+#include <cstdio>
 
 class Core;
 
@@ -29,6 +30,9 @@ class Rtc
     public:
         Rtc(Core *core): core(core) {}
 
+        void saveState(FILE *file);
+        void loadState(FILE *file);
+
         uint8_t readRtc() { return rtc; }
 
         void writeRtc(uint8_t value);
@@ -25,6 +25,7 @@
 bool Settings::loaded = false;
 
 int Settings::directBoot = 1;
+int Settings::fastBoot = 1;
 int Settings::fpsLimiter = 0;
 int Settings::threaded2D = 0;
 int Settings::threaded3D = 0;
@@ -36,6 +37,7 @@ std::string Settings::gbaBiosPath = "gba_bios.bin";
 std::vector<Setting> Settings::settings =
 {
     Setting("directBoot",   &directBoot,   false),
+    Setting("fastBoot",     &fastBoot,     false),
     Setting("fpsLimiter",   &fpsLimiter,   false),
     Setting("threaded2D",   &threaded2D,   false),
     Setting("threaded3D",   &threaded3D,   false),
@@ -40,6 +40,7 @@ class Settings
         static bool save(std::string filename = "noods.ini");
 
         static int         getDirectBoot()   { return directBoot;   }
+        static int         getFastBoot()     { return fastBoot;     }
         static int         getFpsLimiter()   { return fpsLimiter;   }
         static int         getThreaded2D()   { return threaded2D;   }
         static int         getThreaded3D()   { return threaded3D;   }
@@ -49,6 +50,7 @@ class Settings
         static std::string getGbaBiosPath()  { return gbaBiosPath;  }
 
         static void setDirectBoot(int value)           { directBoot   = value; }
+        static void setFastBoot(int value)             { fastBoot     = value; }
         static void setFpsLimiter(int value)           { fpsLimiter   = value; }
         static void setThreaded2D(int value)           { threaded2D   = value; }
         static void setThreaded3D(int value)           { threaded3D   = value; }
@@ -63,6 +65,7 @@ class Settings
         static bool loaded;
 
         static int directBoot;
+        static int fastBoot;
         static int fpsLimiter;
         static int threaded2D;
         static int threaded3D;
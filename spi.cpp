@@ -17,6 +17,8 @@
     along with NooDS. If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <cstring>
+
 #include "spi.h"
 #include "core.h"
 #include "settings.h"
@@ -30,6 +32,12 @@ void Spi::loadFirmware()
     fclose(firmwareFile);
 }
 
+void Spi::loadFirmware(const uint8_t *data)
+{
+    // Load the firmware from a buffer
+    memcpy(firmware, data, 0x40000);
+}
+
 void Spi::directBoot()
 {
     // Load the user settings into memory
@@ -174,3 +182,27 @@ void Spi::writeSpiData(uint8_t value)
     if (spiCnt & BIT(14))
         core->interpreter[1].sendInterrupt(23);
 }
+
+void Spi::saveState(FILE *file)
+{
+    // Write the state to a file
+    fwrite(&writeCount, sizeof(writeCount), 1, file);
+    fwrite(&address, sizeof(address), 1, file);
+    fwrite(&command, sizeof(command), 1, file);
+    fwrite(&touchX, sizeof(touchX), 1, file);
+    fwrite(&touchY, sizeof(touchY), 1, file);
+    fwrite(&spiCnt, sizeof(spiCnt), 1, file);
+    fwrite(&spiData, sizeof(spiData), 1, file);
+}
+
+void Spi::loadState(FILE *file)
+{
+    // Read the state from a file
+    fread(&writeCount, sizeof(writeCount), 1, file);
+    fread(&address, sizeof(address), 1, file);
+    fread(&command, sizeof(command), 1, file);
+    fread(&touchX, sizeof(touchX), 1, file);
+    fread(&touchY, sizeof(touchY), 1, file);
+    fread(&spiCnt, sizeof(spiCnt), 1, file);
+    fread(&spiData, sizeof(spiData), 1, file);
+}
@@ -21,6 +21,7 @@
 #define SPI_H
 
 #include <cstdint>
+#include <cstdio>
 
 class Core;
 
@@ -29,9 +30,15 @@ class Spi
     public:
         Spi(Core *core): core(core) {}
 
+        void saveState(FILE *file);
+        void loadState(FILE *file);
+
         void loadFirmware();
+        void loadFirmware(const uint8_t *data);
         void directBoot();
 
+        uint8_t *getFirmware() { return firmware; }
+
         void setTouch(int x, int y);
         void clearTouch();
 
@@ -1058,3 +1058,114 @@ uint8_t Spu::readGbaWaveRam(int index)
     // Read from the currently inactive GBA wave RAM bank
     return 0; //gbaWaveRam[!(gbaSoundCntL[1] & BIT(6))][index];
 }
+
+void Spu::saveState(FILE *file)
+{
+    // Write the state to a file
+    // The sample buffers aren't included, since they only hold output waiting to be played
+    fwrite(&gbaFrameSequencer, sizeof(gbaFrameSequencer), 1, file);
+    fwrite(gbaSoundTimers, sizeof(gbaSoundTimers), 1, file);
+    fwrite(gbaEnvelopes, sizeof(gbaEnvelopes), 1, file);
+    fwrite(gbaEnvTimers, sizeof(gbaEnvTimers), 1, file);
+    fwrite(&gbaSweepTimer, sizeof(gbaSweepTimer), 1, file);
+    fwrite(&gbaWaveDigit, sizeof(gbaWaveDigit), 1, file);
+    fwrite(&gbaNoiseValue, sizeof(gbaNoiseValue), 1, file);
+    fwrite(gbaWaveRam, sizeof(gbaWaveRam), 1, file);
+    fwrite(&gbaSampleA, sizeof(gbaSampleA), 1, file);
+    fwrite(&gbaSampleB, sizeof(gbaSampleB), 1, file);
+    fwrite(&enabled, sizeof(enabled), 1, file);
+    fwrite(adpcmValue, sizeof(adpcmValue), 1, file);
+    fwrite(adpcmLoopValue, sizeof(adpcmLoopValue), 1, file);
+    fwrite(adpcmIndex, sizeof(adpcmIndex), 1, file);
+    fwrite(adpcmLoopIndex, sizeof(adpcmLoopIndex), 1, file);
+    fwrite(adpcmToggle, sizeof(adpcmToggle), 1, file);
+    fwrite(dutyCycles, sizeof(dutyCycles), 1, file);
+    fwrite(noiseValues, sizeof(noiseValues), 1, file);
+    fwrite(soundCurrent, sizeof(soundCurrent), 1, file);
+    fwrite(soundTimers, sizeof(soundTimers), 1, file);
+    fwrite(sndCapCurrent, sizeof(sndCapCurrent), 1, file);
+    fwrite(sndCapTimers, sizeof(sndCapTimers), 1, file);
+    fwrite(gbaSoundCntL, sizeof(gbaSoundCntL), 1, file);
+    fwrite(gbaSoundCntH, sizeof(gbaSoundCntH), 1, file);
+    fwrite(gbaSoundCntX, sizeof(gbaSoundCntX), 1, file);
+    fwrite(&gbaMainSoundCntL, sizeof(gbaMainSoundCntL), 1, file);
+    fwrite(&gbaMainSoundCntH, sizeof(gbaMainSoundCntH), 1, file);
+    fwrite(&gbaMainSoundCntX, sizeof(gbaMainSoundCntX), 1, file);
+    fwrite(&gbaSoundBias, sizeof(gbaSoundBias), 1, file);
+    fwrite(soundCnt, sizeof(soundCnt), 1, file);
+    fwrite(soundSad, sizeof(soundSad), 1, file);
+    fwrite(soundTmr, sizeof(soundTmr), 1, file);
+    fwrite(soundPnt, sizeof(soundPnt), 1, file);
+    fwrite(soundLen, sizeof(soundLen), 1, file);
+    fwrite(&mainSoundCnt, sizeof(mainSoundCnt), 1, file);
+    fwrite(&soundBias, sizeof(soundBias), 1, file);
+    fwrite(sndCapCnt, sizeof(sndCapCnt), 1, file);
+    fwrite(sndCapDad, sizeof(sndCapDad), 1, file);
+    fwrite(sndCapLen, sizeof(sndCapLen), 1, file);
+
+    // Write the GBA FIFO contents, oldest first
+    for (int i = 0; i < 2; i++)
+    {
+        std::queue<int8_t> fifo = i ? gbaFifoB : gbaFifoA;
+        uint32_t size = fifo.size();
+        fwrite(&size, sizeof(size), 1, file);
+        for (; !fifo.empty(); fifo.pop())
+            fwrite(&fifo.front(), sizeof(int8_t), 1, file);
+    }
+}
+
+void Spu::loadState(FILE *file)
+{
+    // Read the state from a file
+    fread(&gbaFrameSequencer, sizeof(gbaFrameSequencer), 1, file);
+    fread(gbaSoundTimers, sizeof(gbaSoundTimers), 1, file);
+    fread(gbaEnvelopes, sizeof(gbaEnvelopes), 1, file);
+    fread(gbaEnvTimers, sizeof(gbaEnvTimers), 1, file);
+    fread(&gbaSweepTimer, sizeof(gbaSweepTimer), 1, file);
+    fread(&gbaWaveDigit, sizeof(gbaWaveDigit), 1, file);
+    fread(&gbaNoiseValue, sizeof(gbaNoiseValue), 1, file);
+    fread(gbaWaveRam, sizeof(gbaWaveRam), 1, file);
+    fread(&gbaSampleA, sizeof(gbaSampleA), 1, file);
+    fread(&gbaSampleB, sizeof(gbaSampleB), 1, file);
+    fread(&enabled, sizeof(enabled), 1, file);
+    fread(adpcmValue, sizeof(adpcmValue), 1, file);
+    fread(adpcmLoopValue, sizeof(adpcmLoopValue), 1, file);
+    fread(adpcmIndex, sizeof(adpcmIndex), 1, file);
+    fread(adpcmLoopIndex, sizeof(adpcmLoopIndex), 1, file);
+    fread(adpcmToggle, sizeof(adpcmToggle), 1, file);
+    fread(dutyCycles, sizeof(dutyCycles), 1, file);
+    fread(noiseValues, sizeof(noiseValues), 1, file);
+    fread(soundCurrent, sizeof(soundCurrent), 1, file);
+    fread(soundTimers, sizeof(soundTimers), 1, file);
+    fread(sndCapCurrent, sizeof(sndCapCurrent), 1, file);
+    fread(sndCapTimers, sizeof(sndCapTimers), 1, file);
+    fread(gbaSoundCntL, sizeof(gbaSoundCntL), 1, file);
+    fread(gbaSoundCntH, sizeof(gbaSoundCntH), 1, file);
+    fread(gbaSoundCntX, sizeof(gbaSoundCntX), 1, file);
+    fread(&gbaMainSoundCntL, sizeof(gbaMainSoundCntL), 1, file);
+    fread(&gbaMainSoundCntH, sizeof(gbaMainSoundCntH), 1, file);
+    fread(&gbaMainSoundCntX, sizeof(gbaMainSoundCntX), 1, file);
+    fread(&gbaSoundBias, sizeof(gbaSoundBias), 1, file);
+    fread(soundCnt, sizeof(soundCnt), 1, file);
+    fread(soundSad, sizeof(soundSad), 1, file);
+    fread(soundTmr, sizeof(soundTmr), 1, file);
+    fread(soundPnt, sizeof(soundPnt), 1, file);
+    fread(soundLen, sizeof(soundLen), 1, file);
+    fread(&mainSoundCnt, sizeof(mainSoundCnt), 1, file);
+    fread(&soundBias, sizeof(soundBias), 1, file);
+    fread(sndCapCnt, sizeof(sndCapCnt), 1, file);
+    fread(sndCapDad, sizeof(sndCapDad), 1, file);
+    fread(sndCapLen, sizeof(sndCapLen), 1, file);
+
+    // Read the GBA FIFO contents
+    for (int i = 0; i < 2; i++)
+    {
+        std::queue<int8_t> *fifo = i ? &gbaFifoB : &gbaFifoA;
+        *fifo = std::queue<int8_t>();
+        uint32_t size = 0;
+        int8_t value;
+        fread(&size, sizeof(size), 1, file);
+        for (uint32_t j = 0; j < size && fread(&value, sizeof(value), 1, file); j++)
+            fifo->push(value);
+    }
+}
@@ -110,3 +110,25 @@ uint16_t Timers::readTmCntL(int timer)
     // Read the current timer value, shifted to remove the prescaler fraction
     return timers[timer] >> shifts[timer];
 }
+
+void Timers::saveState(FILE *file)
+{
+    // Write the state to a file
+    fwrite(&enabled, sizeof(enabled), 1, file);
+    fwrite(timers, sizeof(timers), 1, file);
+    fwrite(masks, sizeof(masks), 1, file);
+    fwrite(shifts, sizeof(shifts), 1, file);
+    fwrite(tmCntL, sizeof(tmCntL), 1, file);
+    fwrite(tmCntH, sizeof(tmCntH), 1, file);
+}
+
+void Timers::loadState(FILE *file)
+{
+    // Read the state from a file
+    fread(&enabled, sizeof(enabled), 1, file);
+    fread(timers, sizeof(timers), 1, file);
+    fread(masks, sizeof(masks), 1, file);
+    fread(shifts, sizeof(shifts), 1, file);
+    fread(tmCntL, sizeof(tmCntL), 1, file);
+    fread(tmCntH, sizeof(tmCntH), 1, file);
+}
@@ -21,6 +21,7 @@
 #define TIMERS_H
 
 #include <cstdint>
+#include <cstdio>
 
 class Core;
 
@@ -29,6 +30,9 @@ class Timers
     public:
         Timers(Core *core, bool cpu): core(core), cpu(cpu) {}
 
+        void saveState(FILE *file);
+        void loadState(FILE *file);
+
         void tick(int cycles);
 
         bool shouldTick() { return enabled; }
@@ -280,3 +280,63 @@ uint16_t Wifi::readWRxbufRdData()
 
     return value;
 }
+
+void Wifi::saveState(FILE *file)
+{
+    // Write the state to a file
+    fwrite(bbRegisters, sizeof(bbRegisters), 1, file);
+    fwrite(&wModeWep, sizeof(wModeWep), 1, file);
+    fwrite(&wIrf, sizeof(wIrf), 1, file);
+    fwrite(&wIe, sizeof(wIe), 1, file);
+    fwrite(wMacaddr, sizeof(wMacaddr), 1, file);
+    fwrite(wBssid, sizeof(wBssid), 1, file);
+    fwrite(&wAidFull, sizeof(wAidFull), 1, file);
+    fwrite(&wPowerstate, sizeof(wPowerstate), 1, file);
+    fwrite(&wPowerforce, sizeof(wPowerforce), 1, file);
+    fwrite(&wRxbufBegin, sizeof(wRxbufBegin), 1, file);
+    fwrite(&wRxbufEnd, sizeof(wRxbufEnd), 1, file);
+    fwrite(&wRxbufWrAddr, sizeof(wRxbufWrAddr), 1, file);
+    fwrite(&wRxbufRdAddr, sizeof(wRxbufRdAddr), 1, file);
+    fwrite(&wRxbufReadcsr, sizeof(wRxbufReadcsr), 1, file);
+    fwrite(&wRxbufGap, sizeof(wRxbufGap), 1, file);
+    fwrite(&wRxbufGapdisp, sizeof(wRxbufGapdisp), 1, file);
+    fwrite(&wRxbufCount, sizeof(wRxbufCount), 1, file);
+    fwrite(&wTxbufWrAddr, sizeof(wTxbufWrAddr), 1, file);
+    fwrite(&wTxbufCount, sizeof(wTxbufCount), 1, file);
+    fwrite(&wTxbufGap, sizeof(wTxbufGap), 1, file);
+    fwrite(&wTxbufGapdisp, sizeof(wTxbufGapdisp), 1, file);
+    fwrite(&wBeaconcount2, sizeof(wBeaconcount2), 1, file);
+    fwrite(&wBbWrite, sizeof(wBbWrite), 1, file);
+    fwrite(&wBbRead, sizeof(wBbRead), 1, file);
+    fwrite(wConfig, sizeof(wConfig), 1, file);
+}
+
+void Wifi::loadState(FILE *file)
+{
+    // Read the state from a file
+    fread(bbRegisters, sizeof(bbRegisters), 1, file);
+    fread(&wModeWep, sizeof(wModeWep), 1, file);
+    fread(&wIrf, sizeof(wIrf), 1, file);
+    fread(&wIe, sizeof(wIe), 1, file);
+    fread(wMacaddr, sizeof(wMacaddr), 1, file);
+    fread(wBssid, sizeof(wBssid), 1, file);
+    fread(&wAidFull, sizeof(wAidFull), 1, file);
+    fread(&wPowerstate, sizeof(wPowerstate), 1, file);
+    fread(&wPowerforce, sizeof(wPowerforce), 1, file);
+    fread(&wRxbufBegin, sizeof(wRxbufBegin), 1, file);
+    fread(&wRxbufEnd, sizeof(wRxbufEnd), 1, file);
+    fread(&wRxbufWrAddr, sizeof(wRxbufWrAddr), 1, file);
+    fread(&wRxbufRdAddr, sizeof(wRxbufRdAddr), 1, file);
+    fread(&wRxbufReadcsr, sizeof(wRxbufReadcsr), 1, file);
+    fread(&wRxbufGap, sizeof(wRxbufGap), 1, file);
+    fread(&wRxbufGapdisp, sizeof(wRxbufGapdisp), 1, file);
+    fread(&wRxbufCount, sizeof(wRxbufCount), 1, file);
+    fread(&wTxbufWrAddr, sizeof(wTxbufWrAddr), 1, file);
+    fread(&wTxbufCount, sizeof(wTxbufCount), 1, file);
+    fread(&wTxbufGap, sizeof(wTxbufGap), 1, file);
+    fread(&wTxbufGapdisp, sizeof(wTxbufGapdisp), 1, file);
+    fread(&wBeaconcount2, sizeof(wBeaconcount2), 1, file);
+    fread(&wBbWrite, sizeof(wBbWrite), 1, file);
+    fread(&wBbRead, sizeof(wBbRead), 1, file);
+    fread(wConfig, sizeof(wConfig), 1, file);
+}
@@ -21,6 +21,7 @@
 #define WIFI_H
 
 #include <cstdint>
+#include <cstdio>
 
 class Core;
 
@@ -29,6 +30,9 @@ class Wifi
     public:
         Wifi(Core *core);
 
+        void saveState(FILE *file);
+        void loadState(FILE *file);
+
         uint16_t readWModeWep()          { return wModeWep;        }
         uint16_t readWIrf()              { return wIrf;            }
         uint16_t readWIe()               { return wIe;             }